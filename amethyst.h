@@ -91,64 +91,102 @@ struct pdf_xref
 enum pdf_objtype
 {
 	PDF_OBJ_ARR,
+	PDF_OBJ_BOOL,
 	PDF_OBJ_DICT,
 	PDF_OBJ_HEX,
 	PDF_OBJ_INT,
 	PDF_OBJ_NAME,
+	PDF_OBJ_NULL,
+	PDF_OBJ_REAL,
 	PDF_OBJ_REF,
 	PDF_OBJ_STR,
 };
 
+/*
+ * Every member of the pdf_obj union begins with the object's type, so
+ * that the type shares the first word with the 32-bit length and an
+ * object packs into 16 bytes.  Scalars and refs are held inline; array and
+ * dict entries live in contiguous blocks owned by the document.
+ */
 struct pdf_obj;
 struct pdf_obj_arr
 {
+	enum pdf_objtype type;
+	unsigned sz;
 	struct pdf_obj *entries;
-	size_t sz;
 };
 
 struct pdf_dict_entry;
 struct pdf_obj_dict
 {
+	enum pdf_objtype type;
+	unsigned sz;
 	struct pdf_dict_entry *entries;
-	size_t sz;
 };
 
+/*
+ * Hex strings, names and literal strings point into the document's memory
+ * (val is not NUL-terminated) and hold their source bytes: hex digits,
+ * #xx escapes and backslash escapes are left as written.  pdf_obj_decode
+ * returns the value they denote.
+ */
 struct pdf_obj_hex
 {
-	char *val;
-	size_t sz;
+	enum pdf_objtype type;
+	unsigned len;
+	const char *val;
+};
+
+struct pdf_obj_bool
+{
+	enum pdf_objtype type;
+	int val;
 };
 
 struct pdf_obj_int
 {
+	enum pdf_objtype type;
 	int val;
 };
 
 struct pdf_obj_name
 {
-	char *val;
+	enum pdf_objtype type;
+	unsigned len;
+	const char *val;
+};
+
+struct pdf_obj_real
+{
+	enum pdf_objtype type;
+	double val;
 };
 
 struct pdf_obj_ref
 {
+	enum pdf_objtype type;
 	struct pdf_objid id;
 };
 
 struct pdf_obj_str
 {
-	char *val;
+	enum pdf_objtype type;
+	unsigned len;
+	const char *val;
 };
 
 struct pdf_obj
 {
-	enum pdf_objtype type;
 	union
 	{
+		enum pdf_objtype type;
 		struct pdf_obj_arr arr;
+		struct pdf_obj_bool boolean;
 		struct pdf_obj_dict dict;
 		struct pdf_obj_int intg;
 		struct pdf_obj_hex hex;
 		struct pdf_obj_name name;
+		struct pdf_obj_real real;
 		struct pdf_obj_ref ref;
 		struct pdf_obj_str str;
 	};
@@ -161,36 +199,336 @@ enum pdf_stream_type
 	PDF_STREAM_UNKNOWN,
 };
 
+/*
+ * stream is NUL-terminated, stream_sz excludes the NUL.  FlateDecode
+ * (with PDF_ZLIB), LZWDecode, RunLengthDecode, ASCIIHexDecode and
+ * ASCII85Decode filters are undone on load, after the data of an
+ * encrypted document is decrypted; PDF_STREAM_JPEG streams are left
+ * encoded, see pdf_decode_dct.
+ * raw_off and raw_sz locate the encoded stream data in the document
+ * (raw_off is 0 for objects without a stream).
+ */
 struct pdf_baseobj
 {
 	struct pdf_obj obj;
 	enum pdf_stream_type stream_type;
 	char *stream;
+	size_t stream_sz;
+	size_t raw_off, raw_sz;
+};
+
+#ifndef PDF_FILTER_MAX
+#define PDF_FILTER_MAX 8
+#endif
+
+/* Undecoded stream data, with its filters in the order they apply */
+struct pdf_stream_view
+{
+	const char *data;
+	size_t sz;
+	struct pdf_obj_name filters[PDF_FILTER_MAX];
+	int filter_cnt;
 };
 
 struct pdf_dict_entry
 {
-	char *name;
+	const char *name;
+	size_t name_len;
 	struct pdf_obj obj;
 };
 
+struct pdf_obj_share_stats
+{
+	size_t hits, misses;
+	size_t bytes;
+};
+
+enum pdf_walk_event
+{
+	PDF_WALK_ARR_BEGIN,
+	PDF_WALK_ARR_END,
+	PDF_WALK_DICT_BEGIN,
+	PDF_WALK_DICT_END,
+	PDF_WALK_KEY,
+	PDF_WALK_VALUE,
+};
+
+#define PDF_WALK_SKIP (-1)
+
+typedef int (*pdf_walk_fn)(void *udata, enum pdf_walk_event event,
+                           const struct pdf_obj *obj);
+
 /*
  * PDF public functions
+ *
+ * The document is parsed from memory: pdf_init_from_file maps the file
+ * where mmap is available, pdf_init_from_stream reads the stream in whole
+ * (and closes it) and pdf_init_from_memory borrows the caller's buffer,
+ * which must outlive the pdf.
+ *
+ * Documents encrypted with the Standard security handler (RC4 or AES,
+ * revisions 2 to 6) are opened with the empty user password, which is
+ * all a document restricted only by an owner password needs.  Strings
+ * are decrypted as objects are parsed and stream data as it is loaded.
+ * AES uses the AES-NI instructions on CPUs that have them, detected at
+ * run time on x86 with GCC or clang, and lookup tables otherwise.
+ *
+ * pdf_get_stream_view points into that memory without decoding or
+ * copying anything, so the original bytes (e.g. a DCTDecode JPEG) can be
+ * passed through.  An encrypted stream's view is a decrypted copy, with
+ * its other filters still applied.  The view is valid until pdf_free.
+ *
+ * pdf_prefetch hints that a set of objects is about to be read, so later
+ * lookups do not fault on each one in turn.  Only mapped files need it;
+ * PDF_PREFETCH_GAP sets how far apart objects may be and still be paged
+ * in together.
+ *
+ * pdf_load_objects loads a set of objects as pdf_get_baseobj would, but
+ * reads them from the file in large batches.  Ids not in the xref are
+ * skipped, and the memory read is kept until pdf_free.  PDF_IO_CHUNK and
+ * PDF_IO_QUEUE_DEPTH size the reads; define PDF_NO_IO_URING to read with
+ * pread only.
+ *
+ * pdf_load_all loads every object in the xref, on nthreads threads when
+ * PDF_THREADS is defined (link with -pthread) and serially otherwise.
+ *
+ * pdf_obj_share makes objects parsed afterwards share identical small
+ * arrays and dicts (up to PDF_SHARE_MAX entries, nested ones included):
+ * each is hashed when complete and an identical block already parsed is
+ * used in place of a new copy.  Shared objects must be treated as
+ * read-only, which they are everywhere in this library.  pdf_load_all
+ * threads only share among the objects each of them parses.
+ * pdf_obj_share_stats reports the blocks found and stored and the bytes
+ * saved.
+ *
+ * pdf_walk_obj reads an object straight from the document and reports it
+ * to fn as events, without building any pdf_obj tree or consulting the
+ * object cache.  A dict entry is reported as a PDF_WALK_KEY event, with
+ * obj holding the key name, followed by the events for its value.  A
+ * scalar is reported as a PDF_WALK_VALUE event, and the begin and end
+ * events have a NULL obj.  fn can return PDF_WALK_SKIP from a begin event
+ * to pass over the rest of that array or dict, or from a key event to
+ * pass over that entry's value.  Skipped values are only lexed, so long
+ * arrays such as Kids or Widths cost no allocations.  Any other nonzero
+ * return stops the walk, and pdf_walk_obj returns that value.  A stream
+ * object's data is not walked.
+ *
+ * pdf_name_eq compares a name's source bytes with str.  pdf_obj_decode
+ * returns the value of a string, hex string or name with its escapes
+ * undone, NUL-terminated and allocated with PDF_MALLOC.
  */
 
 AMFDEF int pdf_init_from_file(struct pdf *pdf, const char *fname);
 AMFDEF int pdf_init_from_stream(struct pdf *pdf, FILE *stream);
+AMFDEF int pdf_init_from_memory(struct pdf *pdf, const void *data,
+                                size_t sz);
 AMFDEF struct pdf_baseobj *pdf_get_baseobj(struct pdf *pdf, struct pdf_objid id);
+AMFDEF void pdf_prefetch(struct pdf *pdf, const struct pdf_objid *ids,
+                         size_t n);
+AMFDEF int pdf_load_objects(struct pdf *pdf, const struct pdf_objid *ids,
+                            size_t n);
+AMFDEF int pdf_load_all(struct pdf *pdf, int nthreads);
+AMFDEF void pdf_obj_share(struct pdf *pdf, int enable);
+AMFDEF int pdf_walk_obj(struct pdf *pdf, struct pdf_objid id,
+                        pdf_walk_fn fn, void *udata);
+AMFDEF void pdf_obj_share_stats(struct pdf *pdf,
+                                struct pdf_obj_share_stats *stats);
+AMFDEF int pdf_get_stream_view(struct pdf *pdf, struct pdf_objid id,
+                               struct pdf_stream_view *view);
 AMFDEF int pdf_page_cnt(struct pdf *pdf);
 AMFDEF struct pdf_obj *pdf_get_page(struct pdf *pdf, int page);
 AMFDEF int pdf_get_page_bounds(struct pdf *pdf, int page, int bounds[4]);
 AMFDEF struct pdf_obj* pdf_dict_find(struct pdf_obj_dict *dict,
                                      const char *name);
+AMFDEF int pdf_name_eq(const struct pdf_obj_name *name, const char *str);
+AMFDEF char *pdf_obj_decode(const struct pdf_obj *obj, size_t *sz);
 AMFDEF struct pdf_obj *pdf_dict_find_deref(struct pdf *pdf,
                                            struct pdf_obj_dict *dict,
                                            const char *name);
 AMFDEF void pdf_free(struct pdf *pdf);
 
+/*
+ * DCT (JPEG) decoding
+ *
+ * Decodes with libjpeg's DCT-domain scaling, using the smallest of 1/8,
+ * 1/4 and 1/2 that keeps the image at least max_width x max_height (a 0
+ * leaves that axis unconstrained, both 0 decode at full size).  With
+ * header_only set, desc is filled in without decoding any pixels.
+ * Otherwise *pixels is allocated with PDF_MALLOC and owned by the caller.
+ * opts may be NULL for a full decode.  Requires PDF_JPEG.
+ *
+ * pdf_decode_dct_strips instead hands the rows to fn in strips of up to
+ * PDF_DCT_STRIP_ROWS, starting at row y, so only one strip is held in
+ * memory.  A nonzero return from fn stops the decode, which then returns
+ * that value.
+ *
+ * fmt converts the output as each strip is decoded (PDF_PIXEL_NATIVE
+ * keeps libjpeg's output).  CMYK output is never inverted: Adobe's
+ * inverted CMYK and decode_inverted, for a /Decode of [1 0 ...], are
+ * undone.  pdf_decode_image and pdf_decode_image_strips take these from
+ * the image dict's /Decode, check /ColorSpace against the JPEG and decode
+ * straight from the document's memory.
+ */
+
+#ifndef PDF_DCT_STRIP_ROWS
+#define PDF_DCT_STRIP_ROWS 16
+#endif
+
+enum pdf_pixel_fmt
+{
+	PDF_PIXEL_NATIVE,
+	PDF_PIXEL_GRAY,
+	PDF_PIXEL_RGB,
+	PDF_PIXEL_CMYK,
+};
+
+struct pdf_dct_opts
+{
+	int max_width, max_height;
+	int header_only;
+	enum pdf_pixel_fmt fmt;
+	int decode_inverted;
+};
+
+struct pdf_image_desc
+{
+	int width, height, components;
+	size_t stride;
+};
+
+typedef int (*pdf_dct_strip_fn)(void *udata,
+                                const struct pdf_image_desc *desc, int y,
+                                const unsigned char *rows, int row_cnt);
+
+AMFDEF int pdf_decode_dct(const char *data, size_t sz,
+                          const struct pdf_dct_opts *opts,
+                          struct pdf_image_desc *desc,
+                          unsigned char **pixels);
+AMFDEF int pdf_decode_dct_strips(const char *data, size_t sz,
+                                 const struct pdf_dct_opts *opts,
+                                 struct pdf_image_desc *desc,
+                                 pdf_dct_strip_fn fn, void *udata);
+AMFDEF int pdf_decode_image(struct pdf *pdf, struct pdf_objid id,
+                            const struct pdf_dct_opts *opts,
+                            struct pdf_image_desc *desc,
+                            unsigned char **pixels);
+AMFDEF int pdf_decode_image_strips(struct pdf *pdf, struct pdf_objid id,
+                                   const struct pdf_dct_opts *opts,
+                                   struct pdf_image_desc *desc,
+                                   pdf_dct_strip_fn fn, void *udata);
+
+/*
+ * Converts cnt pixels.  invert means the source stores 255 - v.  Any
+ * format converts to gray or RGB, and CMYK to CMYK.
+ */
+AMFDEF int pdf_convert_pixels(const unsigned char *src,
+                              enum pdf_pixel_fmt src_fmt, int invert,
+                              unsigned char *dst,
+                              enum pdf_pixel_fmt dst_fmt, size_t cnt);
+
+/*
+ * Decoded image cache
+ *
+ * pdf_image_acquire decodes an image XObject through pdf_decode_image
+ * once per document for each (id, max_width, max_height, fmt), and hands
+ * out references to the shared raster afterwards.  Released images stay
+ * cached for later pages until pdf_image_cache_trim or pdf_free.
+ */
+
+struct pdf_image
+{
+	struct pdf_objid id;
+	int max_width, max_height;
+	enum pdf_pixel_fmt fmt;
+	struct pdf_image_desc desc;
+	unsigned char *pixels;
+	int refs;
+};
+
+struct pdf_image_cache_stats
+{
+	size_t hits, misses;
+	size_t images, bytes;
+};
+
+AMFDEF struct pdf_image *pdf_image_acquire(struct pdf *pdf,
+                                           struct pdf_objid id,
+                                           const struct pdf_dct_opts *opts);
+AMFDEF void pdf_image_release(struct pdf *pdf, struct pdf_image *image);
+AMFDEF void pdf_image_cache_trim(struct pdf *pdf);
+AMFDEF void pdf_image_cache_stats(struct pdf *pdf,
+                                  struct pdf_image_cache_stats *stats);
+
+/*
+ * Resolved resources
+ *
+ * A resource dict with every category's entries dereferenced.  Pages
+ * inherit Resources from their ancestors, and forms without their own
+ * use the resources they are drawn with.  Resolved dicts are cached by
+ * identity, so pages that share a Resources object share the result.
+ * id is only set for entries that were references (baseobj != NULL).
+ */
+
+enum pdf_res_type
+{
+	PDF_RES_COLOR_SPACE,
+	PDF_RES_EXT_GSTATE,
+	PDF_RES_FONT,
+	PDF_RES_PATTERN,
+	PDF_RES_PROPERTIES,
+	PDF_RES_SHADING,
+	PDF_RES_XOBJECT,
+	PDF_RES_CNT,
+};
+
+struct pdf_res_entry
+{
+	const char *name;
+	size_t name_len;
+	struct pdf_obj *obj;
+	struct pdf_baseobj *baseobj;
+	struct pdf_objid id;
+};
+
+struct pdf_resources
+{
+	struct pdf_obj_dict *dict;
+	struct pdf_res_entry *entries[PDF_RES_CNT];
+	size_t entry_cnt[PDF_RES_CNT];
+};
+
+AMFDEF struct pdf_resources *pdf_get_page_resources(struct pdf *pdf,
+                                                    int page_idx);
+AMFDEF struct pdf_resources *pdf_get_form_resources(struct pdf *pdf,
+                                                    struct pdf_baseobj *form,
+                                                    struct pdf_resources *parent);
+AMFDEF struct pdf_res_entry *pdf_res_find(struct pdf_resources *res,
+                                          enum pdf_res_type type,
+                                          const char *name);
+
+/*
+ * Page triage
+ *
+ * A fast scan of a page's content for routing.  bbox is the painted
+ * extent in default user space (all 0 if nothing was painted): paths and
+ * images contribute their extents, while text only sets its flag since
+ * glyph extents need font metrics.  Form XObject results are memoized
+ * per document.
+ */
+
+#define PDF_TRIAGE_TEXT   1
+#define PDF_TRIAGE_VECTOR 2
+#define PDF_TRIAGE_IMAGE  4
+
+struct pdf_triage
+{
+	float bbox[4];
+	int flags;
+};
+
+AMFDEF int pdf_page_triage(struct pdf *pdf, int page_idx,
+                           struct pdf_triage *triage);
+
 /*
  * PostScript data types
  */
@@ -200,46 +538,151 @@ AMFDEF void pdf_free(struct pdf *pdf);
 #define PS_META_CMD 1
 #define PS_END      2
 
+/* At most 64 commands, so that a mask of them fits in 64 bits */
 enum ps_cmd_type
 {
+	PS_CMD_BEGIN_MARK,
+	PS_CMD_BEGIN_TEXT,
+	PS_CMD_CHAR_SPACING,
+	PS_CMD_CLIP,
+	PS_CMD_CLIP_EVEN_ODD,
+	PS_CMD_CLOSE_FILL_STROKE,
+	PS_CMD_CLOSE_FILL_STROKE_EVEN_ODD,
+	PS_CMD_CLOSE_PATH,
+	PS_CMD_CLOSE_STROKE,
+	PS_CMD_CURVE_TO,
+	PS_CMD_CURVE_TO_V,
+	PS_CMD_CURVE_TO_Y,
 	PS_CMD_DASH,
+	PS_CMD_END_MARK,
+	PS_CMD_END_PATH,
+	PS_CMD_END_TEXT,
+	PS_CMD_EXT_GSTATE,
 	PS_CMD_FILL,
 	PS_CMD_FILL_CMYK,
+	PS_CMD_FILL_COLOR,
+	PS_CMD_FILL_COLOR_SPACE,
+	PS_CMD_FILL_EVEN_ODD,
 	PS_CMD_FILL_GRAY,
+	PS_CMD_FILL_RGB,
+	PS_CMD_FILL_STROKE,
+	PS_CMD_FILL_STROKE_EVEN_ODD,
+	PS_CMD_FLATNESS,
+	PS_CMD_GLYPH_WIDTH,
+	PS_CMD_HORIZ_SCALING,
+	PS_CMD_INLINE_IMAGE,
+	PS_CMD_LEADING,
+	PS_CMD_LINE_CAP,
+	PS_CMD_LINE_JOIN,
 	PS_CMD_LINE_TO,
 	PS_CMD_LINE_WIDTH,
+	PS_CMD_MARK,
+	PS_CMD_MITER_LIMIT,
 	PS_CMD_MOVE_TEXT,
+	PS_CMD_MOVE_TEXT_LEADING,
 	PS_CMD_MOVE_TO,
+	PS_CMD_NEXT_LINE,
+	PS_CMD_NEXT_LINE_SHOW_TEXT,
+	PS_CMD_NEXT_LINE_SHOW_TEXT_SPACED,
 	PS_CMD_OBJ,
 	PS_CMD_RECTANGLE,
+	PS_CMD_RENDERING_INTENT,
 	PS_CMD_RESTORE_STATE,
 	PS_CMD_SAVE_STATE,
 	PS_CMD_SET_FONT,
+	PS_CMD_SHADING,
 	PS_CMD_SHOW_TEXT,
+	PS_CMD_SHOW_TEXT_ARR,
 	PS_CMD_STROKE,
 	PS_CMD_STROKE_CMYK,
+	PS_CMD_STROKE_COLOR,
+	PS_CMD_STROKE_COLOR_SPACE,
 	PS_CMD_STROKE_GRAY,
+	PS_CMD_STROKE_RGB,
+	PS_CMD_TEXT_MATRIX,
+	PS_CMD_TEXT_RENDER,
+	PS_CMD_TEXT_RISE,
 	PS_CMD_TRANSFORM,
+	PS_CMD_WORD_SPACING,
 };
 
 #ifndef PS_DASH_SZ
 #define PS_DASH_SZ 5
 #endif
 
+#ifndef PS_COLOR_SZ
+#define PS_COLOR_SZ 8
+#endif
+
+/*
+ * Masks of enum ps_cmd_type values.  Commands outside the mask given to
+ * ps_init_filtered are skipped without converting their operands.
+ * Defining PS_CMD_BUILD_MASK restricts the commands compiled in at all,
+ * e.g. -DPS_CMD_BUILD_MASK='(PS_CMD_BIT(PS_CMD_SET_FONT) | ...)' for a
+ * text-only build.
+ */
+#define PS_CMD_BIT(type) (1ull << (type))
+#define PS_CMD_ALL       (~0ull)
+
+#ifndef PS_CMD_BUILD_MASK
+#define PS_CMD_BUILD_MASK PS_CMD_ALL
+#endif
+
+/* Element of a TJ array: a string (str != NULL) or a position adjustment */
+struct ps_text_elem
+{
+	const char *str;
+	size_t len;
+	int hex;
+	float adjust;
+};
+
+/*
+ * Curves set every point except for CURVE_TO_V (no x1, y1) and
+ * CURVE_TO_Y (no x2, y2).  TEXT_MATRIX uses transform, MOVE_TEXT_LEADING
+ * uses pos and NEXT_LINE_SHOW_TEXT uses show_text.  Strings are left
+ * undecoded (hex digits or escapes) and len excludes the delimiters;
+ * ps_text_extract decodes them.
+ */
 struct ps_cmd
 {
 	enum ps_cmd_type type;
 	union
 	{
 		struct { float c, m, y, k; }           cmyk;
+		struct { float val[PS_COLOR_SZ];
+		         int sz;
+		         const char *pattern; }        color;
+		struct { float x1, y1, x2, y2,
+		               x3, y3; }               curve;
 		struct { int arr[PS_DASH_SZ], phase; } dash;
+		struct { float wx, wy, llx, lly,
+		               urx, ury;
+		         int bbox; }                   glyph_width;
 		struct { float val; }                  gray;
+		struct { const char *data;
+		         size_t sz;
+		         int width, height; }          inline_image;
+		struct { int val; }                    intg;
 		struct { float val; }                  line_width;
+		struct { const char *tag, *props; }    mark;
+		struct { const char *val; }            name;
 		struct { const char *name; }           obj;
 		struct { float x, y; }                 pos;
+		struct { float val; }                  real;
 		struct { float x, y, width, height; }  rectangle;
-		struct { const char *font; int sz; }   set_font;
-		struct { const char *str; }            show_text;
+		struct { float r, g, b; }              rgb;
+		struct { const char *font; float sz; } set_font;
+		struct { const char *str;
+		         size_t len;
+		         int hex; }                    show_text;
+		struct { const struct ps_text_elem *elems;
+		         size_t sz; }                  show_text_arr;
+		struct { float word_spacing,
+		               char_spacing;
+		         const char *str;
+		         size_t len;
+		         int hex; }                    spaced_text;
 		struct { float a, b, c, d, e, f; }     transform;
 	};
 };
@@ -250,15 +693,27 @@ struct ps__arg;
 struct ps__arg_arr
 {
 	struct ps__arg *entries;
-	size_t sz;
+	size_t sz, cap;
 	struct ps__arg_arr* parent;
 };
 
+/* One part of a content stream split across several stream objects */
+struct ps_segment
+{
+	char *str;
+	size_t sz;
+};
+
 struct ps_ctx
 {
 	struct ps__arg_arr args;
-	char *stream;
-	int (*next_cmd)(struct ps_ctx *ctx, struct ps_cmd *cmd);
+	char *stream, *end;
+	const struct ps_segment *segs;
+	size_t seg_cnt;
+	unsigned long long cmd_mask;
+	int compat;
+	struct ps_text_elem *text_elems;
+	size_t text_elems_cap;
 };
 
 /*
@@ -266,12 +721,157 @@ struct ps_ctx
  *
  * For perfomance reasons, the parser modifies the postscript command
  * string. However, it will restore the original string after commands
- * are processed.
+ * are processed.  The string must be NUL-terminated; ps_init_ex takes
+ * its length (excluding the NUL) so that binary inline image data can
+ * be skipped.
+ *
+ * ps_init_chain reads cnt segments as one stream, as for a page whose
+ * Contents is an array.  Nothing is copied: the lexer moves on to the
+ * next segment where it would skip whitespace, since the parts may only
+ * be split between tokens.  An operator's operands may therefore sit in
+ * earlier segments.  Each segment must be NUL-terminated like a single
+ * string, and segs must outlive the ctx.
  */
 
 AMFDEF void ps_init(struct ps_ctx *ctx, char *str);
+AMFDEF void ps_init_filtered(struct ps_ctx *ctx, char *str,
+                             unsigned long long cmd_mask);
+AMFDEF void ps_init_ex(struct ps_ctx *ctx, char *str, size_t sz,
+                       unsigned long long cmd_mask);
+AMFDEF void ps_init_chain(struct ps_ctx *ctx, const struct ps_segment *segs,
+                          size_t cnt, unsigned long long cmd_mask);
 AMFDEF int ps_exec(struct ps_ctx *ctx, struct ps_cmd *cmd);
 
+/*
+ * Graphics state data types
+ */
+
+#define PS_PATH 3
+
+#ifndef PS_GSTATE_DEPTH
+#define PS_GSTATE_DEPTH 32
+#endif
+
+struct ps_color
+{
+	float val[PS_COLOR_SZ];
+	int sz;
+};
+
+struct ps_gstate
+{
+	float ctm[6];
+	float line_width;
+	struct ps_color fill, stroke;
+	int dash[PS_DASH_SZ], dash_phase;
+};
+
+enum ps_path_verb
+{
+	PS_PATH_CLOSE,
+	PS_PATH_CURVE_TO,
+	PS_PATH_LINE_TO,
+	PS_PATH_MOVE_TO,
+};
+
+/*
+ * A painted path in device space.  Curves consume 3 points, move/line
+ * 1 point and close none.  paint is the painting command (END_PATH for
+ * a path that is only used to clip) and clip is PS_CMD_CLIP or
+ * PS_CMD_CLIP_EVEN_ODD if the path also clips, -1 otherwise.
+ */
+struct ps_path
+{
+	const unsigned char *verbs;
+	size_t verb_cnt;
+	const float *pts;
+	size_t pt_cnt;
+	enum ps_cmd_type paint;
+	int clip;
+};
+
+struct ps_gs
+{
+	struct ps_ctx ctx;
+	struct ps_gstate stack[PS_GSTATE_DEPTH];
+	int depth;
+	unsigned long long cmd_mask;
+	unsigned char *verbs;
+	size_t verb_cnt, verb_cap;
+	float *pts;
+	size_t pt_cnt, pt_cap;
+	float cur[2], start[2];
+	int clip;
+};
+
+/*
+ * Graphics state public functions
+ *
+ * ps_gs_exec runs the content stream through ps_exec, consuming the
+ * graphics state and path construction commands.  It returns PS_PATH
+ * with a device-space path when one is painted, or PS_OK with any other
+ * command in cmd_mask.  The current state is gs->stack[gs->depth].
+ * ctm may be NULL for the identity.  ps_gs_init_chain takes the stream
+ * in segments, as ps_init_chain does.
+ */
+
+AMFDEF void ps_gs_init(struct ps_gs *gs, char *str, size_t sz,
+                       const float ctm[6], unsigned long long cmd_mask);
+AMFDEF void ps_gs_init_chain(struct ps_gs *gs, const struct ps_segment *segs,
+                             size_t cnt, const float ctm[6],
+                             unsigned long long cmd_mask);
+AMFDEF int ps_gs_exec(struct ps_gs *gs, struct ps_cmd *cmd,
+                      struct ps_path *path);
+AMFDEF void ps_gs_free(struct ps_gs *gs);
+AMFDEF void ps_transform_pts(const float m[6], const float *src,
+                             float *dst, size_t cnt);
+AMFDEF void ps_mat_mul(const float a[6], const float b[6], float out[6]);
+
+/*
+ * Text extraction
+ *
+ * ps_text_extract collects the strings shown by a content stream as runs.
+ * Run text is the decoded string bytes, still in the font's encoding, and
+ * a TJ array becomes one run with a space inserted wherever an adjustment
+ * moves right by at least PS_TEXT_SPACE_ADJUST thousandths of an em.  trm
+ * is the text rendering matrix at the start of the run: its translation
+ * is the device-space origin and its scale includes the font size.
+ * Glyph widths are not known, so runs shown without repositioning share
+ * an origin.  font and text are offsets into data.
+ *
+ * The text bytes fill data from the front and the runs follow the text
+ * bound, which is known before parsing, so a page costs at most one
+ * allocation and none once buf has grown to fit.  ctm may be NULL for
+ * the identity.  ps_text_extract_chain takes the stream in segments, as
+ * ps_init_chain does.
+ */
+
+#ifndef PS_TEXT_SPACE_ADJUST
+#define PS_TEXT_SPACE_ADJUST 250
+#endif
+
+struct ps_text_run
+{
+	float trm[6];
+	size_t font, font_len;
+	size_t text, text_len;
+};
+
+struct ps_text_buf
+{
+	char *data;
+	size_t cap, text_sz;
+	struct ps_text_run *runs;
+	size_t run_cnt;
+};
+
+AMFDEF int ps_text_extract(struct ps_text_buf *buf, char *str, size_t sz,
+                           const float ctm[6]);
+AMFDEF int ps_text_extract_chain(struct ps_text_buf *buf,
+                                 const struct ps_segment *segs, size_t cnt,
+                                 const float ctm[6]);
+AMFDEF void ps_text_buf_free(struct ps_text_buf *buf);
+
 #ifdef __cplusplus
 }
 #endif
@@ -282,15 +882,52 @@ AMFDEF int ps_exec(struct ps_ctx *ctx, struct ps_cmd *cmd);
 
 #include <assert.h>
 #include <ctype.h>
+#include <float.h>
 #include <stdlib.h>
 #include <string.h>
+#if !defined(PDF_NO_MMAP) && (defined(__unix__) || defined(__APPLE__))
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define PDF__MMAP
+#if defined(__linux__) && !defined(PDF_NO_IO_URING)
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#ifdef __NR_io_uring_setup
+#define PDF__IO_URING
+#endif
+#endif
+#endif
 #ifdef PDF_ZLIB
 #include <zlib.h>
 #endif
+#ifdef PDF_THREADS
+#include <pthread.h>
+#endif
 #ifdef PDF_JPEG
 #include <jpeglib.h>
 #include <setjmp.h>
 #endif
+#ifndef PDF_NO_SIMD
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define PDF__SSE2
+/* AES-NI is used where the CPU has it, or always when built with -maes */
+#if defined(__AES__)
+#include <wmmintrin.h>
+#define PDF__AESNI
+#define PDF__AESNI_CPU 1
+#define PDF__AESNI_FN
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <wmmintrin.h>
+#define PDF__AESNI
+#define PDF__AESNI_CPU __builtin_cpu_supports("aes")
+#define PDF__AESNI_FN __attribute__((target("aes,sse2")))
+#endif
+#endif
+#endif
 
 #define PDF_ERR(code, ...) { PDF_LOG(__VA_ARGS__); return code; }
 #define PDF_ERRIF(cond, code, ...) \
@@ -300,83 +937,379 @@ AMFDEF int ps_exec(struct ps_ctx *ctx, struct ps_cmd *cmd);
  * PDF parser implementation
  */
 
+struct pdf__triage_memo
+{
+	struct pdf_objid id;
+	int busy;
+	struct pdf_triage triage;
+};
+
+enum pdf__mem_type
+{
+	PDF__MEM_BORROWED,
+	PDF__MEM_HEAP,
+	PDF__MEM_MAPPED,
+};
+
 #define PDF_BUF_SZ 256
+
+#ifndef PDF_ARENA_BLOCK
+#define PDF_ARENA_BLOCK (64 * 1024)
+#endif
+
+/* Backs array and dict entries and base objects until pdf_free */
+struct pdf__arena
+{
+	struct pdf__arena *next;
+	size_t used, cap;
+};
+
+typedef char pdf__obj_sz_check[sizeof(struct pdf_obj) <= 16 ? 1 : -1];
+
+/* A canonical entries block for pdf_obj_share */
+struct pdf__shared
+{
+	void *entries;
+	unsigned hash;
+	unsigned short sz;
+	unsigned char type;
+};
 struct pdf__ctx
 {
 	char buf[PDF_BUF_SZ];
 	size_t ln_sz; // TODO(rgriege): remove me - not worth possible mismatch
-	FILE *fp;
-	int ints[3], int_cnt;
+	const char *mem, *pos, *end;
+	/* file offset of mem[0], set while parsing from a read buffer */
+	size_t mem_off;
+	enum pdf__mem_type mem_type;
+	int tok_int;
+	double tok_real;
+	struct pdf_objid tok_ref;
+	struct pdf__triage_memo *triage_memo;
+	size_t triage_memo_sz;
+	struct pdf_image **images;
+	size_t image_cnt, image_cap;
+	size_t image_hits, image_misses;
+	struct pdf_resources **resources;
+	size_t resources_cnt, resources_cap;
+	int fd;
+	size_t main_xref;
+	struct pdf_objid linear_page;
+	int linear_page_cnt;
+	struct pdf__arena *arena;
+	struct pdf_obj *arr_stack;
+	size_t arr_stack_sz, arr_stack_cap;
+	struct pdf_dict_entry *dict_stack;
+	size_t dict_stack_sz, dict_stack_cap;
+	int share;
+	struct pdf__shared *shared;
+	size_t shared_cnt, shared_cap;
+	size_t share_hits, share_misses, share_bytes;
+	struct pdf__crypt *crypt;
+	/* strings are decrypted while crypt_strs is set, for object crypt_id */
+	struct pdf_objid crypt_id;
+	int crypt_strs;
 };
 
-static size_t pdf__getdelim(char buf[], size_t n, int delim, FILE *fp)
+static void *pdf__arena_alloc(struct pdf__ctx *ctx, size_t sz)
 {
-	size_t i = 0;
-	int c;
+	struct pdf__arena *arena = ctx->arena;
+	char *p;
 
-	while (i < n)
-	{
-		c = fgetc(fp);
-		if (c == EOF || c == delim)
-			break;
-		buf[i++] = c;
+	sz = (sz + 7) & ~(size_t)7;
+	if (!arena || arena->cap - arena->used < sz) {
+		size_t cap = sz > PDF_ARENA_BLOCK / 4 ? sz : PDF_ARENA_BLOCK;
+		arena = PDF_MALLOC(sizeof(struct pdf__arena) + cap);
+		arena->used = 0;
+		arena->cap = cap;
+		/* an oversized block goes behind the one still being filled */
+		if (ctx->arena && cap != PDF_ARENA_BLOCK) {
+			arena->next = ctx->arena->next;
+			ctx->arena->next = arena;
+		} else {
+			arena->next = ctx->arena;
+			ctx->arena = arena;
+		}
 	}
+	p = (char*)(arena + 1) + arena->used;
+	arena->used += sz;
+	return p;
+}
 
-	if (ferror(fp) || feof(fp))
-		return -1;
-
-	if (i != n)
-		buf[i] = '\0';
-	return i;
+static void pdf__free_arena(struct pdf__arena *arena)
+{
+	while (arena) {
+		struct pdf__arena *next = arena->next;
+		PDF_FREE(arena);
+		arena = next;
+	}
 }
 
-static size_t pdf__getline(char buf[], size_t n, FILE *fp)
+#ifndef PDF_SHARE_MAX
+#define PDF_SHARE_MAX 8
+#endif
+typedef char pdf__share_max_check[PDF_SHARE_MAX <= 0xffff ? 1 : -1];
+
+static unsigned pdf__hash_bytes(unsigned h, const void *data, size_t n)
 {
-	return pdf__getdelim(buf, n, '\n', fp);
+	const unsigned char *p = data;
+	for (size_t i = 0; i < n; ++i)
+		h = (h ^ p[i]) * 16777619u;
+	return h;
 }
 
-static void pdf__readline(struct pdf__ctx *ctx)
+/*
+ * Containers are only shared once their children have been, so child
+ * entries compare by identity rather than by walking them again.
+ */
+static unsigned pdf__hash_obj(unsigned h, const struct pdf_obj *obj)
 {
-	ctx->ln_sz = pdf__getline(ctx->buf, PDF_BUF_SZ, ctx->fp);
-	// TODO(rgriege): handle ctx->ln_sz == PDF_BUF_SZ
+	h = pdf__hash_bytes(h, &obj->type, sizeof(obj->type));
+	switch (obj->type) {
+	case PDF_OBJ_ARR:
+	case PDF_OBJ_DICT:
+		h = pdf__hash_bytes(h, &obj->arr.entries, sizeof(obj->arr.entries));
+		return pdf__hash_bytes(h, &obj->arr.sz, sizeof(obj->arr.sz));
+	case PDF_OBJ_HEX:
+	case PDF_OBJ_NAME:
+	case PDF_OBJ_STR:
+		return pdf__hash_bytes(h, obj->str.val, obj->str.len);
+	case PDF_OBJ_BOOL:
+	case PDF_OBJ_INT:
+		return pdf__hash_bytes(h, &obj->intg.val, sizeof(obj->intg.val));
+	case PDF_OBJ_NULL:
+		return h;
+	case PDF_OBJ_REAL:
+		return pdf__hash_bytes(h, &obj->real.val, sizeof(obj->real.val));
+	case PDF_OBJ_REF:
+		return pdf__hash_bytes(h, &obj->ref.id, sizeof(obj->ref.id));
+	}
+	return h;
 }
 
-static int pdf__parse_ushort_pair_ex(const char *buf, unsigned short *u0,
-                                     unsigned short *u1, char **end)
+static int pdf__obj_eq(const struct pdf_obj *a, const struct pdf_obj *b)
 {
-	char *p;
-	*u0 = strtoul(buf, &p, 10);
-	if (buf == p)
-		return 1;
-	*u1 = strtoul(p, end, 10);
-	if (p == *end)
+	if (a->type != b->type)
+		return 0;
+	switch (a->type) {
+	case PDF_OBJ_ARR:
+	case PDF_OBJ_DICT:
+		return a->arr.entries == b->arr.entries && a->arr.sz == b->arr.sz;
+	case PDF_OBJ_HEX:
+	case PDF_OBJ_NAME:
+	case PDF_OBJ_STR:
+		return    a->str.len == b->str.len
+		       && memcmp(a->str.val, b->str.val, a->str.len) == 0;
+	case PDF_OBJ_BOOL:
+	case PDF_OBJ_INT:
+		return a->intg.val == b->intg.val;
+	case PDF_OBJ_NULL:
 		return 1;
+	case PDF_OBJ_REAL:
+		return a->real.val == b->real.val;
+	case PDF_OBJ_REF:
+		return a->ref.id.num == b->ref.id.num && a->ref.id.gen == b->ref.id.gen;
+	}
 	return 0;
 }
 
-static int pdf__parse_ushort_pair(const char *buf, unsigned short *u0,
-                                  unsigned short *u1)
+static const struct pdf_obj *pdf__entry_obj(enum pdf_objtype type,
+                                            const void *entries, size_t i)
 {
-	char *end;
-	return pdf__parse_ushort_pair_ex(buf, u0, u1, &end);
+	if (type == PDF_OBJ_ARR)
+		return (const struct pdf_obj *)entries + i;
+	return &((const struct pdf_dict_entry *)entries)[i].obj;
 }
 
+static unsigned pdf__hash_entries(enum pdf_objtype type,
+                                  const void *entries, unsigned sz)
+{
+	unsigned h = 2166136261u;
+	for (unsigned i = 0; i < sz; ++i) {
+		if (type == PDF_OBJ_DICT) {
+			const struct pdf_dict_entry *entry = entries;
+			h = pdf__hash_bytes(h, entry[i].name, entry[i].name_len);
+		}
+		h = pdf__hash_obj(h, pdf__entry_obj(type, entries, i));
+	}
+	return h;
+}
 
-enum pdf__token
+static int pdf__entries_eq(enum pdf_objtype type, const void *a,
+                           const void *b, unsigned sz)
 {
-	PDF_TOK_ARR_BEGIN,
-	PDF_TOK_ARR_END,
-	PDF_TOK_DICT_BEGIN,
-	PDF_TOK_DICT_END,
-	PDF_TOK_EOF,
-	PDF_TOK_HEX_BEGIN,
-	PDF_TOK_HEX_END,
-	PDF_TOK_INVALID,
-	PDF_TOK_NAME_BEGIN,
-	PDF_TOK_NUMERIC,
-	PDF_TOK_REF_END,
-	PDF_TOK_STR_BEGIN,
-	PDF_TOK_STR_END,
+	for (unsigned i = 0; i < sz; ++i) {
+		if (type == PDF_OBJ_DICT) {
+			const struct pdf_dict_entry *ea = a, *eb = b;
+			if (   ea[i].name_len != eb[i].name_len
+			    || memcmp(ea[i].name, eb[i].name, ea[i].name_len))
+				return 0;
+		}
+		if (!pdf__obj_eq(pdf__entry_obj(type, a, i),
+		                 pdf__entry_obj(type, b, i)))
+			return 0;
+	}
+	return 1;
+}
+
+static int pdf__shareable(enum pdf_objtype type, const void *entries,
+                          unsigned sz)
+{
+	if (sz > PDF_SHARE_MAX)
+		return 0;
+	for (unsigned i = 0; i < sz; ++i) {
+		const struct pdf_obj *obj = pdf__entry_obj(type, entries, i);
+		if (   (obj->type == PDF_OBJ_ARR || obj->type == PDF_OBJ_DICT)
+		    && obj->arr.sz > PDF_SHARE_MAX)
+			return 0;
+	}
+	return 1;
+}
+
+static void pdf__share_insert(struct pdf__ctx *ctx,
+                              const struct pdf__shared *shared)
+{
+	size_t mask = ctx->shared_cap - 1, i = shared->hash & mask;
+	while (ctx->shared[i].entries)
+		i = (i + 1) & mask;
+	ctx->shared[i] = *shared;
+	++ctx->shared_cnt;
+}
+
+/*
+ * Copies a finished container's entries into the arena, or with sharing
+ * enabled returns an identical block that is already there.
+ */
+static void *pdf__store_entries(struct pdf__ctx *ctx, enum pdf_objtype type,
+                                const void *entries, unsigned sz)
+{
+	size_t bytes = sz * (  type == PDF_OBJ_ARR ? sizeof(struct pdf_obj)
+	                     : sizeof(struct pdf_dict_entry));
+	struct pdf__shared shared;
+	void *block;
+
+	if (!sz)
+		return NULL;
+	if (!ctx->share || !pdf__shareable(type, entries, sz)) {
+		block = pdf__arena_alloc(ctx, bytes);
+		memcpy(block, entries, bytes);
+		return block;
+	}
+
+	shared.hash = pdf__hash_entries(type, entries, sz);
+	shared.type = type;
+	shared.sz = sz;
+	if (ctx->shared_cap) {
+		size_t mask = ctx->shared_cap - 1, i = shared.hash & mask;
+		for (; ctx->shared[i].entries; i = (i + 1) & mask) {
+			const struct pdf__shared *s = ctx->shared + i;
+			if (   s->hash == shared.hash && s->type == type && s->sz == sz
+			    && pdf__entries_eq(type, s->entries, entries, sz)) {
+				++ctx->share_hits;
+				ctx->share_bytes += bytes;
+				return s->entries;
+			}
+		}
+	}
+	++ctx->share_misses;
+	if (4*(ctx->shared_cnt + 1) > 3*ctx->shared_cap) {
+		struct pdf__shared *old = ctx->shared;
+		size_t old_cap = ctx->shared_cap;
+		ctx->shared_cap = old_cap ? 2*old_cap : 256;
+		ctx->shared = PDF_MALLOC(ctx->shared_cap * sizeof(struct pdf__shared));
+		memset(ctx->shared, 0, ctx->shared_cap * sizeof(struct pdf__shared));
+		ctx->shared_cnt = 0;
+		for (size_t i = 0; i < old_cap; ++i)
+			if (old[i].entries)
+				pdf__share_insert(ctx, old + i);
+		PDF_FREE(old);
+	}
+	shared.entries = pdf__arena_alloc(ctx, bytes);
+	memcpy(shared.entries, entries, bytes);
+	pdf__share_insert(ctx, &shared);
+	return shared.entries;
+}
+
+static int pdf__getc(struct pdf__ctx *ctx)
+{
+	return ctx->pos < ctx->end ? (unsigned char)*ctx->pos++ : EOF;
+}
+
+static int pdf__seek(struct pdf__ctx *ctx, size_t off)
+{
+	if (   off < ctx->mem_off
+	    || off - ctx->mem_off > (size_t)(ctx->end - ctx->mem))
+		return 1;
+	ctx->pos = ctx->mem + (off - ctx->mem_off);
+	return 0;
+}
+
+static size_t pdf__getdelim(struct pdf__ctx *ctx, char buf[], size_t n,
+                            int delim)
+{
+	size_t avail = ctx->end - ctx->pos, len = avail < n ? avail : n;
+	const char *p = memchr(ctx->pos, delim, len);
+
+	if (p)
+		len = p - ctx->pos;
+	memcpy(buf, ctx->pos, len);
+	ctx->pos += len;
+	if (len != n)
+		buf[len] = '\0';
+	if (p)
+		++ctx->pos;
+	else if (ctx->pos == ctx->end)
+		return -1;
+	return len;
+}
+
+static void pdf__readline(struct pdf__ctx *ctx)
+{
+	ctx->ln_sz = pdf__getdelim(ctx, ctx->buf, PDF_BUF_SZ, '\n');
+	// TODO(rgriege): handle ctx->ln_sz == PDF_BUF_SZ
+}
+
+static int pdf__parse_ushort_pair_ex(const char *buf, unsigned short *u0,
+                                     unsigned short *u1, char **end)
+{
+	char *p;
+	*u0 = strtoul(buf, &p, 10);
+	if (buf == p)
+		return 1;
+	*u1 = strtoul(p, end, 10);
+	if (p == *end)
+		return 1;
+	return 0;
+}
+
+static int pdf__parse_ushort_pair(const char *buf, unsigned short *u0,
+                                  unsigned short *u1)
+{
+	char *end;
+	return pdf__parse_ushort_pair_ex(buf, u0, u1, &end);
+}
+
+
+enum pdf__token
+{
+	PDF_TOK_ARR_BEGIN,
+	PDF_TOK_ARR_END,
+	PDF_TOK_DICT_BEGIN,
+	PDF_TOK_DICT_END,
+	PDF_TOK_EOF,
+	PDF_TOK_FALSE,
+	PDF_TOK_HEX_BEGIN,
+	PDF_TOK_HEX_END,
+	PDF_TOK_INT,
+	PDF_TOK_INVALID,
+	PDF_TOK_KEYWORD,
+	PDF_TOK_NAME_BEGIN,
+	PDF_TOK_NULL,
+	PDF_TOK_REAL,
+	PDF_TOK_REF,
+	PDF_TOK_STR_BEGIN,
+	PDF_TOK_STR_END,
+	PDF_TOK_TRUE,
 };
 
 static const char *pdf__token_names[] = {
@@ -385,104 +1318,178 @@ static const char *pdf__token_names[] = {
 	"Dictionary begin",
 	"Dictionary end",
 	"EOF",
+	"False",
 	"Hex begin",
 	"Hex end",
+	"Int",
 	"Invalid",
+	"Keyword",
 	"Name begin",
-	"Numeric",
-	"Ref end",
+	"Null",
+	"Real",
+	"Ref",
 	"String begin",
 	"String end",
+	"True",
 };
 
-void pdf__reset_buf(struct pdf__ctx *ctx)
+/* Character classes, any class from PDF__CC_REGULAR on is a regular char */
+enum pdf__cc
 {
-	ctx->buf[0] = '\0';
-	ctx->ln_sz = 0;
-}
+	PDF__CC_WS,
+	PDF__CC_DELIM,
+	PDF__CC_REGULAR,
+	PDF__CC_DIGIT,
+	PDF__CC_SIGN,
+	PDF__CC_DOT,
+};
+
+#define W PDF__CC_WS
+#define D PDF__CC_DELIM
+#define R PDF__CC_REGULAR
+#define N PDF__CC_DIGIT
+#define S PDF__CC_SIGN
+#define P PDF__CC_DOT
+static const unsigned char pdf__cc[256] = {
+	W, R, R, R, R, R, R, R, R, W, W, R, W, W, R, R,
+	R, R, R, R, R, R, R, R, R, R, R, R, R, R, R, R,
+	W, R, R, R, R, D, R, R, D, D, R, S, R, S, P, D,
+	N, N, N, N, N, N, N, N, N, N, R, R, D, R, D, R,
+	R, R, R, R, R, R, R, R, R, R, R, R, R, R, R, R,
+	R, R, R, R, R, R, R, R, R, R, R, D, R, D, R, R,
+	R, R, R, R, R, R, R, R, R, R, R, R, R, R, R, R,
+	R, R, R, R, R, R, R, R, R, R, R, D, R, D, R, R,
+	R, R, R, R, R, R, R, R, R, R, R, R, R, R, R, R,
+	R, R, R, R, R, R, R, R, R, R, R, R, R, R, R, R,
+	R, R, R, R, R, R, R, R, R, R, R, R, R, R, R, R,
+	R, R, R, R, R, R, R, R, R, R, R, R, R, R, R, R,
+	R, R, R, R, R, R, R, R, R, R, R, R, R, R, R, R,
+	R, R, R, R, R, R, R, R, R, R, R, R, R, R, R, R,
+	R, R, R, R, R, R, R, R, R, R, R, R, R, R, R, R,
+	R, R, R, R, R, R, R, R, R, R, R, R, R, R, R, R,
+};
+#undef W
+#undef D
+#undef R
+#undef N
+#undef S
+#undef P
 
 static int pdf__is_delim(int c)
 {
-	 return c == '('
-	     || c == ')'
-	     || c == '<'
-	     || c == '>'
-	     || c == '['
-	     || c == ']'
-	     || c == '{'
-	     || c == '}'
-	     || c == '/'
-	     || c == '%';
+	return pdf__cc[(unsigned char)c] == PDF__CC_DELIM;
 }
 
 static void pdf__consume_ws(struct pdf__ctx *ctx)
 {
-	int c;
-	while ((c = fgetc(ctx->fp)) != EOF && isspace(c))
-		;
-	ungetc(c, ctx->fp);
+	while (   ctx->pos < ctx->end
+	       && pdf__cc[(unsigned char)*ctx->pos] == PDF__CC_WS)
+		++ctx->pos;
 }
 
-static void pdf__consume_word(struct pdf__ctx *ctx)
+enum pdf__num_state
 {
-	unsigned len = ctx->ln_sz;
-	int c;
-	while (   (c = fgetc(ctx->fp)) != EOF
-	       && !isspace(c)
-	       && !pdf__is_delim(c))
-		ctx->buf[len++] = c;
-	ungetc(c, ctx->fp);
-	ctx->buf[len] = '\0';
-	ctx->ln_sz = len;
-}
+	PDF__NUM_START,
+	PDF__NUM_SIGN,
+	PDF__NUM_INT,
+	PDF__NUM_DOT,
+	PDF__NUM_FRAC,
+	PDF__NUM_END,
+	PDF__NUM_ERR,
+};
 
-void pdf__consume_digits(struct pdf__ctx *ctx)
-{
-	unsigned len = ctx->ln_sz;
-	int c;
-	while ((c = fgetc(ctx->fp)) != EOF && isdigit(c))
-		ctx->buf[len++] = c;
-	ungetc(c, ctx->fp);
-	ctx->buf[len] = '\0';
-	ctx->ln_sz = len;
-}
+/* Numbers are [+-]digits, [+-]digits.[digits] or [+-].digits */
+static const unsigned char pdf__num_dfa[PDF__NUM_END][PDF__CC_DOT+1] = {
+	/*  WS            DELIM         REGULAR       DIGIT
+	    SIGN          DOT */
+	{   PDF__NUM_ERR, PDF__NUM_ERR, PDF__NUM_ERR, PDF__NUM_INT,
+	    PDF__NUM_SIGN, PDF__NUM_DOT },  /* START */
+	{   PDF__NUM_ERR, PDF__NUM_ERR, PDF__NUM_ERR, PDF__NUM_INT,
+	    PDF__NUM_ERR, PDF__NUM_DOT },   /* SIGN */
+	{   PDF__NUM_END, PDF__NUM_END, PDF__NUM_ERR, PDF__NUM_INT,
+	    PDF__NUM_ERR, PDF__NUM_FRAC },  /* INT */
+	{   PDF__NUM_ERR, PDF__NUM_ERR, PDF__NUM_ERR, PDF__NUM_FRAC,
+	    PDF__NUM_ERR, PDF__NUM_ERR },   /* DOT */
+	{   PDF__NUM_END, PDF__NUM_END, PDF__NUM_ERR, PDF__NUM_FRAC,
+	    PDF__NUM_ERR, PDF__NUM_ERR },   /* FRAC */
+};
 
-int pdf__consume_int(struct pdf__ctx *ctx, int *val)
+/*
+ * "num gen R" is a reference.  Rather than queueing ints in the parser,
+ * the rest of it is looked for right after an unsigned int.
+ */
+static int pdf__lex_ref(struct pdf__ctx *ctx, const char *p, double num)
 {
-	PDF_ERRIF(!ctx->int_cnt, 1, "No ints to consume\n");
-	*val = ctx->ints[0];
-	ctx->ints[0] = ctx->ints[1];
-	ctx->ints[1] = ctx->ints[2];
-	--ctx->int_cnt;
-#ifdef PDF_DEBUG
-	PDF_LOG("consume int: %d\n", *val);
-#endif
-	return 0;
+	const char *end = ctx->end;
+	unsigned gen = 0;
+
+	if (num > 0xffff || p == end || pdf__cc[(unsigned char)*p] != PDF__CC_WS)
+		return 0;
+	while (p < end && pdf__cc[(unsigned char)*p] == PDF__CC_WS)
+		++p;
+	if (p == end || pdf__cc[(unsigned char)*p] != PDF__CC_DIGIT)
+		return 0;
+	while (p < end && pdf__cc[(unsigned char)*p] == PDF__CC_DIGIT && gen <= 0xffff)
+		gen = 10*gen + (*p++ - '0');
+	if (gen > 0xffff || p == end || pdf__cc[(unsigned char)*p] != PDF__CC_WS)
+		return 0;
+	while (p < end && pdf__cc[(unsigned char)*p] == PDF__CC_WS)
+		++p;
+	if (p == end || *p++ != 'R')
+		return 0;
+	if (p < end && pdf__cc[(unsigned char)*p] >= PDF__CC_REGULAR)
+		return 0;
+	ctx->tok_ref.num = (unsigned short)num;
+	ctx->tok_ref.gen = gen;
+	ctx->pos = p;
+	return 1;
 }
 
-int pdf__consume_to(struct pdf__ctx *ctx, int end)
+static enum pdf__token pdf__lex_number(struct pdf__ctx *ctx, const char *p)
 {
-	unsigned len = ctx->ln_sz;
-	int c;
-	while ((c = fgetc(ctx->fp)) != EOF && c != end)
-		ctx->buf[len++] = c;
-	ctx->buf[len] = '\0';
-	ctx->ln_sz = len;
-	return c != end;
-}
+	const char *start = p;
+	enum pdf__num_state state = PDF__NUM_START, prev;
+	double val = 0, scale = 1;
+	unsigned char cc;
 
-int pdf__consume_to_ignoring_ws(struct pdf__ctx *ctx, int end)
-{
-	unsigned len = ctx->ln_sz;
-	int c;
-	while ((c = fgetc(ctx->fp)) != EOF && c != end)
-		if (!isspace(c))
-			ctx->buf[len++] = c;
-	ctx->buf[len] = '\0';
-	ctx->ln_sz = len;
-	return c != end;
+	do {
+		cc = p < ctx->end ? pdf__cc[(unsigned char)*p] : PDF__CC_WS;
+		prev = state;
+		state = pdf__num_dfa[state][cc];
+		if (cc == PDF__CC_DIGIT) {
+			val = 10*val + (*p - '0');
+			if (state == PDF__NUM_FRAC)
+				scale *= 10;
+		}
+		if (state < PDF__NUM_END)
+			++p;
+	} while (state < PDF__NUM_END);
+
+	if (state == PDF__NUM_ERR) {
+		while (p < ctx->end && pdf__cc[(unsigned char)*p] >= PDF__CC_REGULAR)
+			++p;
+		ctx->pos = p;
+		PDF_ERR(PDF_TOK_INVALID, "Invalid number '%.*s'\n",
+		        (int)(p - start), start);
+	}
+	ctx->pos = p;
+	if (*start == '-')
+		val = -val;
+	if (prev == PDF__NUM_INT && val >= -2147483648.0 && val <= 2147483647.0) {
+		if (*start != '-' && *start != '+' && pdf__lex_ref(ctx, p, val))
+			return PDF_TOK_REF;
+		ctx->tok_int = (int)val;
+		return PDF_TOK_INT;
+	}
+	ctx->tok_real = val / scale;
+	return PDF_TOK_REAL;
 }
 
+/*
+ * A single pass over the document with one token of lookahead, which the
+ * parser hands back through pdf__parse_obj_after.  Int, real and ref
+ * values are left in ctx->tok_int, tok_real and tok_ref.
+ */
 #ifdef PDF_DEBUG
 enum pdf__token pdf__next_token_dbg(struct pdf__ctx *ctx);
 enum pdf__token pdf__next_token(struct pdf__ctx *ctx)
@@ -496,138 +1503,122 @@ enum pdf__token pdf__next_token_dbg(struct pdf__ctx *ctx)
 enum pdf__token pdf__next_token(struct pdf__ctx *ctx)
 #endif
 {
-	int c;
-	pdf__reset_buf(ctx);
-	while (1) {
-		c = fgetc(ctx->fp);
-		if (ctx->int_cnt) {
-			switch (c) {
-			case '[':
-			case ']':
-			case '<':
-			case '>':
-			case EOF:
-			case '/':
-			case '\n':
-				ungetc(c, ctx->fp);
-				return PDF_TOK_NUMERIC;
-			default:
+	const char *p = ctx->pos, *end = ctx->end, *start;
+
+	for (;;) {
+		while (p < end && pdf__cc[(unsigned char)*p] == PDF__CC_WS)
+			++p;
+		if (p == end || *p != '%')
 			break;
-			}
-		}
-		switch (c) {
+		while (p < end && *p != '\n' && *p != '\r')
+			++p;
+	}
+	ctx->pos = p + 1;
+	if (p == end) {
+		ctx->pos = p;
+		return PDF_TOK_EOF;
+	}
+
+	switch (pdf__cc[(unsigned char)*p]) {
+	case PDF__CC_DELIM:
+		switch (*p) {
 		case '[':
 			return PDF_TOK_ARR_BEGIN;
-		break;
 		case ']':
 			return PDF_TOK_ARR_END;
-		break;
 		case '<':
-			if ((c = fgetc(ctx->fp)) != '<') {
-				ungetc(c, ctx->fp);
-				return PDF_TOK_HEX_BEGIN;
-			} else
+			if (p + 1 < end && p[1] == '<') {
+				ctx->pos = p + 2;
 				return PDF_TOK_DICT_BEGIN;
-		break;
+			}
+			return PDF_TOK_HEX_BEGIN;
 		case '>':
-			if ((c = fgetc(ctx->fp)) != '>') {
-				ungetc(c, ctx->fp);
-				return PDF_TOK_HEX_END;
-			} else
+			if (p + 1 < end && p[1] == '>') {
+				ctx->pos = p + 2;
 				return PDF_TOK_DICT_END;
-		break;
+			}
+			return PDF_TOK_HEX_END;
 		case '(':
 			return PDF_TOK_STR_BEGIN;
 		case ')':
-			return PDF_TOK_STR_BEGIN;
-		case EOF:
-			return PDF_TOK_EOF;
-		break;
+			return PDF_TOK_STR_END;
 		case '/':
 			return PDF_TOK_NAME_BEGIN;
-		break;
-		case '0':
-		case '1':
-		case '2':
-		case '3':
-		case '4':
-		case '5':
-		case '6':
-		case '7':
-		case '8':
-		case '9':
-			ctx->buf[ctx->ln_sz++] = c;
-			pdf__consume_digits(ctx);
-			if (ctx->int_cnt == 3) {
-				pdf__consume_int(ctx, &c);
-				PDF_LOG("Too many unconsumed ints, skipping\n");
-			}
-			ctx->ints[ctx->int_cnt++] = atoi(ctx->buf);
-			pdf__reset_buf(ctx);
-			if (ctx->int_cnt == 3)
-				return PDF_TOK_NUMERIC;
-		break;
-		case 'R':
-			PDF_ERRIF(ctx->int_cnt != 2, PDF_TOK_INVALID,
-			          "Incorrect int count preceding ref token\n");
-			return PDF_TOK_REF_END;
-		break;
-		default:
-			PDF_ERRIF(!isspace(c), PDF_TOK_INVALID,
-			          "Unexpected '%c' when looking for token\n", c);
-		break;
 		}
+		PDF_ERR(PDF_TOK_INVALID, "Unexpected '%c' when looking for token\n",
+		        *p);
+	case PDF__CC_DIGIT:
+	case PDF__CC_SIGN:
+	case PDF__CC_DOT:
+		return pdf__lex_number(ctx, p);
 	}
-}
 
-int pdf__move_buf(struct pdf__ctx *ctx, char **dst)
-{
-	int ret = 1;
-	if (ctx->ln_sz) {
-		*dst = PDF_MALLOC(ctx->ln_sz+1);
-		memcpy(*dst, ctx->buf, ctx->ln_sz);
-		(*dst)[ctx->ln_sz] = '\0';
-		ret = 0;
-	}
-	pdf__reset_buf(ctx);
-	return ret;
+	start = p;
+	while (p < end && pdf__cc[(unsigned char)*p] >= PDF__CC_REGULAR)
+		++p;
+	ctx->pos = p;
+	if (p - start == 4 && memcmp(start, "true", 4) == 0)
+		return PDF_TOK_TRUE;
+	if (p - start == 5 && memcmp(start, "false", 5) == 0)
+		return PDF_TOK_FALSE;
+	if (p - start == 4 && memcmp(start, "null", 4) == 0)
+		return PDF_TOK_NULL;
+	return PDF_TOK_KEYWORD;
 }
 
 #ifdef PDF_DEBUG
-int pdf__read_name_dbg(struct pdf__ctx *ctx, char **name);
-int pdf__read_name(struct pdf__ctx *ctx, char **name)
+int pdf__read_name_dbg(struct pdf__ctx *ctx, struct pdf_obj_name *name);
+int pdf__read_name(struct pdf__ctx *ctx, struct pdf_obj_name *name)
 {
 	int ret = pdf__read_name_dbg(ctx, name);
 	if (PDF_OK(ret))
-		PDF_LOG("name: %s\n", *name);
+		PDF_LOG("name: %.*s\n", (int)name->len, name->val);
 	return ret;
 }
-int pdf__read_name_dbg(struct pdf__ctx *ctx, char **name)
+int pdf__read_name_dbg(struct pdf__ctx *ctx, struct pdf_obj_name *name)
 #else
-int pdf__read_name(struct pdf__ctx *ctx, char **name)
+int pdf__read_name(struct pdf__ctx *ctx, struct pdf_obj_name *name)
 #endif
 {
-	pdf__consume_word(ctx);
-	return pdf__move_buf(ctx, name);
+	const char *start = ctx->pos;
+	while (   ctx->pos < ctx->end
+	       && pdf__cc[(unsigned char)*ctx->pos] >= PDF__CC_REGULAR)
+		++ctx->pos;
+	name->val = start;
+	name->len = ctx->pos - start;
+	return name->len == 0;
 }
 
 #ifdef PDF_DEBUG
-static int pdf__read_str_dbg(struct pdf__ctx *ctx, char **str);
-static int pdf__read_str(struct pdf__ctx *ctx, char **str)
+static int pdf__read_str_dbg(struct pdf__ctx *ctx, struct pdf_obj_str *str);
+static int pdf__read_str(struct pdf__ctx *ctx, struct pdf_obj_str *str)
 {
 	int ret = pdf__read_str_dbg(ctx, str);
 	if (PDF_OK(ret))
-		PDF_LOG("str: %s\n", *str);
+		PDF_LOG("str: %.*s\n", (int)str->len, str->val);
 	return ret;
 }
-static int pdf__read_str_dbg(struct pdf__ctx *ctx, char **str)
+static int pdf__read_str_dbg(struct pdf__ctx *ctx, struct pdf_obj_str *str)
 #else
-static int pdf__read_str(struct pdf__ctx *ctx, char **str)
+static int pdf__read_str(struct pdf__ctx *ctx, struct pdf_obj_str *str)
 #endif
 {
-	if (pdf__consume_to(ctx, ')'))
-		PDF_ERR(1, "Error reading string\n");
-	return pdf__move_buf(ctx, str);
+	const char *start = ctx->pos;
+	int depth = 1, c;
+
+	/* balanced parens may appear unescaped */
+	while ((c = pdf__getc(ctx)) != EOF) {
+		if (c == '\\')
+			pdf__getc(ctx);
+		else if (c == '(')
+			++depth;
+		else if (c == ')' && --depth == 0)
+			break;
+	}
+	PDF_ERRIF(c == EOF, 1, "Error reading string\n");
+	str->val = start;
+	str->len = ctx->pos - 1 - start;
+	return 0;
 }
 
 #ifdef PDF_DEBUG
@@ -635,12 +1626,8 @@ static int pdf__read_hex_dbg(struct pdf__ctx *ctx, struct pdf_obj_hex *hex);
 static int pdf__read_hex(struct pdf__ctx *ctx, struct pdf_obj_hex *hex)
 {
 	int ret = pdf__read_hex_dbg(ctx, hex);
-	if (PDF_OK(ret)) {
-		PDF_LOG("hex: ");
-		for (int i = 0; i < hex->sz; ++i)
-			PDF_LOG("%02x", hex->val[i] & 0xff);
-		PDF_LOG("\n");
-	}
+	if (PDF_OK(ret))
+		PDF_LOG("hex: %.*s\n", (int)hex->len, hex->val);
 	return ret;
 }
 static int pdf__read_hex_dbg(struct pdf__ctx *ctx, struct pdf_obj_hex *hex)
@@ -648,43 +1635,46 @@ static int pdf__read_hex_dbg(struct pdf__ctx *ctx, struct pdf_obj_hex *hex)
 static int pdf__read_hex(struct pdf__ctx *ctx, struct pdf_obj_hex *hex)
 #endif
 {
-	int ret = 1;
-	if (pdf__consume_to_ignoring_ws(ctx, '>'))
-		PDF_ERR(1, "Error reading hex string\n");
-	if (ctx->ln_sz) {
-		hex->sz = (ctx->ln_sz+1)/2;
-		hex->val = PDF_MALLOC(hex->sz);
-		for (int i = 0; i < hex->sz; ++i) {
-			char c = ctx->buf[2*(i+1)];
-			ctx->buf[2*(i+1)] = '\0';
-			hex->val[i] = strtol(ctx->buf+2*i, NULL, 16);
-			ctx->buf[2*(i+1)] = c;
-		}
-		ret = 0;
-	}
-	pdf__reset_buf(ctx);
-	return ret;
+	const char *end = memchr(ctx->pos, '>', ctx->end - ctx->pos);
+	PDF_ERRIF(!end, 1, "Error reading hex string\n");
+	hex->val = ctx->pos;
+	hex->len = end - ctx->pos;
+	ctx->pos = end + 1;
+	return 0;
 }
 
 static int pdf__parse_obj_after(struct pdf__ctx *ctx, struct pdf_obj *obj,
                                 enum pdf__token token);
+/*
+ * Entries are gathered on a stack shared by all nesting levels, then
+ * stored in the arena in one block once the container is complete.
+ */
 static int pdf__parse_arr_body(struct pdf__ctx *ctx,
                                struct pdf_obj_arr *arr)
 {
+	size_t base = ctx->arr_stack_sz;
 	enum pdf__token token;
-	struct pdf_obj *entry;
-
-	PDF_ERRIF(arr->entries || arr->sz, 1, "arr struct not 0-d\n");
+	struct pdf_obj entry;
 
 	token = pdf__next_token(ctx);
 	while (token != PDF_TOK_ARR_END) {
-		arr->entries = PDF_REALLOC(arr->entries,
-		                           ++arr->sz*sizeof(struct pdf_obj));
-		entry = arr->entries + arr->sz - 1;
-		if (pdf__parse_obj_after(ctx, entry, token))
+		if (pdf__parse_obj_after(ctx, &entry, token)) {
+			ctx->arr_stack_sz = base;
 			PDF_ERR(1, "failed to parse arr entry obj\n");
+		}
+		if (ctx->arr_stack_sz == ctx->arr_stack_cap) {
+			ctx->arr_stack_cap = ctx->arr_stack_cap ? 2*ctx->arr_stack_cap : 64;
+			ctx->arr_stack = PDF_REALLOC(ctx->arr_stack,   ctx->arr_stack_cap
+			                                             * sizeof(struct pdf_obj));
+		}
+		ctx->arr_stack[ctx->arr_stack_sz++] = entry;
 		token = pdf__next_token(ctx);
 	}
+	arr->type = PDF_OBJ_ARR;
+	arr->sz = ctx->arr_stack_sz - base;
+	arr->entries = pdf__store_entries(ctx, PDF_OBJ_ARR, ctx->arr_stack + base,
+	                                  arr->sz);
+	ctx->arr_stack_sz = base;
 	return 0;
 }
 
@@ -692,24 +1682,35 @@ static int pdf__parse_obj(struct pdf__ctx *ctx, struct pdf_obj *obj);
 static int pdf__parse_dict_body(struct pdf__ctx *ctx,
                                 struct pdf_obj_dict *dict)
 {
+	size_t base = ctx->dict_stack_sz;
 	enum pdf__token token;
-	struct pdf_dict_entry *entry;
-
-	PDF_ERRIF(dict->entries || dict->sz, 1, "dict struct not 0-d\n");
+	struct pdf_dict_entry entry;
+	struct pdf_obj_name key;
 
 	token = pdf__next_token(ctx);
 	while (token != PDF_TOK_DICT_END) {
-		PDF_ERRIF(token != PDF_TOK_NAME_BEGIN, 1,
-		          "dict entry should begin with a name begin token\n");
-		dict->entries = PDF_REALLOC(dict->entries,
-		                            ++dict->sz*sizeof(struct pdf_dict_entry));
-		entry = dict->entries + dict->sz - 1;
-		if (pdf__read_name(ctx, &entry->name))
-			PDF_ERR(1, "failed to parse dict entry name\n");
-		if (pdf__parse_obj(ctx, &entry->obj))
-			PDF_ERR(1, "failed to parse dict entry obj\n");
+		if (   token != PDF_TOK_NAME_BEGIN
+		    || pdf__read_name(ctx, &key)
+		    || pdf__parse_obj(ctx, &entry.obj)) {
+			ctx->dict_stack_sz = base;
+			PDF_ERR(1, "failed to parse dict entry\n");
+		}
+		entry.name = key.val;
+		entry.name_len = key.len;
+		if (ctx->dict_stack_sz == ctx->dict_stack_cap) {
+			ctx->dict_stack_cap = ctx->dict_stack_cap ? 2*ctx->dict_stack_cap : 64;
+			ctx->dict_stack = PDF_REALLOC(ctx->dict_stack,
+			                                ctx->dict_stack_cap
+			                              * sizeof(struct pdf_dict_entry));
+		}
+		ctx->dict_stack[ctx->dict_stack_sz++] = entry;
 		token = pdf__next_token(ctx);
 	}
+	dict->type = PDF_OBJ_DICT;
+	dict->sz = ctx->dict_stack_sz - base;
+	dict->entries = pdf__store_entries(ctx, PDF_OBJ_DICT,
+	                                   ctx->dict_stack + base, dict->sz);
+	ctx->dict_stack_sz = base;
 	return 0;
 }
 
@@ -720,55 +1721,64 @@ static int pdf__parse_dict(struct pdf__ctx *ctx, struct pdf_obj_dict *dict)
 	return pdf__parse_dict_body(ctx, dict);
 }
 
+static int pdf__decrypt_str(struct pdf__ctx *ctx, struct pdf_obj *obj);
 static int pdf__parse_obj_after(struct pdf__ctx *ctx, struct pdf_obj *obj,
                                 enum pdf__token token)
 {
 	switch (token) {
 	case PDF_TOK_ARR_BEGIN:
-		obj->type = PDF_OBJ_ARR;
-		obj->arr.entries = NULL;
-		obj->arr.sz = 0;
 		return pdf__parse_arr_body(ctx, &obj->arr);
 	break;
 	case PDF_TOK_DICT_BEGIN:
-		obj->type = PDF_OBJ_DICT;
-		obj->dict.entries = NULL;
-		obj->dict.sz = 0;
 		return pdf__parse_dict_body(ctx, &obj->dict);
 	break;
 	case PDF_TOK_HEX_BEGIN:
 		obj->type = PDF_OBJ_HEX;
-		return pdf__read_hex(ctx, &obj->hex);
+		if (pdf__read_hex(ctx, &obj->hex))
+			return 1;
+		return ctx->crypt_strs ? pdf__decrypt_str(ctx, obj) : 0;
 	case PDF_TOK_NAME_BEGIN:
 		obj->type = PDF_OBJ_NAME;
-		return pdf__read_name(ctx, &obj->name.val);
+		return pdf__read_name(ctx, &obj->name);
 	break;
-	case PDF_TOK_NUMERIC:
+	case PDF_TOK_INT:
 		obj->type = PDF_OBJ_INT;
-		return pdf__consume_int(ctx, &obj->intg.val);
+		obj->intg.val = ctx->tok_int;
+	break;
+	case PDF_TOK_REAL:
+		obj->type = PDF_OBJ_REAL;
+		obj->real.val = ctx->tok_real;
 	break;
-	case PDF_TOK_REF_END:
-		PDF_ERRIF(ctx->int_cnt != 2, 1, "Invalid object reference\n");
+	case PDF_TOK_REF:
 		obj->type = PDF_OBJ_REF;
-		obj->ref.id.num = ctx->ints[0];
-		obj->ref.id.gen = ctx->ints[1];
+		obj->ref.id = ctx->tok_ref;
 #ifdef PDF_DEBUG
 		PDF_LOG("pdf_obj_ref: %u.%u\n", obj->ref.id.num, obj->ref.id.gen);
 #endif
-		ctx->int_cnt = 0;
+	break;
+	case PDF_TOK_TRUE:
+	case PDF_TOK_FALSE:
+		obj->type = PDF_OBJ_BOOL;
+		obj->boolean.val = token == PDF_TOK_TRUE;
+	break;
+	case PDF_TOK_NULL:
+		obj->type = PDF_OBJ_NULL;
 	break;
 	case PDF_TOK_STR_BEGIN:
 		obj->type = PDF_OBJ_STR;
-		return pdf__read_str(ctx, &obj->hex.val);
+		if (pdf__read_str(ctx, &obj->str))
+			return 1;
+		return ctx->crypt_strs ? pdf__decrypt_str(ctx, obj) : 0;
 	case PDF_TOK_ARR_END:
 	case PDF_TOK_DICT_END:
 	case PDF_TOK_HEX_END:
 	case PDF_TOK_STR_END:
 	case PDF_TOK_EOF:
+	case PDF_TOK_KEYWORD:
 		PDF_ERR(1, "Unexpected token (%s) when parsing obj\n",
 		        pdf__token_names[token]);
 	case PDF_TOK_INVALID:
-		PDF_ERR(1, "Invalid token (%c) when parsing obj\n", fgetc(ctx->fp));
+		PDF_ERR(1, "Invalid token when parsing obj\n");
 	}
 	return 0;
 }
@@ -778,13 +1788,24 @@ static int pdf__parse_obj(struct pdf__ctx *ctx, struct pdf_obj *obj)
 	return pdf__parse_obj_after(ctx, obj, pdf__next_token(ctx));
 }
 
+/* Ints and reals are interchangeable wherever PDF expects a number */
+static int pdf__obj_num(const struct pdf_obj *obj, double *val)
+{
+	if (obj->type == PDF_OBJ_INT)
+		*val = obj->intg.val;
+	else if (obj->type == PDF_OBJ_REAL)
+		*val = obj->real.val;
+	else
+		return 1;
+	return 0;
+}
+
+static int pdf__init_crypt(struct pdf *pdf, struct pdf_obj_dict *trailer);
 static int pdf__validate_trailer(struct pdf *pdf,
                                  struct pdf_obj_dict *trailer)
 {
 	struct pdf_obj *obj;
 
-	if (pdf__parse_dict(pdf->ctx, trailer))
-		PDF_ERR(1, "failed to parse trailer\n");
 	obj = pdf_dict_find(trailer, "Root");
 	PDF_ERRIF(!obj, 1, "trailer dict has no Root entry\n");
 	PDF_ERRIF(obj->type != PDF_OBJ_REF, 1,
@@ -794,58 +1815,17 @@ static int pdf__validate_trailer(struct pdf *pdf,
 	PDF_ERRIF(!obj, 1, "trailer dict has no Size entry\n");
 	PDF_ERRIF(obj->type != PDF_OBJ_INT, 1,
 	          "trailer dict Size entry is not an integer\n");
-	PDF_ERRIF(obj->intg.val != pdf->xref_tbl_sz+1, 1,
+	/* the main xref of a linearized file has not been read yet */
+	PDF_ERRIF(!pdf->ctx->main_xref && obj->intg.val != pdf->xref_tbl_sz+1, 1,
 	          "trailer dict Size (%d) != xref table size (%lu)\n",
 		        obj->intg.val, pdf->xref_tbl_sz+1);
 
-	return 0;
-}
-
-static void pdf__free_obj(struct pdf_obj *obj);
-static void pdf__free_dict(struct pdf_obj_dict *dict)
-{
-	for (size_t i = 0; i < dict->sz; ++i) {
-		struct pdf_dict_entry *entry = dict->entries+i;
-		PDF_FREE(entry->name);
-		pdf__free_obj(&entry->obj);
-	}
-	PDF_FREE(dict->entries);
+	return pdf__init_crypt(pdf, trailer);
 }
 
-AMFDEF int pdf_init_from_stream(struct pdf *pdf, FILE *stream)
+/* Reads the xref table at the current position and the trailer after it */
+static int pdf__parse_xref(struct pdf *pdf, struct pdf_obj_dict *trailer)
 {
-	char *p;
-	int xref_pos, ret;
-	struct pdf_obj_dict trailer = {0};
-
-	pdf->ctx = PDF_MALLOC(sizeof(struct pdf__ctx));
-	pdf->ctx->buf[0] = '\0';
-	pdf->ctx->ln_sz = 0;
-	pdf->ctx->fp = stream;
-	pdf->ctx->int_cnt = 0;
-
-	PDF_ERRIF(pdf->xref_tbl || pdf->xref_tbl_sz, 1,
-	          "pdf struct data not zero-d\n");
-
-	pdf__readline(pdf->ctx);
-	if (strncmp(pdf->ctx->buf, "%PDF-1.", 7))
-		PDF_ERR(1, "invalid header line\n");
-
-	pdf->version = atoi(pdf->ctx->buf+7);
-	if (pdf->version > 7)
-		PDF_ERR(1, "invalid PDF version '%u'\n", pdf->version);
-
-	if (fseek(pdf->ctx->fp, -25, SEEK_END))
-		PDF_ERR(1, "failed to lookup xref table position\n");
-	pdf->ctx->ln_sz = fread(pdf->ctx->buf, 1, 256, pdf->ctx->fp);
-	p = strstr(pdf->ctx->buf, "startxref");
-	PDF_ERRIF(!p, 1, "failed to locate xref table position\n");
-	xref_pos = atoi(p+9);
-	PDF_ERRIF(!xref_pos, 1, "failed to parse xref table position\n");
-
-	if (fseek(pdf->ctx->fp, xref_pos, SEEK_SET))
-		PDF_ERR(1, "failed to lookup xref table\n");
-
 	pdf__readline(pdf->ctx);
 	if (strncmp(pdf->ctx->buf, "xref", 4))
 		PDF_ERR(1, "xref table not found in assigned location\n");
@@ -858,14 +1838,14 @@ AMFDEF int pdf_init_from_stream(struct pdf *pdf, FILE *stream)
 		PDF_ERRIF(cnt == 0, 1, "xref table section has 0 objects\n");
 
 		// The first object is always a NULL object, so skip it
-		if (!pdf->xref_tbl_sz) {
+		if (objnum == 0) {
 			pdf__readline(pdf->ctx);
 			++objnum;
 			--cnt;
 		}
 		pdf->xref_tbl = PDF_REALLOC(pdf->xref_tbl,
-		                              pdf->xref_tbl_sz
-		                            + cnt*sizeof(struct pdf_xref));
+		                              (pdf->xref_tbl_sz + cnt)
+		                            * sizeof(struct pdf_xref));
 		for (unsigned short i = 0; i < cnt; ++i) {
 			struct pdf_xref *entry = pdf->xref_tbl + pdf->xref_tbl_sz + i;
 			unsigned off, gen;
@@ -884,81 +1864,736 @@ AMFDEF int pdf_init_from_stream(struct pdf *pdf, FILE *stream)
 		pdf__readline(pdf->ctx);
 	}
 
-	PDF_ERRIF(pdf->xref_tbl_sz < 4, 1,
-	          "too few (%lu) objects found in xref table\n",
-	          pdf->xref_tbl_sz);
-
-	ret = pdf__validate_trailer(pdf, &trailer);
-	pdf__free_dict(&trailer);
-	return ret;
+	if (pdf__parse_dict(pdf->ctx, trailer))
+		PDF_ERR(1, "failed to parse trailer\n");
+	return 0;
 }
 
-AMFDEF int pdf_init_from_file(struct pdf *pdf, const char *fname)
+#ifndef PDF_LINEARIZED_HEAD_SZ
+#define PDF_LINEARIZED_HEAD_SZ 1024
+#endif
+
+/* Undoes a first-page xref that failed to load */
+static void pdf__drop_linearized(struct pdf *pdf)
 {
-	FILE *fp = fopen(fname, "rb");
-	PDF_ERRIF(!fp, 1, "failed to open file '%s'\n", fname);
-	return pdf_init_from_stream(pdf, fp);
+	for (size_t i = 0; i < pdf->xref_tbl_sz; ++i)
+		if (pdf->xref_tbl[i].baseobj)
+			PDF_FREE(pdf->xref_tbl[i].baseobj->stream);
+	PDF_FREE(pdf->xref_tbl);
+	pdf->xref_tbl = NULL;
+	pdf->xref_tbl_sz = 0;
+	pdf->root.num = pdf->root.gen = 0;
+	PDF_FREE(pdf->ctx->crypt);
+	pdf->ctx->crypt = NULL;
+	pdf->ctx->main_xref = 0;
+	pdf->ctx->linear_page.num = pdf->ctx->linear_page.gen = 0;
+	pdf->ctx->linear_page_cnt = 0;
 }
 
-#ifdef PDF_ZLIB
-/* Based on zlib zpipe.c example */
-#define PDF_ZLIB_CHUNK 1024
-static int pdf__zlib_inflate(char **stream, int len)
+/*
+ * A linearized file opens with its linearization dict and the xref section
+ * covering the catalog and first page, so page 0 can be served from the
+ * head of the file.  The main xref it points to with Prev is only read
+ * once an object outside that section is requested.  Linearization is
+ * only a hint: if any of it fails to parse, 0 is returned and the file is
+ * opened through its trailing startxref instead.
+ */
+static int pdf__init_linearized(struct pdf *pdf, size_t sz)
 {
-	int ret;
-	unsigned have;
-	z_stream strm;
-	unsigned char buf[PDF_ZLIB_CHUNK];
-	char *out = NULL;
-
-	if (len == 0)
-		return Z_OK;
-
-	/* allocate inflate state */
-	strm.zalloc = Z_NULL;
-	strm.zfree = Z_NULL;
-	strm.opaque = Z_NULL;
-	strm.avail_in = 0;
-	strm.next_in = Z_NULL;
-	ret = inflateInit(&strm);
-	if (ret != Z_OK)
-		return ret;
+	struct pdf__ctx *ctx = pdf->ctx;
+	size_t head = sz < PDF_LINEARIZED_HEAD_SZ ? sz : PDF_LINEARIZED_HEAD_SZ;
+	struct pdf_obj_dict trailer = {0};
+	struct pdf_obj lin, *entry;
+	struct pdf_objid id;
+	const char *line, *p;
+	char *id_end;
 
-	strm.avail_in = len;
-	strm.next_in = (unsigned char*)*stream;
+	for (p = ctx->mem; p + 11 <= ctx->mem + head; ++p)
+		if (*p == '/' && memcmp(p, "/Linearized", 11) == 0)
+			break;
+	if (p + 11 > ctx->mem + head)
+		return 0;
 
-	/* run inflate() on input until output buffer not full */
 	do {
-		strm.avail_out = PDF_ZLIB_CHUNK;
-		strm.next_out = buf;
-		ret = inflate(&strm, Z_NO_FLUSH);
-		assert(ret != Z_STREAM_ERROR); /* state not clobbered */
-		switch (ret) {
-		case Z_NEED_DICT:
-			ret = Z_DATA_ERROR; /* and fall through */
-		case Z_DATA_ERROR:
-		case Z_MEM_ERROR:
-			(void)inflateEnd(&strm);
-			PDF_FREE(out);
-			return ret;
-		}
-		have = PDF_ZLIB_CHUNK - strm.avail_out;
-		out = PDF_REALLOC(out, have+1);
-		memcpy(out, buf, have);
-		out[have] = '\0';
-	} while (strm.avail_out == 0);
+		line = ctx->pos;
+		pdf__readline(ctx);
+	} while (ctx->buf[0] == '%');
+	if (   pdf__parse_ushort_pair_ex(ctx->buf, &id.num, &id.gen, &id_end)
+	    || strncmp(id_end, " obj", 4))
+		return 0;
+	/* the dict often shares a line with the object header */
+	ctx->pos = line + (id_end - ctx->buf) + 4;
+	if (pdf__parse_obj(ctx, &lin))
+		PDF_ERR(0, "failed to parse linearization dict\n");
+	if (lin.type != PDF_OBJ_DICT || !pdf_dict_find(&lin.dict, "Linearized"))
+		return 0;
+	/* a file updated after linearization no longer matches its L */
+	entry = pdf_dict_find(&lin.dict, "L");
+	if (   !entry || entry->type != PDF_OBJ_INT || entry->intg.val < 0
+	    || (size_t)entry->intg.val != sz)
+		return 0;
+	entry = pdf_dict_find(&lin.dict, "O");
+	if (entry && entry->type == PDF_OBJ_INT)
+		ctx->linear_page.num = entry->intg.val;
+	entry = pdf_dict_find(&lin.dict, "N");
+	if (entry && entry->type == PDF_OBJ_INT)
+		ctx->linear_page_cnt = entry->intg.val;
+
+	pdf__consume_ws(ctx);
+	pdf__readline(ctx);
+	if (strncmp(ctx->buf, "endobj", 6)) {
+		PDF_LOG("missing linearization dict endobj token\n");
+		goto fail;
+	}
+	pdf__consume_ws(ctx);
+	if (pdf__parse_xref(pdf, &trailer))
+		goto fail;
+	entry = pdf_dict_find(&trailer, "Prev");
+	if (entry && entry->type == PDF_OBJ_INT)
+		ctx->main_xref = entry->intg.val;
+	if (pdf__validate_trailer(pdf, &trailer))
+		goto fail;
+	return 1;
+
+fail:
+	pdf__drop_linearized(pdf);
+	return 0;
+}
 
-	/* clean up and return */
-	(void)inflateEnd(&strm);
-	PDF_FREE(*stream);
-	*stream = out;
-	return Z_OK;
+static int pdf__load_main_xref(struct pdf *pdf)
+{
+	struct pdf_obj_dict trailer = {0};
+
+	if (pdf__seek(pdf->ctx, pdf->ctx->main_xref))
+		PDF_ERR(1, "failed to lookup main xref table\n");
+	pdf->ctx->main_xref = 0;
+	return pdf__parse_xref(pdf, &trailer);
 }
-#endif
 
-#ifdef PDF_JPEG
-struct pdf__jpeg_error_mgr {
-	struct jpeg_error_mgr pub;
+static int pdf__init(struct pdf *pdf, const char *data, size_t sz,
+                     enum pdf__mem_type mem_type)
+{
+	const char *p;
+	int xref_pos, ret;
+	struct pdf_obj_dict trailer = {0};
+
+	pdf->ctx = PDF_MALLOC(sizeof(struct pdf__ctx));
+	pdf->ctx->buf[0] = '\0';
+	pdf->ctx->ln_sz = 0;
+	pdf->ctx->mem = pdf->ctx->pos = data;
+	pdf->ctx->mem_off = 0;
+	pdf->ctx->end = data + sz;
+	pdf->ctx->mem_type = mem_type;
+	pdf->ctx->triage_memo = NULL;
+	pdf->ctx->triage_memo_sz = 0;
+	pdf->ctx->images = NULL;
+	pdf->ctx->image_cnt = pdf->ctx->image_cap = 0;
+	pdf->ctx->image_hits = pdf->ctx->image_misses = 0;
+	pdf->ctx->resources = NULL;
+	pdf->ctx->resources_cnt = pdf->ctx->resources_cap = 0;
+	pdf->ctx->fd = -1;
+	pdf->ctx->main_xref = 0;
+	pdf->ctx->linear_page.num = pdf->ctx->linear_page.gen = 0;
+	pdf->ctx->linear_page_cnt = 0;
+	pdf->ctx->arena = NULL;
+	pdf->ctx->arr_stack = NULL;
+	pdf->ctx->arr_stack_sz = pdf->ctx->arr_stack_cap = 0;
+	pdf->ctx->dict_stack = NULL;
+	pdf->ctx->dict_stack_sz = pdf->ctx->dict_stack_cap = 0;
+	pdf->ctx->share = 0;
+	pdf->ctx->shared = NULL;
+	pdf->ctx->shared_cnt = pdf->ctx->shared_cap = 0;
+	pdf->ctx->share_hits = pdf->ctx->share_misses = 0;
+	pdf->ctx->share_bytes = 0;
+	pdf->ctx->crypt = NULL;
+	pdf->ctx->crypt_strs = 0;
+
+	PDF_ERRIF(pdf->xref_tbl || pdf->xref_tbl_sz, 1,
+	          "pdf struct data not zero-d\n");
+
+	pdf__readline(pdf->ctx);
+	if (strncmp(pdf->ctx->buf, "%PDF-1.", 7))
+		PDF_ERR(1, "invalid header line\n");
+
+	pdf->version = atoi(pdf->ctx->buf+7);
+	if (pdf->version > 7)
+		PDF_ERR(1, "invalid PDF version '%u'\n", pdf->version);
+
+	if (pdf__init_linearized(pdf, sz))
+		return 0;
+
+	/* startxref is near the end, after any trailing garbage */
+	p = data + sz - 9;
+	while (p >= data && data + sz - p < 1024 && memcmp(p, "startxref", 9))
+		--p;
+	PDF_ERRIF(p < data || data + sz - p >= 1024, 1,
+	          "failed to locate xref table position\n");
+	p += 9;
+	xref_pos = 0;
+	while (p < data + sz && isspace((unsigned char)*p))
+		++p;
+	while (p < data + sz && isdigit((unsigned char)*p))
+		xref_pos = 10*xref_pos + (*p++ - '0');
+	PDF_ERRIF(!xref_pos, 1, "failed to parse xref table position\n");
+
+	if (pdf__seek(pdf->ctx, xref_pos))
+		PDF_ERR(1, "failed to lookup xref table\n");
+
+	ret = pdf__parse_xref(pdf, &trailer);
+	if (PDF_OK(ret) && pdf->xref_tbl_sz < 4) {
+		PDF_LOG("too few (%lu) objects found in xref table\n",
+		        pdf->xref_tbl_sz);
+		ret = 1;
+	}
+	if (PDF_OK(ret))
+		ret = pdf__validate_trailer(pdf, &trailer);
+	return ret;
+}
+
+AMFDEF int pdf_init_from_memory(struct pdf *pdf, const void *data,
+                                size_t sz)
+{
+	return pdf__init(pdf, data, sz, PDF__MEM_BORROWED);
+}
+
+AMFDEF int pdf_init_from_stream(struct pdf *pdf, FILE *stream)
+{
+	char *data = NULL;
+	size_t sz = 0, cap = 0, n;
+
+	do {
+		if (sz == cap) {
+			cap = cap ? 2*cap : 1 << 16;
+			data = PDF_REALLOC(data, cap);
+		}
+		n = fread(data + sz, 1, cap - sz, stream);
+		sz += n;
+	} while (n);
+	if (ferror(stream)) {
+		fclose(stream);
+		PDF_FREE(data);
+		PDF_ERR(1, "failed to read pdf stream\n");
+	}
+	fclose(stream);
+	return pdf__init(pdf, data, sz, PDF__MEM_HEAP);
+}
+
+AMFDEF int pdf_init_from_file(struct pdf *pdf, const char *fname)
+{
+#ifdef PDF__MMAP
+	struct stat st;
+	void *data;
+	int fd = open(fname, O_RDONLY), ret;
+
+	PDF_ERRIF(fd < 0, 1, "failed to open file '%s'\n", fname);
+	if (fstat(fd, &st) || st.st_size == 0) {
+		close(fd);
+		PDF_ERR(1, "failed to stat file '%s'\n", fname);
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		close(fd);
+		PDF_ERR(1, "failed to map file '%s'\n", fname);
+	}
+	/* kept open for pdf_load_objects to read through */
+	ret = pdf__init(pdf, data, st.st_size, PDF__MEM_MAPPED);
+	pdf->ctx->fd = fd;
+	return ret;
+#else
+	FILE *fp = fopen(fname, "rb");
+	PDF_ERRIF(!fp, 1, "failed to open file '%s'\n", fname);
+	return pdf_init_from_stream(pdf, fp);
+#endif
+}
+
+#ifdef PDF_ZLIB
+/* Based on zlib zpipe.c example */
+static int pdf__zlib_inflate(char **stream, size_t *sz)
+{
+	int ret;
+	z_stream strm;
+	char *out;
+	size_t out_sz = 0, out_cap;
+
+	if (*sz == 0)
+		return Z_OK;
+
+	/* allocate inflate state */
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+	strm.avail_in = 0;
+	strm.next_in = Z_NULL;
+	ret = inflateInit(&strm);
+	if (ret != Z_OK)
+		return ret;
+
+	strm.avail_in = *sz;
+	strm.next_in = (unsigned char*)*stream;
+
+	/* inflate straight into an output buffer grown as needed */
+	out_cap = 4 * *sz + 1;
+	out = PDF_MALLOC(out_cap);
+	do {
+		if (out_cap - out_sz == 1) {
+			out_cap *= 2;
+			out = PDF_REALLOC(out, out_cap);
+		}
+		strm.avail_out = out_cap - out_sz - 1;
+		strm.next_out = (unsigned char*)out + out_sz;
+		ret = inflate(&strm, Z_NO_FLUSH);
+		assert(ret != Z_STREAM_ERROR); /* state not clobbered */
+		switch (ret) {
+		case Z_NEED_DICT:
+			ret = Z_DATA_ERROR; /* and fall through */
+		case Z_DATA_ERROR:
+		case Z_MEM_ERROR:
+			(void)inflateEnd(&strm);
+			PDF_FREE(out);
+			return ret;
+		}
+		out_sz = out_cap - 1 - strm.avail_out;
+	} while (ret != Z_STREAM_END && strm.avail_out == 0);
+	out[out_sz] = '\0';
+
+	/* clean up and return */
+	(void)inflateEnd(&strm);
+	PDF_FREE(*stream);
+	*stream = out;
+	*sz = out_sz;
+	return Z_OK;
+}
+#endif
+
+/*
+ * ASCII filters
+ *
+ * Hex digits and base-85 digits are checked a vector at a time; a vector
+ * of nothing but digits is converted without per-byte tests, anything else
+ * (whitespace, odd runs, the tail) goes through the scalar loop.
+ */
+
+static int ps__hex_digit(int c);
+
+/*
+ * Decodes hex digits from *pp up to end or the first byte that is neither
+ * a digit nor whitespace, which *pp is left at.  An odd digit carries over
+ * in *hi, -1 when there is none.  out may be the input itself.
+ */
+static size_t pdf__hex_decode(const char **pp, const char *end, char *out,
+                              int *hi)
+{
+	const char *p = *pp;
+	char *start = out;
+	int d, ws;
+
+	while (p < end) {
+#if defined(PDF__SSE2)
+		const __m128i nib = _mm_set1_epi8(0x0f), nine = _mm_set1_epi8(9);
+		const __m128i low = _mm_set1_epi16(0x00ff), lower = _mm_set1_epi8(0x20);
+		for (; *hi < 0 && end - p >= 16; p += 16, out += 8) {
+			__m128i v = _mm_loadu_si128((const __m128i *)p);
+			__m128i l = _mm_or_si128(v, lower);
+			__m128i dig = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0'-1)),
+			                            _mm_cmplt_epi8(v, _mm_set1_epi8('9'+1)));
+			__m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(l, _mm_set1_epi8('a'-1)),
+			                              _mm_cmplt_epi8(l, _mm_set1_epi8('f'+1)));
+			if (_mm_movemask_epi8(_mm_or_si128(dig, alpha)) != 0xffff)
+				break;
+			/* a digit is its low nibble, plus 9 for a-f */
+			v = _mm_add_epi8(_mm_and_si128(v, nib), _mm_and_si128(alpha, nine));
+			v = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v, low), 4),
+			                 _mm_srli_epi16(v, 8));
+			_mm_storel_epi64((__m128i *)out, _mm_packus_epi16(v, v));
+		}
+#endif
+		/* up to the digit after the next whitespace, where vectors fit again */
+		for (ws = 0; p < end; ++p) {
+			if ((d = ps__hex_digit(*p)) < 0) {
+				if (pdf__cc[(unsigned char)*p] != PDF__CC_WS) {
+					*pp = p;
+					return out - start;
+				}
+				ws = 1;
+			} else if (*hi >= 0) {
+				*out++ = (char)(*hi << 4 | d);
+				*hi = -1;
+			} else if (ws) {
+				break;
+			} else {
+				*hi = d;
+			}
+		}
+	}
+	*pp = p;
+	return out - start;
+}
+
+static int pdf__ahx_decode(char **stream, size_t *sz)
+{
+	const char *p = *stream, *end = p + *sz;
+	int hi = -1;
+	size_t out_sz = pdf__hex_decode(&p, end, *stream, &hi);
+
+	PDF_ERRIF(p < end && *p != '>', 1,
+	          "invalid byte 0x%02x in ASCIIHexDecode stream\n",
+	          (unsigned char)*p);
+	/* a final odd digit is followed by an implied 0 */
+	if (hi >= 0)
+		(*stream)[out_sz++] = (char)(hi << 4);
+	(*stream)[out_sz] = '\0';
+	*sz = out_sz;
+	return 0;
+}
+
+/* Number of leading bytes of p[0..16) that are base-85 digits */
+static int pdf__a85_run(const char *p)
+{
+#if defined(PDF__SSE2)
+	__m128i v = _mm_loadu_si128((const __m128i *)p);
+	int m = _mm_movemask_epi8(_mm_and_si128(
+	                          _mm_cmpgt_epi8(v, _mm_set1_epi8('!'-1)),
+	                          _mm_cmplt_epi8(v, _mm_set1_epi8('u'+1))));
+	return m == 0xffff ? 16 : __builtin_ctz(~m);
+#else
+	int n = 0;
+	while (n < 16 && p[n] >= '!' && p[n] <= 'u')
+		++n;
+	return n;
+#endif
+}
+
+/* Stores the 4 bytes 5 base-85 digits denote, nonzero if they overflow */
+static int pdf__a85_group(const char *p, char *out)
+{
+	/* independent terms rather than a chain of multiply-adds */
+	unsigned long long v =   52200625ull*(unsigned char)(p[0] - '!')
+	                       + 614125u*(unsigned char)(p[1] - '!')
+	                       + 7225u*(unsigned char)(p[2] - '!')
+	                       + 85u*(unsigned char)(p[3] - '!')
+	                       + (unsigned char)(p[4] - '!');
+	out[0] = (char)(v >> 24);
+	out[1] = (char)(v >> 16);
+	out[2] = (char)(v >> 8);
+	out[3] = (char)v;
+	return v > 0xffffffff;
+}
+
+static int pdf__a85_decode(char **stream, size_t *sz)
+{
+	const char *p = *stream, *end = p + *sz;
+	size_t out_sz = 0, out_cap = *sz / 5 * 4 + 16;
+	char *out = PDF_MALLOC(out_cap), grp[5];
+	int n = 0, k, bad = 0;
+
+	while (p < end && !bad) {
+		/* z expands 1 byte to 4, so the output may outgrow the input */
+		if (out_cap - out_sz <= 16) {
+			out_cap *= 2;
+			out = PDF_REALLOC(out, out_cap);
+		}
+		if (n == 0 && end - p >= 16 && (k = pdf__a85_run(p)) >= 5) {
+			for (k /= 5; k > 0; --k, p += 5, out_sz += 4)
+				bad |= pdf__a85_group(p, out + out_sz);
+			continue;
+		}
+		if (*p >= '!' && *p <= 'u') {
+			grp[n++] = *p;
+			if (n == 5) {
+				bad = pdf__a85_group(grp, out + out_sz);
+				out_sz += 4;
+				n = 0;
+			}
+		} else if (*p == 'z' && n == 0) {
+			memset(out + out_sz, 0, 4);
+			out_sz += 4;
+		} else if (*p == '~') {
+			break;
+		} else if (pdf__cc[(unsigned char)*p] != PDF__CC_WS) {
+			bad = 1;
+		}
+		++p;
+	}
+	/* a final partial group is padded with u, the largest digit */
+	if (!bad && n > 1) {
+		memset(grp + n, 'u', 5 - n);
+		bad = pdf__a85_group(grp, out + out_sz);
+		out_sz += n - 1;
+	}
+	if (bad || n == 1) {
+		PDF_FREE(out);
+		PDF_ERR(1, "invalid ASCII85Decode stream\n");
+	}
+	out[out_sz] = '\0';
+	PDF_FREE(*stream);
+	*stream = out;
+	*sz = out_sz;
+	return 0;
+}
+
+/*
+ * LZW and RunLength filters
+ *
+ * Every LZW string is a run of output already written: the string a code
+ * was added for is the previous string plus the first byte of the next,
+ * and those sit side by side in the output.  The code table is then a flat
+ * array of offsets and lengths into the output, and a code is a memcpy.
+ */
+
+#define PDF__LZW_CLEAR 256
+#define PDF__LZW_EOD   257
+#define PDF__LZW_MAX   4096
+
+struct pdf__lzw_str
+{
+	size_t off;
+	size_t len;
+};
+
+static int pdf__lzw_decode(char **stream, size_t *sz, int early)
+{
+	const unsigned char *p = (const unsigned char *)*stream, *end = p + *sz;
+	struct pdf__lzw_str *tab = PDF_MALLOC(PDF__LZW_MAX * sizeof(*tab));
+	size_t out_sz = 0, out_cap = 4 * *sz + PDF__LZW_MAX, prev_off = 0;
+	char *out = PDF_MALLOC(out_cap);
+	unsigned long long bits = 0;
+	unsigned code, next = 258, width = 9, prev = PDF__LZW_CLEAR, nbits = 0;
+	size_t len, prev_len = 0;
+	int bad = 0;
+
+	for (;;) {
+		while (nbits <= 56 && p < end) {
+			bits |= (unsigned long long)*p++ << (56 - nbits);
+			nbits += 8;
+		}
+		if (nbits < width)
+			break;
+		code = (unsigned)(bits >> (64 - width));
+		bits <<= width;
+		nbits -= width;
+
+		if (code == PDF__LZW_CLEAR) {
+			next = 258;
+			width = 9;
+			prev = PDF__LZW_CLEAR;
+			continue;
+		}
+		if (code == PDF__LZW_EOD)
+			break;
+		if (code > next || (code == next && prev == PDF__LZW_CLEAR)) {
+			bad = 1;
+			break;
+		}
+		if (out_cap - out_sz <= PDF__LZW_MAX) {
+			out_cap *= 2;
+			out = PDF_REALLOC(out, out_cap);
+		}
+		if (code < 256) {
+			out[out_sz] = (char)code;
+			len = 1;
+		} else if (code < next) {
+			/*
+			 * Strings are short, so copy 8 bytes at a time.  The source
+			 * ends at or before out_sz, and what is copied past the end is
+			 * overwritten by later strings.  A source less than 8 bytes
+			 * back would overlap the chunks, so it is copied exactly.
+			 */
+			len = tab[code].len;
+			if (out_sz - tab[code].off >= 8)
+				for (size_t i = 0; i < len; i += 8)
+					memcpy(out + out_sz + i, out + tab[code].off + i, 8);
+			else
+				memcpy(out + out_sz, out + tab[code].off, len);
+		} else {
+			/* the string being defined: the previous one plus its first byte */
+			len = prev_len + 1;
+			memcpy(out + out_sz, out + prev_off, prev_len);
+			out[out_sz + prev_len] = out[prev_off];
+		}
+		if (prev != PDF__LZW_CLEAR && next < PDF__LZW_MAX) {
+			tab[next].off = prev_off;
+			tab[next].len = prev_len + 1;
+			if (++next + early == 1u << width && width < 12)
+				++width;
+		}
+		prev = code;
+		prev_off = out_sz;
+		prev_len = len;
+		out_sz += len;
+	}
+	PDF_FREE(tab);
+	if (bad) {
+		PDF_FREE(out);
+		PDF_ERR(1, "invalid LZW code %u\n", code);
+	}
+	out[out_sz] = '\0';
+	PDF_FREE(*stream);
+	*stream = out;
+	*sz = out_sz;
+	return 0;
+}
+
+/*
+ * A length byte n copies the next n + 1 bytes, 257 - n repeats the next
+ * byte for n > 128 and 128 ends the data.  The lengths are summed first so
+ * the output is allocated once.
+ */
+static int pdf__rl_decode(char **stream, size_t *sz)
+{
+	const unsigned char *p = (const unsigned char *)*stream, *end = p + *sz;
+	size_t out_sz = 0;
+	char *out;
+
+	while (p < end && *p != 128) {
+		if (*p < 128) {
+			out_sz += *p + 1;
+			p += *p + 2;
+		} else {
+			out_sz += 257 - *p;
+			p += 2;
+		}
+	}
+	PDF_ERRIF(p > end, 1, "RunLength data is truncated\n");
+
+	out = PDF_MALLOC(out_sz + 1);
+	out_sz = 0;
+	for (p = (const unsigned char *)*stream; p < end && *p != 128; ) {
+		if (*p < 128) {
+			memcpy(out + out_sz, p + 1, *p + 1);
+			out_sz += *p + 1;
+			p += *p + 2;
+		} else {
+			memset(out + out_sz, p[1], 257 - *p);
+			out_sz += 257 - *p;
+			p += 2;
+		}
+	}
+	out[out_sz] = '\0';
+	PDF_FREE(*stream);
+	*stream = out;
+	*sz = out_sz;
+	return 0;
+}
+
+/*
+ * Pixel conversion
+ *
+ * Each kernel handles whole vectors of pixels and leaves the tail to the
+ * scalar loop.  Inverted sources store 255 - v, as Adobe CMYK JPEGs and
+ * /Decode [1 0 ...] images do.
+ */
+
+static int pdf__pixel_comps(enum pdf_pixel_fmt fmt)
+{
+	switch (fmt) {
+	case PDF_PIXEL_GRAY: return 1;
+	case PDF_PIXEL_RGB:  return 3;
+	case PDF_PIXEL_CMYK: return 4;
+	default:             return 0;
+	}
+}
+
+#ifdef PDF_JPEG
+static enum pdf_pixel_fmt pdf__pixel_fmt(int comps)
+{
+	switch (comps) {
+	case 1:  return PDF_PIXEL_GRAY;
+	case 3:  return PDF_PIXEL_RGB;
+	case 4:  return PDF_PIXEL_CMYK;
+	default: return PDF_PIXEL_NATIVE;
+	}
+}
+#endif
+
+/* x / 255 rounded, for x <= 255 * 255 */
+#define PDF__DIV255(x) (((x) + 128 + (((x) + 128) >> 8)) >> 8)
+#define PDF__LUMA(r, g, b) ((77*(r) + 150*(g) + 29*(b) + 128) >> 8)
+
+/* CMYK to RGB is r = (255 - c) * (255 - k) / 255, i.e. c' * k' / 255 */
+static size_t pdf__cmyk_to_rgb(const unsigned char *src, int invert,
+                               unsigned char *dst, size_t cnt)
+{
+	size_t i = 0;
+#if defined(PDF__SSE2)
+	const __m128i zero = _mm_setzero_si128(), c128 = _mm_set1_epi16(128);
+	const __m128i flip = invert ? zero : _mm_set1_epi8(-1);
+	unsigned char tmp[16];
+	for (; i + 4 <= cnt; i += 4) {
+		__m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(src + 4*i)),
+		                          flip);
+		__m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+		__m128i klo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, 0xff), 0xff);
+		__m128i khi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, 0xff), 0xff);
+		lo = _mm_add_epi16(_mm_mullo_epi16(lo, klo), c128);
+		hi = _mm_add_epi16(_mm_mullo_epi16(hi, khi), c128);
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+		_mm_storeu_si128((__m128i *)tmp, _mm_packus_epi16(lo, hi));
+		for (int j = 0; j < 4; ++j) {
+			dst[3*(i+j)]   = tmp[4*j];
+			dst[3*(i+j)+1] = tmp[4*j+1];
+			dst[3*(i+j)+2] = tmp[4*j+2];
+		}
+	}
+#endif
+	return i;
+}
+
+AMFDEF int pdf_convert_pixels(const unsigned char *src,
+                              enum pdf_pixel_fmt src_fmt, int invert,
+                              unsigned char *dst,
+                              enum pdf_pixel_fmt dst_fmt, size_t cnt)
+{
+	int src_comps = pdf__pixel_comps(src_fmt);
+	const unsigned char flip = invert ? 0xff : 0;
+	size_t i = 0;
+
+	PDF_ERRIF(!src_comps || !pdf__pixel_comps(dst_fmt), 1,
+	          "invalid pixel format\n");
+	if (src_fmt == dst_fmt) {
+		for (; i < cnt*src_comps; ++i)
+			dst[i] = src[i] ^ flip;
+		return 0;
+	}
+
+	switch (src_fmt << 4 | dst_fmt) {
+	case PDF_PIXEL_CMYK << 4 | PDF_PIXEL_RGB:
+		i = pdf__cmyk_to_rgb(src, invert, dst, cnt);
+		for (; i < cnt; ++i) {
+			unsigned k = src[4*i+3] ^ flip ^ 0xff;
+			for (int j = 0; j < 3; ++j)
+				dst[3*i+j] = PDF__DIV255((src[4*i+j] ^ flip ^ 0xffu) * k);
+		}
+	break;
+	case PDF_PIXEL_CMYK << 4 | PDF_PIXEL_GRAY: {
+		/* through RGB in blocks, so the CMYK step stays vectorized */
+		unsigned char rgb[3*64];
+		for (; i < cnt; i += 64) {
+			size_t n = cnt - i < 64 ? cnt - i : 64;
+			pdf_convert_pixels(src + 4*i, src_fmt, invert, rgb,
+			                   PDF_PIXEL_RGB, n);
+			pdf_convert_pixels(rgb, PDF_PIXEL_RGB, 0, dst + i,
+			                   PDF_PIXEL_GRAY, n);
+		}
+	} break;
+	case PDF_PIXEL_RGB << 4 | PDF_PIXEL_GRAY:
+		for (; i < cnt; ++i)
+			dst[i] = PDF__LUMA(src[3*i] ^ flip, src[3*i+1] ^ flip,
+			                   src[3*i+2] ^ flip);
+	break;
+	case PDF_PIXEL_GRAY << 4 | PDF_PIXEL_RGB:
+		for (; i < cnt; ++i)
+			dst[3*i] = dst[3*i+1] = dst[3*i+2] = src[i] ^ flip;
+	break;
+	default:
+		PDF_ERR(1, "unsupported pixel conversion\n");
+	}
+	return 0;
+}
+
+#ifdef PDF_JPEG
+struct pdf__jpeg_error_mgr {
+	struct jpeg_error_mgr pub;
 	jmp_buf setjmp_buffer;
 };
 
@@ -970,764 +2605,4703 @@ static void pdf__jpeg_error_exit(j_common_ptr cinfo)
 	longjmp(err->setjmp_buffer, 1);
 }
 
-static int pdf__jpeg_decode(char **stream, int len)
+/* Picks the smallest DCT scale that still covers the target size */
+static int pdf__jpeg_scale_denom(int width, int height,
+                                 const struct pdf_dct_opts *opts)
+{
+	if (!opts || (opts->max_width <= 0 && opts->max_height <= 0))
+		return 1;
+	for (int denom = 8; denom > 1; denom /= 2)
+		if (   (width + denom - 1) / denom >= opts->max_width
+		    && (height + denom - 1) / denom >= opts->max_height)
+			return denom;
+	return 1;
+}
+#endif
+
+#ifdef PDF_JPEG
+/*
+ * Decodes into *pixels, or strip by strip through fn when it is set.
+ * Either way rows are read straight into the destination buffer.
+ */
+static int pdf__jpeg_decode(const char *data, size_t sz,
+                            const struct pdf_dct_opts *opts,
+                            struct pdf_image_desc *desc,
+                            unsigned char **pixels,
+                            pdf_dct_strip_fn fn, void *udata)
+{
+	struct jpeg_decompress_struct cinfo;
+	struct pdf__jpeg_error_mgr err_mgr;
+	unsigned char *volatile buffer = NULL, *volatile scratch = NULL;
+	unsigned char *rows[PDF_DCT_STRIP_ROWS];
+	enum pdf_pixel_fmt native, fmt;
+	size_t native_stride;
+	int strip_rows, invert, ret = 0;
+
+	cinfo.err = jpeg_std_error(&err_mgr.pub);
+	err_mgr.pub.error_exit = pdf__jpeg_error_exit;
+	if (setjmp(err_mgr.setjmp_buffer)) {
+		jpeg_destroy_decompress(&cinfo);
+		PDF_FREE(buffer);
+		PDF_FREE(scratch);
+		PDF_ERR(1, "Failed to decode jpeg\n");
+	}
+
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, (unsigned char*)data, sz);
+
+	jpeg_read_header(&cinfo, TRUE);
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = pdf__jpeg_scale_denom(cinfo.image_width,
+	                                          cinfo.image_height, opts);
+	jpeg_calc_output_dimensions(&cinfo);
+
+	/* Adobe CMYK is stored inverted, which /Decode [1 0 ...] undoes */
+	native = pdf__pixel_fmt(cinfo.output_components);
+	fmt = opts && opts->fmt ? opts->fmt : native;
+	invert = opts && opts->decode_inverted;
+	if (native == PDF_PIXEL_CMYK && cinfo.saw_Adobe_marker)
+		invert = !invert;
+	if (fmt != native || (invert && opts && opts->fmt)) {
+		if (   !native || !pdf__pixel_comps(fmt)
+		    || (fmt == PDF_PIXEL_CMYK && native != PDF_PIXEL_CMYK)) {
+			jpeg_destroy_decompress(&cinfo);
+			PDF_ERR(1, "unsupported jpeg pixel conversion\n");
+		}
+	} else {
+		fmt = PDF_PIXEL_NATIVE;
+	}
+
+	desc->width = cinfo.output_width;
+	desc->height = cinfo.output_height;
+	desc->components =   fmt ? pdf__pixel_comps(fmt)
+	                   : cinfo.output_components;
+	desc->stride = (size_t)cinfo.output_width * desc->components;
+	native_stride = (size_t)cinfo.output_width * cinfo.output_components;
+	if (opts && opts->header_only) {
+		jpeg_destroy_decompress(&cinfo);
+		return 0;
+	}
+
+	jpeg_start_decompress(&cinfo);
+	buffer = PDF_MALLOC(  (fn ? PDF_DCT_STRIP_ROWS : cinfo.output_height)
+	                    * desc->stride);
+	/* converted output is decoded a strip at a time into scratch */
+	if (fmt)
+		scratch = PDF_MALLOC(PDF_DCT_STRIP_ROWS * native_stride);
+	while (cinfo.output_scanline < cinfo.output_height) {
+		int y = cinfo.output_scanline, cnt = 0;
+		unsigned char *strip = fn ? buffer : buffer + y * desc->stride;
+		unsigned char *dst = fmt ? scratch : strip;
+		strip_rows = cinfo.output_height - y;
+		if (strip_rows > PDF_DCT_STRIP_ROWS)
+			strip_rows = PDF_DCT_STRIP_ROWS;
+		for (int i = 0; i < strip_rows; ++i)
+			rows[i] = dst + i * native_stride;
+		/* libjpeg returns at most rec_outbuf_height rows per call */
+		while (cnt < strip_rows)
+			cnt += jpeg_read_scanlines(&cinfo, rows + cnt, strip_rows - cnt);
+		if (fmt)
+			pdf_convert_pixels(scratch, native, invert, strip, fmt,
+			                   (size_t)cnt * cinfo.output_width);
+		if (fn && (ret = fn(udata, desc, y, strip, cnt)) != 0)
+			break;
+	}
+
+	if (ret)
+		jpeg_abort_decompress(&cinfo);
+	else
+		jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	PDF_FREE(scratch);
+	if (fn)
+		PDF_FREE(buffer);
+	else
+		*pixels = buffer;
+	return ret;
+}
+#endif
+
+AMFDEF int pdf_decode_dct(const char *data, size_t sz,
+                          const struct pdf_dct_opts *opts,
+                          struct pdf_image_desc *desc,
+                          unsigned char **pixels)
+{
+#ifdef PDF_JPEG
+	return pdf__jpeg_decode(data, sz, opts, desc, pixels, NULL, NULL);
+#else
+	PDF_ERR(1, "DCTDecode not supported without PDF_JPEG\n");
+#endif
+}
+
+AMFDEF int pdf_decode_dct_strips(const char *data, size_t sz,
+                                 const struct pdf_dct_opts *opts,
+                                 struct pdf_image_desc *desc,
+                                 pdf_dct_strip_fn fn, void *udata)
+{
+#ifdef PDF_JPEG
+	return pdf__jpeg_decode(data, sz, opts, desc, NULL, fn, udata);
+#else
+	PDF_ERR(1, "DCTDecode not supported without PDF_JPEG\n");
+#endif
+}
+
+static int pdf__decode_stream(enum pdf_stream_type *type, char **stream,
+                              size_t *sz, const struct pdf_obj_name *decoder,
+                              struct pdf_obj_dict *parms)
+{
+	struct pdf_obj *early;
+
+	int ret = 1;
+	if (pdf_name_eq(decoder, "FlateDecode")) {
+		*type = PDF_STREAM_CMD;
+#ifdef PDF_ZLIB
+		ret = pdf__zlib_inflate(stream, sz);
+		if (ret != Z_OK)
+			PDF_LOG("zlib error (%d)\n", ret);
+		return ret;
+#endif
+	}
+	/* the data was decrypted as it was read */
+	if (pdf_name_eq(decoder, "Crypt"))
+		return 0;
+	if (pdf_name_eq(decoder, "ASCIIHexDecode"))
+		return pdf__ahx_decode(stream, sz);
+	if (pdf_name_eq(decoder, "ASCII85Decode"))
+		return pdf__a85_decode(stream, sz);
+	if (pdf_name_eq(decoder, "LZWDecode")) {
+		/* EarlyChange defaults to 1 */
+		early = parms ? pdf_dict_find(parms, "EarlyChange") : NULL;
+		return pdf__lzw_decode(stream, sz, !(   early
+		                                     && early->type == PDF_OBJ_INT
+		                                     && early->intg.val == 0));
+	}
+	if (pdf_name_eq(decoder, "RunLengthDecode"))
+		return pdf__rl_decode(stream, sz);
+	if (pdf_name_eq(decoder, "DCTDecode")) {
+		/* decoded on request, at the size the caller needs */
+		*type = PDF_STREAM_JPEG;
+		return 0;
+	}
+	PDF_LOG("Filter '%.*s' not supported\n", (int)decoder->len, decoder->val);
+	return ret;
+}
+
+/* Collects the Filter name or array of names */
+static int pdf__stream_filters(struct pdf_baseobj *baseobj,
+                               struct pdf_obj_name filters[PDF_FILTER_MAX])
+{
+	struct pdf_obj *filter = pdf_dict_find(&baseobj->obj.dict, "Filter");
+	int cnt = 0;
+	if (!filter)
+		return 0;
+	if (filter->type == PDF_OBJ_NAME) {
+		filters[cnt++] = filter->name;
+		return cnt;
+	}
+	PDF_ERRIF(filter->type != PDF_OBJ_ARR, -1,
+	          "stream filter is not a name or array\n");
+	PDF_ERRIF(filter->arr.sz > PDF_FILTER_MAX, -1,
+	          "stream has too many filters\n");
+	for (size_t i = 0; i < filter->arr.sz; ++i) {
+		PDF_ERRIF(filter->arr.entries[i].type != PDF_OBJ_NAME, -1,
+		          "stream filter is not a name\n");
+		filters[cnt++] = filter->arr.entries[i].name;
+	}
+	return cnt;
+}
+
+/* The DecodeParms dict of filter i, a lone dict going with the first */
+static struct pdf_obj_dict *pdf__stream_parms(struct pdf_baseobj *baseobj,
+                                              int i)
+{
+	struct pdf_obj *parms = pdf_dict_find(&baseobj->obj.dict, "DecodeParms");
+	if (parms && parms->type == PDF_OBJ_ARR)
+		parms = (unsigned)i < parms->arr.sz ? parms->arr.entries + i : NULL;
+	else if (i > 0)
+		parms = NULL;
+	return parms && parms->type == PDF_OBJ_DICT ? &parms->dict : NULL;
+}
+
+/*
+ * Standard security handler
+ *
+ * Documents with an Encrypt dict are decrypted as objects are read:
+ * strings while the object is parsed, streams before their filters run.
+ * Only the empty user password is tried, which opens documents that only
+ * set an owner password.  RC4 (V 1-2, or a V2 crypt filter), AES-128
+ * (AESV2) and AES-256 (AESV3, R 5-6) are supported.
+ *
+ * AES uses AES-NI when the CPU supports it, and otherwise lookup tables
+ * filled in from the S-box when the document is opened.
+ */
+
+typedef char pdf__u32_check[sizeof(unsigned) == 4 ? 1 : -1];
+
+#define PDF__ROR32(x, n) ((x) >> (n) | (x) << (32 - (n)))
+#define PDF__ROR64(x, n) ((x) >> (n) | (x) << (64 - (n)))
+
+struct pdf__span
+{
+	const void *p;
+	size_t sz;
+};
+
+static const unsigned pdf__md5_k[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
+	0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+	0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340,
+	0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+	0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+	0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+	0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
+	0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+	0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const unsigned pdf__sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const unsigned long long pdf__sha512_k[80] = {
+	0x428a2f98d728ae22ull, 0x7137449123ef65cdull, 0xb5c0fbcfec4d3b2full,
+	0xe9b5dba58189dbbcull, 0x3956c25bf348b538ull, 0x59f111f1b605d019ull,
+	0x923f82a4af194f9bull, 0xab1c5ed5da6d8118ull, 0xd807aa98a3030242ull,
+	0x12835b0145706fbeull, 0x243185be4ee4b28cull, 0x550c7dc3d5ffb4e2ull,
+	0x72be5d74f27b896full, 0x80deb1fe3b1696b1ull, 0x9bdc06a725c71235ull,
+	0xc19bf174cf692694ull, 0xe49b69c19ef14ad2ull, 0xefbe4786384f25e3ull,
+	0x0fc19dc68b8cd5b5ull, 0x240ca1cc77ac9c65ull, 0x2de92c6f592b0275ull,
+	0x4a7484aa6ea6e483ull, 0x5cb0a9dcbd41fbd4ull, 0x76f988da831153b5ull,
+	0x983e5152ee66dfabull, 0xa831c66d2db43210ull, 0xb00327c898fb213full,
+	0xbf597fc7beef0ee4ull, 0xc6e00bf33da88fc2ull, 0xd5a79147930aa725ull,
+	0x06ca6351e003826full, 0x142929670a0e6e70ull, 0x27b70a8546d22ffcull,
+	0x2e1b21385c26c926ull, 0x4d2c6dfc5ac42aedull, 0x53380d139d95b3dfull,
+	0x650a73548baf63deull, 0x766a0abb3c77b2a8ull, 0x81c2c92e47edaee6ull,
+	0x92722c851482353bull, 0xa2bfe8a14cf10364ull, 0xa81a664bbc423001ull,
+	0xc24b8b70d0f89791ull, 0xc76c51a30654be30ull, 0xd192e819d6ef5218ull,
+	0xd69906245565a910ull, 0xf40e35855771202aull, 0x106aa07032bbd1b8ull,
+	0x19a4c116b8d2d0c8ull, 0x1e376c085141ab53ull, 0x2748774cdf8eeb99ull,
+	0x34b0bcb5e19b48a8ull, 0x391c0cb3c5c95a63ull, 0x4ed8aa4ae3418acbull,
+	0x5b9cca4f7763e373ull, 0x682e6ff3d6b2b8a3ull, 0x748f82ee5defb2fcull,
+	0x78a5636f43172f60ull, 0x84c87814a1f0ab72ull, 0x8cc702081a6439ecull,
+	0x90befffa23631e28ull, 0xa4506cebde82bde9ull, 0xbef9a3f7b2c67915ull,
+	0xc67178f2e372532bull, 0xca273eceea26619cull, 0xd186b8c721c0c207ull,
+	0xeada7dd6cde0eb1eull, 0xf57d4f7fee6ed178ull, 0x06f067aa72176fbaull,
+	0x0a637dc5a2c898a6ull, 0x113f9804bef90daeull, 0x1b710b35131c471bull,
+	0x28db77f523047d84ull, 0x32caab7b40c72493ull, 0x3c9ebe0a15c9bebcull,
+	0x431d67c49c100d4cull, 0x4cc5d4becb3e42b6ull, 0x597f299cfc657e2aull,
+	0x5fcb6fab3ad6faecull, 0x6c44198c4a475817ull,
+};
+
+/*
+ * Feeds the spans through fn a block at a time, then the padding: 0x80,
+ * zeros and the bit length in the last block / 8 bytes.
+ */
+static void pdf__hash_spans(const struct pdf__span *in, int cnt,
+                            size_t block, int big_endian,
+                            void (*fn)(void *, const unsigned char *),
+                            void *state)
+{
+	unsigned char buf[128];
+	unsigned long long bits = 0;
+	size_t fill = 0, n;
+
+	for (int i = 0; i < cnt; ++i) {
+		const unsigned char *p = in[i].p;
+		bits += 8 * (unsigned long long)in[i].sz;
+		for (size_t left = in[i].sz; left; left -= n, p += n) {
+			n = block - fill < left ? block - fill : left;
+			memcpy(buf + fill, p, n);
+			fill += n;
+			if (fill == block) {
+				fn(state, buf);
+				fill = 0;
+			}
+		}
+	}
+	buf[fill++] = 0x80;
+	if (fill > block - block / 8) {
+		memset(buf + fill, 0, block - fill);
+		fn(state, buf);
+		fill = 0;
+	}
+	memset(buf + fill, 0, block - fill);
+	for (int i = 0; i < 8; ++i)
+		buf[big_endian ? block - 1 - i : block - 8 + i] =
+			(unsigned char)(bits >> 8*i);
+	fn(state, buf);
+}
+
+static void pdf__md5_block(void *state, const unsigned char *p)
+{
+	static const unsigned char rot[4][4] = {
+		{ 7, 12, 17, 22 }, { 5, 9, 14, 20 }, { 4, 11, 16, 23 }, { 6, 10, 15, 21 },
+	};
+	unsigned *h = state, w[16], a = h[0], b = h[1], c = h[2], d = h[3], f, t;
+	int g;
+
+	for (int i = 0; i < 16; ++i)
+		w[i] = p[4*i] | p[4*i+1] << 8 | p[4*i+2] << 16 | (unsigned)p[4*i+3] << 24;
+	for (int i = 0; i < 64; ++i) {
+		switch (i / 16) {
+		case 0:  f = (b & c) | (~b & d); g = i;               break;
+		case 1:  f = (d & b) | (~d & c); g = (5*i + 1) & 15;  break;
+		case 2:  f = b ^ c ^ d;          g = (3*i + 5) & 15;  break;
+		default: f = c ^ (b | ~d);       g = (7*i) & 15;      break;
+		}
+		f += a + pdf__md5_k[i] + w[g];
+		t = d;
+		d = c;
+		c = b;
+		b += f << rot[i/16][i%4] | f >> (32 - rot[i/16][i%4]);
+		a = t;
+	}
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+}
+
+static void pdf__md5(const struct pdf__span *in, int cnt,
+                     unsigned char out[16])
+{
+	unsigned h[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	pdf__hash_spans(in, cnt, 64, 0, pdf__md5_block, h);
+	for (int i = 0; i < 16; ++i)
+		out[i] = (unsigned char)(h[i/4] >> 8*(i%4));
+}
+
+static void pdf__sha256_block(void *state, const unsigned char *p)
+{
+	unsigned *h = state, w[64], s[8], t1, t2;
+
+	for (int i = 0; i < 16; ++i)
+		w[i] = (unsigned)p[4*i] << 24 | p[4*i+1] << 16 | p[4*i+2] << 8 | p[4*i+3];
+	for (int i = 16; i < 64; ++i)
+		w[i] =   w[i-16] + w[i-7]
+		       + (PDF__ROR32(w[i-15], 7) ^ PDF__ROR32(w[i-15], 18) ^ w[i-15] >> 3)
+		       + (PDF__ROR32(w[i-2], 17) ^ PDF__ROR32(w[i-2], 19) ^ w[i-2] >> 10);
+	memcpy(s, h, sizeof(s));
+	for (int i = 0; i < 64; ++i) {
+		t1 =   s[7] + pdf__sha256_k[i] + w[i]
+		     + (PDF__ROR32(s[4], 6) ^ PDF__ROR32(s[4], 11) ^ PDF__ROR32(s[4], 25))
+		     + ((s[4] & s[5]) ^ (~s[4] & s[6]));
+		t2 =   (PDF__ROR32(s[0], 2) ^ PDF__ROR32(s[0], 13) ^ PDF__ROR32(s[0], 22))
+		     + ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+		memmove(s + 1, s, 7 * sizeof(*s));
+		s[4] += t1;
+		s[0] = t1 + t2;
+	}
+	for (int i = 0; i < 8; ++i)
+		h[i] += s[i];
+}
+
+static void pdf__sha256(const struct pdf__span *in, int cnt,
+                        unsigned char out[32])
+{
+	unsigned h[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+	pdf__hash_spans(in, cnt, 64, 1, pdf__sha256_block, h);
+	for (int i = 0; i < 32; ++i)
+		out[i] = (unsigned char)(h[i/4] >> (24 - 8*(i%4)));
+}
+
+static void pdf__sha512_block(void *state, const unsigned char *p)
+{
+	unsigned long long *h = state, w[80], s[8], t1, t2;
+
+	for (int i = 0; i < 16; ++i) {
+		w[i] = 0;
+		for (int j = 0; j < 8; ++j)
+			w[i] = w[i] << 8 | p[8*i+j];
+	}
+	for (int i = 16; i < 80; ++i)
+		w[i] =   w[i-16] + w[i-7]
+		       + (PDF__ROR64(w[i-15], 1) ^ PDF__ROR64(w[i-15], 8) ^ w[i-15] >> 7)
+		       + (PDF__ROR64(w[i-2], 19) ^ PDF__ROR64(w[i-2], 61) ^ w[i-2] >> 6);
+	memcpy(s, h, sizeof(s));
+	for (int i = 0; i < 80; ++i) {
+		t1 =   s[7] + pdf__sha512_k[i] + w[i]
+		     + (PDF__ROR64(s[4], 14) ^ PDF__ROR64(s[4], 18) ^ PDF__ROR64(s[4], 41))
+		     + ((s[4] & s[5]) ^ (~s[4] & s[6]));
+		t2 =   (PDF__ROR64(s[0], 28) ^ PDF__ROR64(s[0], 34) ^ PDF__ROR64(s[0], 39))
+		     + ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+		memmove(s + 1, s, 7 * sizeof(*s));
+		s[4] += t1;
+		s[0] = t1 + t2;
+	}
+	for (int i = 0; i < 8; ++i)
+		h[i] += s[i];
+}
+
+/* SHA-512, or SHA-384 when out_sz is 48 */
+static void pdf__sha512(const struct pdf__span *in, int cnt,
+                        unsigned char *out, int out_sz)
+{
+	static const unsigned long long h512[8] = {
+		0x6a09e667f3bcc908ull, 0xbb67ae8584caa73bull, 0x3c6ef372fe94f82bull,
+		0xa54ff53a5f1d36f1ull, 0x510e527fade682d1ull, 0x9b05688c2b3e6c1full,
+		0x1f83d9abfb41bd6bull, 0x5be0cd19137e2179ull,
+	};
+	static const unsigned long long h384[8] = {
+		0xcbbb9d5dc1059ed8ull, 0x629a292a367cd507ull, 0x9159015a3070dd17ull,
+		0x152fecd8f70e5939ull, 0x67332667ffc00b31ull, 0x8eb44a8768581511ull,
+		0xdb0c2e0d64f98fa7ull, 0x47b5481dbefa4fa4ull,
+	};
+	unsigned long long h[8];
+	memcpy(h, out_sz == 48 ? h384 : h512, sizeof(h));
+	pdf__hash_spans(in, cnt, 128, 1, pdf__sha512_block, h);
+	for (int i = 0; i < out_sz; ++i)
+		out[i] = (unsigned char)(h[i/8] >> (56 - 8*(i%8)));
+}
+
+static void pdf__rc4(const unsigned char *key, size_t key_len,
+                     unsigned char *data, size_t sz)
+{
+	unsigned char s[256], t;
+	unsigned i, j = 0;
+
+	for (i = 0; i < 256; ++i)
+		s[i] = (unsigned char)i;
+	for (i = 0; i < 256; ++i) {
+		j = (j + s[i] + key[i % key_len]) & 255;
+		t = s[i], s[i] = s[j], s[j] = t;
+	}
+	i = j = 0;
+	for (size_t n = 0; n < sz; ++n) {
+		i = (i + 1) & 255;
+		j = (j + s[i]) & 255;
+		t = s[i], s[i] = s[j], s[j] = t;
+		data[n] ^= s[(s[i] + s[j]) & 255];
+	}
+}
+
+/*
+ * S-boxes and the round tables derived from them: te[i] and td[i] are the
+ * first table rotated right by 8 * i bits, one per row of the state.
+ */
+struct pdf__aes_tables
+{
+	unsigned char sbox[256], inv_sbox[256];
+	unsigned te[4][256], td[4][256];
+	int aesni;
+};
+
+static unsigned char pdf__gf_mul(unsigned char a, unsigned char b)
+{
+	unsigned char r = 0;
+	for (; b; b >>= 1) {
+		if (b & 1)
+			r ^= a;
+		a = (unsigned char)(a << 1 ^ (a & 0x80 ? 0x1b : 0));
+	}
+	return r;
+}
+
+static void pdf__aes_tables_init(struct pdf__aes_tables *t)
+{
+	unsigned char p = 1, q = 1, s, x;
+	unsigned e, d;
+
+	/* p steps through the field's units by 3, q by its inverse */
+	do {
+		p = (unsigned char)(p ^ p << 1 ^ (p & 0x80 ? 0x1b : 0));
+		q ^= q << 1;
+		q ^= q << 2;
+		q ^= q << 4;
+		q ^= q & 0x80 ? 0x09 : 0;
+		x = (unsigned char)(q ^ (q << 1 | q >> 7) ^ (q << 2 | q >> 6)
+		                      ^ (q << 3 | q >> 5) ^ (q << 4 | q >> 4));
+		t->sbox[p] = x ^ 0x63;
+	} while (p != 1);
+	t->sbox[0] = 0x63;
+	for (int i = 0; i < 256; ++i)
+		t->inv_sbox[t->sbox[i]] = (unsigned char)i;
+	for (int i = 0; i < 256; ++i) {
+		s = t->sbox[i];
+		e =   (unsigned)pdf__gf_mul(s, 2) << 24 | s << 16 | s << 8
+		    | pdf__gf_mul(s, 3);
+		s = t->inv_sbox[i];
+		d =   (unsigned)pdf__gf_mul(s, 14) << 24 | pdf__gf_mul(s, 9) << 16
+		    | pdf__gf_mul(s, 13) << 8 | pdf__gf_mul(s, 11);
+		t->te[0][i] = e;
+		t->td[0][i] = d;
+		for (int r = 1; r < 4; ++r) {
+			t->te[r][i] = e = PDF__ROR32(e, 8);
+			t->td[r][i] = d = PDF__ROR32(d, 8);
+		}
+	}
+#if defined(PDF__AESNI)
+	t->aesni = PDF__AESNI_CPU;
+#else
+	t->aesni = 0;
+#endif
+}
+
+/*
+ * Round keys for both directions, decryption's for the equivalent cipher,
+ * as words for the tables or as vectors for AES-NI.
+ */
+union pdf__aes_keys
+{
+	unsigned w[60];
+#if defined(PDF__AESNI)
+	__m128i x[15];
+#endif
+};
+
+struct pdf__aes
+{
+	union pdf__aes_keys ek, dk;
+	int rounds;
+	int aesni;
+};
+
+static unsigned pdf__load_be32(const unsigned char *p)
+{
+	return (unsigned)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void pdf__store_be32(unsigned char *p, unsigned v)
+{
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+#if defined(PDF__AESNI)
+PDF__AESNI_FN
+static void pdf__aes_init_ni(struct pdf__aes *aes, const unsigned char *rk)
+{
+	for (int r = 0; r <= aes->rounds; ++r)
+		aes->ek.x[r] = _mm_loadu_si128((const __m128i *)(rk + 16*r));
+	aes->dk.x[0] = aes->ek.x[aes->rounds];
+	for (int r = 1; r < aes->rounds; ++r)
+		aes->dk.x[r] = _mm_aesimc_si128(aes->ek.x[aes->rounds - r]);
+	aes->dk.x[aes->rounds] = aes->ek.x[0];
+}
+#endif
+
+/* key_len is 16 or 32 */
+static void pdf__aes_init(struct pdf__aes *aes, const struct pdf__aes_tables *t,
+                          const unsigned char *key, int key_len)
+{
+	unsigned char rk[240], tmp[4], c, rcon = 1;
+	int nk = key_len / 4, words;
+
+	aes->rounds = nk + 6;
+	aes->aesni = t->aesni;
+	words = 4 * (aes->rounds + 1);
+	memcpy(rk, key, key_len);
+	for (int i = nk; i < words; ++i) {
+		memcpy(tmp, rk + 4*(i-1), 4);
+		if (i % nk == 0) {
+			c = tmp[0];
+			tmp[0] = t->sbox[tmp[1]] ^ rcon;
+			tmp[1] = t->sbox[tmp[2]];
+			tmp[2] = t->sbox[tmp[3]];
+			tmp[3] = t->sbox[c];
+			rcon = pdf__gf_mul(rcon, 2);
+		} else if (nk > 6 && i % nk == 4) {
+			for (int j = 0; j < 4; ++j)
+				tmp[j] = t->sbox[tmp[j]];
+		}
+		for (int j = 0; j < 4; ++j)
+			rk[4*i+j] = rk[4*(i-nk)+j] ^ tmp[j];
+	}
+#if defined(PDF__AESNI)
+	if (aes->aesni) {
+		pdf__aes_init_ni(aes, rk);
+		return;
+	}
+#endif
+	for (int i = 0; i < words; ++i)
+		aes->ek.w[i] = pdf__load_be32(rk + 4*i);
+	for (int r = 0; r <= aes->rounds; ++r) {
+		for (int j = 0; j < 4; ++j) {
+			unsigned w = aes->ek.w[4*(aes->rounds - r) + j];
+			/* InvMixColumns, as td undoes the S-box it applies */
+			if (r > 0 && r < aes->rounds)
+				w =   t->td[0][t->sbox[w >> 24]]
+				    ^ t->td[1][t->sbox[w >> 16 & 255]]
+				    ^ t->td[2][t->sbox[w >> 8 & 255]]
+				    ^ t->td[3][t->sbox[w & 255]];
+			aes->dk.w[4*r + j] = w;
+		}
+	}
+}
+
+/*
+ * One block, as big-endian words, through the table rounds.  Column c of
+ * a round takes row i from column c + i for encryption and c - i for
+ * decryption, so a, b, c and d name the columns feeding each row.
+ */
+#define PDF__AES_COL(tab, a, b, c, d, k) \
+	(  tab[0][(a) >> 24] ^ tab[1][(b) >> 16 & 255] \
+	 ^ tab[2][(c) >> 8 & 255] ^ tab[3][(d) & 255] ^ (k))
+#define PDF__AES_LAST(box, a, b, c, d, k) \
+	(  (  (unsigned)box[(a) >> 24] << 24 | box[(b) >> 16 & 255] << 16 \
+	    | box[(c) >> 8 & 255] << 8 | box[(d) & 255]) \
+	 ^ (k))
+
+static void pdf__aes_encrypt_block(const struct pdf__aes *aes,
+                                   const struct pdf__aes_tables *t,
+                                   unsigned s[4])
+{
+	const unsigned *rk = aes->ek.w;
+	const unsigned (*te)[256] = t->te;
+	unsigned s0 = s[0] ^ rk[0], s1 = s[1] ^ rk[1];
+	unsigned s2 = s[2] ^ rk[2], s3 = s[3] ^ rk[3];
+	unsigned x0, x1, x2, x3;
+
+	for (int r = 1; r < aes->rounds; ++r) {
+		rk += 4;
+		x0 = PDF__AES_COL(te, s0, s1, s2, s3, rk[0]);
+		x1 = PDF__AES_COL(te, s1, s2, s3, s0, rk[1]);
+		x2 = PDF__AES_COL(te, s2, s3, s0, s1, rk[2]);
+		x3 = PDF__AES_COL(te, s3, s0, s1, s2, rk[3]);
+		s0 = x0, s1 = x1, s2 = x2, s3 = x3;
+	}
+	rk += 4;
+	s[0] = PDF__AES_LAST(t->sbox, s0, s1, s2, s3, rk[0]);
+	s[1] = PDF__AES_LAST(t->sbox, s1, s2, s3, s0, rk[1]);
+	s[2] = PDF__AES_LAST(t->sbox, s2, s3, s0, s1, rk[2]);
+	s[3] = PDF__AES_LAST(t->sbox, s3, s0, s1, s2, rk[3]);
+}
+
+static void pdf__aes_decrypt_block(const struct pdf__aes *aes,
+                                   const struct pdf__aes_tables *t,
+                                   unsigned s[4])
+{
+	const unsigned *rk = aes->dk.w;
+	const unsigned (*td)[256] = t->td;
+	unsigned s0 = s[0] ^ rk[0], s1 = s[1] ^ rk[1];
+	unsigned s2 = s[2] ^ rk[2], s3 = s[3] ^ rk[3];
+	unsigned x0, x1, x2, x3;
+
+	for (int r = 1; r < aes->rounds; ++r) {
+		rk += 4;
+		x0 = PDF__AES_COL(td, s0, s3, s2, s1, rk[0]);
+		x1 = PDF__AES_COL(td, s1, s0, s3, s2, rk[1]);
+		x2 = PDF__AES_COL(td, s2, s1, s0, s3, rk[2]);
+		x3 = PDF__AES_COL(td, s3, s2, s1, s0, rk[3]);
+		s0 = x0, s1 = x1, s2 = x2, s3 = x3;
+	}
+	rk += 4;
+	s[0] = PDF__AES_LAST(t->inv_sbox, s0, s3, s2, s1, rk[0]);
+	s[1] = PDF__AES_LAST(t->inv_sbox, s1, s0, s3, s2, rk[1]);
+	s[2] = PDF__AES_LAST(t->inv_sbox, s2, s1, s0, s3, rk[2]);
+	s[3] = PDF__AES_LAST(t->inv_sbox, s3, s2, s1, s0, rk[3]);
+}
+
+#if defined(PDF__AESNI)
+PDF__AESNI_FN
+static void pdf__aes_cbc_encrypt_ni(const struct pdf__aes *aes,
+                                    const unsigned char iv[16],
+                                    unsigned char *p, size_t sz)
+{
+	__m128i x = _mm_loadu_si128((const __m128i *)iv);
+	for (; sz >= 16; sz -= 16, p += 16) {
+		x = _mm_xor_si128(x, _mm_loadu_si128((const __m128i *)p));
+		x = _mm_xor_si128(x, aes->ek.x[0]);
+		for (int r = 1; r < aes->rounds; ++r)
+			x = _mm_aesenc_si128(x, aes->ek.x[r]);
+		x = _mm_aesenclast_si128(x, aes->ek.x[aes->rounds]);
+		_mm_storeu_si128((__m128i *)p, x);
+	}
+}
+
+/* blocks decrypt independently, so four are kept in flight */
+PDF__AESNI_FN
+static void pdf__aes_cbc_decrypt_ni(const struct pdf__aes *aes,
+                                    const unsigned char iv[16],
+                                    unsigned char *p, size_t sz)
+{
+	__m128i prev = _mm_loadu_si128((const __m128i *)iv), k;
+	__m128i b0, b1, b2, b3, x0, x1, x2, x3;
+	for (; sz >= 64; sz -= 64, p += 64) {
+		k = aes->dk.x[0];
+		b0 = _mm_loadu_si128((const __m128i *)p);
+		b1 = _mm_loadu_si128((const __m128i *)p + 1);
+		b2 = _mm_loadu_si128((const __m128i *)p + 2);
+		b3 = _mm_loadu_si128((const __m128i *)p + 3);
+		x0 = _mm_xor_si128(b0, k);
+		x1 = _mm_xor_si128(b1, k);
+		x2 = _mm_xor_si128(b2, k);
+		x3 = _mm_xor_si128(b3, k);
+		for (int r = 1; r < aes->rounds; ++r) {
+			k = aes->dk.x[r];
+			x0 = _mm_aesdec_si128(x0, k);
+			x1 = _mm_aesdec_si128(x1, k);
+			x2 = _mm_aesdec_si128(x2, k);
+			x3 = _mm_aesdec_si128(x3, k);
+		}
+		k = aes->dk.x[aes->rounds];
+		x0 = _mm_aesdeclast_si128(x0, k);
+		x1 = _mm_aesdeclast_si128(x1, k);
+		x2 = _mm_aesdeclast_si128(x2, k);
+		x3 = _mm_aesdeclast_si128(x3, k);
+		_mm_storeu_si128((__m128i *)p, _mm_xor_si128(x0, prev));
+		_mm_storeu_si128((__m128i *)p + 1, _mm_xor_si128(x1, b0));
+		_mm_storeu_si128((__m128i *)p + 2, _mm_xor_si128(x2, b1));
+		_mm_storeu_si128((__m128i *)p + 3, _mm_xor_si128(x3, b2));
+		prev = b3;
+	}
+	for (; sz >= 16; sz -= 16, p += 16) {
+		b0 = _mm_loadu_si128((const __m128i *)p);
+		x0 = _mm_xor_si128(b0, aes->dk.x[0]);
+		for (int r = 1; r < aes->rounds; ++r)
+			x0 = _mm_aesdec_si128(x0, aes->dk.x[r]);
+		x0 = _mm_aesdeclast_si128(x0, aes->dk.x[aes->rounds]);
+		_mm_storeu_si128((__m128i *)p, _mm_xor_si128(x0, prev));
+		prev = b0;
+	}
+}
+#endif
+
+/* CBC over sz bytes in place, sz a multiple of 16 */
+static void pdf__aes_cbc_encrypt(const struct pdf__aes *aes,
+                                 const struct pdf__aes_tables *t,
+                                 const unsigned char iv[16],
+                                 unsigned char *p, size_t sz)
+{
+	unsigned s[4];
+
+#if defined(PDF__AESNI)
+	if (aes->aesni) {
+		pdf__aes_cbc_encrypt_ni(aes, iv, p, sz);
+		return;
+	}
+#endif
+	for (int i = 0; i < 4; ++i)
+		s[i] = pdf__load_be32(iv + 4*i);
+	for (; sz >= 16; sz -= 16, p += 16) {
+		for (int i = 0; i < 4; ++i)
+			s[i] ^= pdf__load_be32(p + 4*i);
+		pdf__aes_encrypt_block(aes, t, s);
+		for (int i = 0; i < 4; ++i)
+			pdf__store_be32(p + 4*i, s[i]);
+	}
+}
+
+static void pdf__aes_cbc_decrypt(const struct pdf__aes *aes,
+                                 const struct pdf__aes_tables *t,
+                                 const unsigned char iv[16],
+                                 unsigned char *p, size_t sz)
+{
+	unsigned prev[4], cur[4], s[4];
+
+#if defined(PDF__AESNI)
+	if (aes->aesni) {
+		pdf__aes_cbc_decrypt_ni(aes, iv, p, sz);
+		return;
+	}
+#endif
+	for (int i = 0; i < 4; ++i)
+		prev[i] = pdf__load_be32(iv + 4*i);
+	for (; sz >= 16; sz -= 16, p += 16) {
+		for (int i = 0; i < 4; ++i)
+			s[i] = cur[i] = pdf__load_be32(p + 4*i);
+		pdf__aes_decrypt_block(aes, t, s);
+		for (int i = 0; i < 4; ++i) {
+			pdf__store_be32(p + 4*i, s[i] ^ prev[i]);
+			prev[i] = cur[i];
+		}
+	}
+}
+
+enum pdf__cipher
+{
+	PDF__CIPHER_NONE,
+	PDF__CIPHER_RC4,
+	PDF__CIPHER_AES128,
+	PDF__CIPHER_AES256,
+};
+
+struct pdf__crypt
+{
+	enum pdf__cipher str_cipher, stm_cipher;
+	unsigned char key[32];
+	int key_len;
+	int encrypt_metadata;
+	struct pdf__aes_tables aes;
+};
+
+/*
+ * Decrypts sz bytes of object id in place and returns the plaintext size.
+ * AES data is a 16 byte IV followed by the padded CBC blocks.
+ */
+static size_t pdf__decrypt(const struct pdf__crypt *crypt,
+                           enum pdf__cipher cipher, struct pdf_objid id,
+                           unsigned char *data, size_t sz)
+{
+	unsigned char obj_key[16], ref[5];
+	struct pdf__span in[3] = { { NULL, 0 }, { ref, 5 }, { "sAlT", 4 } };
+	struct pdf__aes aes;
+	const unsigned char *key = obj_key;
+	int key_len, pad;
+
+	if (cipher == PDF__CIPHER_NONE)
+		return sz;
+	if (cipher == PDF__CIPHER_AES256) {
+		/* AES-256 uses the file key for every object */
+		key = crypt->key;
+		key_len = 32;
+	} else {
+		ref[0] = (unsigned char)id.num;
+		ref[1] = (unsigned char)(id.num >> 8);
+		ref[2] = 0;
+		ref[3] = (unsigned char)id.gen;
+		ref[4] = (unsigned char)(id.gen >> 8);
+		in[0].p = crypt->key;
+		in[0].sz = crypt->key_len;
+		pdf__md5(in, cipher == PDF__CIPHER_AES128 ? 3 : 2, obj_key);
+		key_len = crypt->key_len + 5 < 16 ? crypt->key_len + 5 : 16;
+	}
+	if (cipher == PDF__CIPHER_RC4) {
+		pdf__rc4(key, key_len, data, sz);
+		return sz;
+	}
+	if (sz < 32)
+		return 0;
+	pdf__aes_init(&aes, &crypt->aes, key, key_len);
+	sz = (sz - 16) & ~(size_t)15;
+	pdf__aes_cbc_decrypt(&aes, &crypt->aes, data, data + 16, sz);
+	memmove(data, data + 16, sz);
+	pad = data[sz - 1];
+	return pad >= 1 && pad <= 16 ? sz - pad : sz;
+}
+
+/*
+ * Strings of the object being parsed are decrypted and stored in the
+ * arena as literal strings, with backslashes and CRs escaped so that they
+ * decode to the plaintext.
+ */
+static int pdf__decrypt_str(struct pdf__ctx *ctx, struct pdf_obj *obj)
+{
+	const struct pdf__crypt *crypt = ctx->crypt;
+	size_t sz, esc = 0;
+	char *plain, *out;
+
+	if (crypt->str_cipher == PDF__CIPHER_NONE)
+		return 0;
+	plain = pdf_obj_decode(obj, &sz);
+	PDF_ERRIF(!plain, 1, "failed to decode encrypted string\n");
+	sz = pdf__decrypt(crypt, crypt->str_cipher, ctx->crypt_id,
+	                  (unsigned char *)plain, sz);
+	for (size_t i = 0; i < sz; ++i)
+		esc += plain[i] == '\\' || plain[i] == '\r';
+	out = pdf__arena_alloc(ctx, sz + esc);
+	obj->type = PDF_OBJ_STR;
+	obj->str.val = out;
+	obj->str.len = sz + esc;
+	for (size_t i = 0; i < sz; ++i) {
+		if (plain[i] == '\\' || plain[i] == '\r')
+			*out++ = '\\';
+		*out++ = plain[i] == '\r' ? 'r' : plain[i];
+	}
+	PDF_FREE(plain);
+	return 0;
+}
+
+/* The cipher a stream's data is encrypted with, after its crypt filter */
+static enum pdf__cipher pdf__stream_cipher(const struct pdf__crypt *crypt,
+                                           struct pdf_baseobj *baseobj,
+                                           const struct pdf_obj_name *filters,
+                                           int filter_cnt)
+{
+	struct pdf_obj *type = pdf_dict_find(&baseobj->obj.dict, "Type");
+	struct pdf_obj_dict *parms;
+	struct pdf_obj *name;
+
+	if (!crypt)
+		return PDF__CIPHER_NONE;
+	if (type && type->type == PDF_OBJ_NAME) {
+		if (pdf_name_eq(&type->name, "XRef"))
+			return PDF__CIPHER_NONE;
+		if (!crypt->encrypt_metadata && pdf_name_eq(&type->name, "Metadata"))
+			return PDF__CIPHER_NONE;
+	}
+	/* only the Identity crypt filter can be named by a stream */
+	if (filter_cnt > 0 && pdf_name_eq(filters, "Crypt")) {
+		parms = pdf__stream_parms(baseobj, 0);
+		name = parms ? pdf_dict_find(parms, "Name") : NULL;
+		if (   !name || name->type != PDF_OBJ_NAME
+		    || pdf_name_eq(&name->name, "Identity"))
+			return PDF__CIPHER_NONE;
+	}
+	return crypt->stm_cipher;
+}
+
+static const unsigned char pdf__pw_pad[32] = {
+	0x28, 0xbf, 0x4e, 0x5e, 0x4e, 0x75, 0x8a, 0x41,
+	0x64, 0x00, 0x4e, 0x56, 0xff, 0xfa, 0x01, 0x08,
+	0x2e, 0x2e, 0x00, 0xb6, 0xd0, 0x68, 0x3e, 0x80,
+	0x2f, 0x0c, 0xa9, 0xfe, 0x64, 0x53, 0x69, 0x7a,
+};
+
+/* Copies the first sz bytes of an Encrypt dict string */
+static int pdf__crypt_bytes(struct pdf_obj_dict *dict, const char *name,
+                            unsigned char *out, size_t sz)
+{
+	struct pdf_obj *obj = pdf_dict_find(dict, name);
+	size_t len;
+	char *str;
+
+	PDF_ERRIF(!obj || (obj->type != PDF_OBJ_STR && obj->type != PDF_OBJ_HEX),
+	          1, "Encrypt dict has no %s string\n", name);
+	str = pdf_obj_decode(obj, &len);
+	if (len >= sz)
+		memcpy(out, str, sz);
+	PDF_FREE(str);
+	PDF_ERRIF(len < sz, 1, "Encrypt dict %s is too short\n", name);
+	return 0;
+}
+
+static int pdf__crypt_int(struct pdf_obj_dict *dict, const char *name,
+                          int default_val)
+{
+	struct pdf_obj *obj = pdf_dict_find(dict, name);
+	return obj && obj->type == PDF_OBJ_INT ? obj->intg.val : default_val;
+}
+
+/* The method of crypt filter StmF or StrF names, V 4 and up */
+static enum pdf__cipher pdf__crypt_filter(struct pdf_obj_dict *enc,
+                                          const char *key)
+{
+	struct pdf_obj *name = pdf_dict_find(enc, key), *cf, *method;
+
+	if (!name || name->type != PDF_OBJ_NAME
+	    || pdf_name_eq(&name->name, "Identity"))
+		return PDF__CIPHER_NONE;
+	cf = pdf_dict_find(enc, "CF");
+	if (!cf || cf->type != PDF_OBJ_DICT)
+		return PDF__CIPHER_NONE;
+	for (unsigned i = 0; i < cf->dict.sz; ++i) {
+		struct pdf_dict_entry *entry = cf->dict.entries + i;
+		if (   entry->name_len != name->name.len
+		    || memcmp(entry->name, name->name.val, name->name.len)
+		    || entry->obj.type != PDF_OBJ_DICT)
+			continue;
+		method = pdf_dict_find(&entry->obj.dict, "CFM");
+		if (!method || method->type != PDF_OBJ_NAME)
+			return PDF__CIPHER_NONE;
+		if (pdf_name_eq(&method->name, "V2"))
+			return PDF__CIPHER_RC4;
+		if (pdf_name_eq(&method->name, "AESV2"))
+			return PDF__CIPHER_AES128;
+		if (pdf_name_eq(&method->name, "AESV3"))
+			return PDF__CIPHER_AES256;
+		return PDF__CIPHER_NONE;
+	}
+	return PDF__CIPHER_NONE;
+}
+
+/* Algorithms 2 and 6 of ISO 32000-1, for R 2-4 */
+static int pdf__crypt_key_md5(struct pdf__crypt *crypt,
+                              struct pdf_obj_dict *enc,
+                              struct pdf_obj_dict *trailer, int r)
+{
+	unsigned char o[32], u[32], p[4], ff[4] = { 0xff, 0xff, 0xff, 0xff };
+	unsigned char check[32];
+	struct pdf_obj *ids = pdf_dict_find(trailer, "ID");
+	struct pdf__span in[5] = {
+		{ pdf__pw_pad, 32 }, { o, 32 }, { p, 4 }, { "", 0 }, { ff, 4 },
+	};
+	char *id = NULL;
+	size_t id_sz = 0;
+	int perms, ok;
+
+	if (pdf__crypt_bytes(enc, "O", o, 32) || pdf__crypt_bytes(enc, "U", u, 32))
+		return 1;
+	perms = pdf__crypt_int(enc, "P", 0);
+	for (int i = 0; i < 4; ++i)
+		p[i] = (unsigned char)((unsigned)perms >> 8*i);
+	if (   ids && ids->type == PDF_OBJ_ARR && ids->arr.sz > 0
+	    && (   ids->arr.entries[0].type == PDF_OBJ_STR
+	        || ids->arr.entries[0].type == PDF_OBJ_HEX))
+		id = pdf_obj_decode(ids->arr.entries, &id_sz);
+	in[3].p = id;
+	in[3].sz = id_sz;
+
+	crypt->key_len = r == 2 ? 5 : pdf__crypt_int(enc, "Length", 40) / 8;
+	if (crypt->key_len < 5 || crypt->key_len > 16)
+		crypt->key_len = 16;
+	pdf__md5(in, r >= 4 && !crypt->encrypt_metadata ? 5 : 4, crypt->key);
+	for (int i = 0; r >= 3 && i < 50; ++i) {
+		in[0].p = crypt->key;
+		in[0].sz = crypt->key_len;
+		pdf__md5(in, 1, crypt->key);
+	}
+
+	/* U is the padding (R 2) or its hash with the ID (R 3-4), encrypted */
+	if (r == 2) {
+		memcpy(check, pdf__pw_pad, 32);
+		pdf__rc4(crypt->key, crypt->key_len, check, 32);
+		ok = !memcmp(check, u, 32);
+	} else {
+		unsigned char key[16];
+		in[0].p = pdf__pw_pad;
+		in[0].sz = 32;
+		in[1] = in[3];
+		pdf__md5(in, 2, check);
+		for (int i = 0; i < 20; ++i) {
+			for (int j = 0; j < crypt->key_len; ++j)
+				key[j] = crypt->key[j] ^ (unsigned char)i;
+			pdf__rc4(key, crypt->key_len, check, 16);
+		}
+		ok = !memcmp(check, u, 16);
+	}
+	PDF_FREE(id);
+	PDF_ERRIF(!ok, 1, "document needs a user password\n");
+	return 0;
+}
+
+/* Algorithm 2.B of ISO 32000-2, for the empty password */
+static void pdf__hash_r6(const struct pdf__aes_tables *t,
+                         const unsigned char salt[8], unsigned char out[32])
+{
+	unsigned char k[64], *e = PDF_MALLOC(64 * 64);
+	struct pdf__span in = { salt, 8 };
+	struct pdf__aes aes;
+	int k_sz = 32, e_sz, sum, round = 0;
+
+	pdf__sha256(&in, 1, k);
+	do {
+		e_sz = 64 * k_sz;
+		for (int i = 0; i < 64; ++i)
+			memcpy(e + i * k_sz, k, k_sz);
+		pdf__aes_init(&aes, t, k, 16);
+		pdf__aes_cbc_encrypt(&aes, t, k + 16, e, e_sz);
+		/* the first 16 bytes as a number mod 3, as 256 = 1 mod 3 */
+		sum = 0;
+		for (int i = 0; i < 16; ++i)
+			sum += e[i];
+		in.p = e;
+		in.sz = e_sz;
+		k_sz = 32 + 16 * (sum % 3);
+		if (k_sz == 32)
+			pdf__sha256(&in, 1, k);
+		else
+			pdf__sha512(&in, 1, k, k_sz);
+	} while (++round < 64 || e[e_sz - 1] > round - 32);
+	memcpy(out, k, 32);
+	PDF_FREE(e);
+}
+
+/* Algorithms 2.A and 11 of ISO 32000-2, for R 5-6 */
+static int pdf__crypt_key_sha(struct pdf__crypt *crypt,
+                              struct pdf_obj_dict *enc, int r)
+{
+	unsigned char u[48], ue[32], hash[32], iv[16] = {0};
+	struct pdf__span in;
+	struct pdf__aes aes;
+
+	if (   pdf__crypt_bytes(enc, "U", u, 48)
+	    || pdf__crypt_bytes(enc, "UE", ue, 32))
+		return 1;
+	/* U holds the hash, then its validation salt and key salt */
+	in.p = u + 32;
+	in.sz = 8;
+	if (r == 5)
+		pdf__sha256(&in, 1, hash);
+	else
+		pdf__hash_r6(&crypt->aes, u + 32, hash);
+	PDF_ERRIF(memcmp(hash, u, 32), 1, "document needs a user password\n");
+	in.p = u + 40;
+	if (r == 5)
+		pdf__sha256(&in, 1, hash);
+	else
+		pdf__hash_r6(&crypt->aes, u + 40, hash);
+	pdf__aes_init(&aes, &crypt->aes, hash, 32);
+	pdf__aes_cbc_decrypt(&aes, &crypt->aes, iv, ue, 32);
+	memcpy(crypt->key, ue, 32);
+	crypt->key_len = 32;
+	return 0;
+}
+
+static struct pdf_baseobj *pdf__get_baseobj(struct pdf *pdf,
+                                            struct pdf_objid id,
+                                            int load_stream);
+static int pdf__init_crypt(struct pdf *pdf, struct pdf_obj_dict *trailer)
+{
+	struct pdf_obj *obj = pdf_dict_find(trailer, "Encrypt"), *entry;
+	struct pdf_baseobj *baseobj;
+	struct pdf__crypt *crypt;
+	int v, r, ret;
+
+	if (!obj || pdf->ctx->crypt)
+		return 0;
+	/* read before ctx->crypt is set, as its strings are not encrypted */
+	if (obj->type == PDF_OBJ_REF) {
+		baseobj = pdf__get_baseobj(pdf, obj->ref.id, 0);
+		obj = baseobj ? &baseobj->obj : NULL;
+	}
+	PDF_ERRIF(!obj || obj->type != PDF_OBJ_DICT, 1, "Encrypt is not a dict\n");
+	entry = pdf_dict_find(&obj->dict, "Filter");
+	PDF_ERRIF(   !entry || entry->type != PDF_OBJ_NAME
+	          || !pdf_name_eq(&entry->name, "Standard"), 1,
+	          "only the Standard security handler is supported\n");
+	v = pdf__crypt_int(&obj->dict, "V", 0);
+	r = pdf__crypt_int(&obj->dict, "R", 0);
+	PDF_ERRIF(v < 1 || v > 5 || v == 3 || r < 2 || r > 6, 1,
+	          "unsupported encryption V %d R %d\n", v, r);
+
+	crypt = PDF_MALLOC(sizeof(struct pdf__crypt));
+	pdf__aes_tables_init(&crypt->aes);
+	entry = pdf_dict_find(&obj->dict, "EncryptMetadata");
+	crypt->encrypt_metadata = !entry || entry->type != PDF_OBJ_BOOL
+	                          || entry->boolean.val;
+	if (v >= 4) {
+		crypt->str_cipher = pdf__crypt_filter(&obj->dict, "StrF");
+		crypt->stm_cipher = pdf__crypt_filter(&obj->dict, "StmF");
+	} else {
+		crypt->str_cipher = crypt->stm_cipher = PDF__CIPHER_RC4;
+	}
+	ret =   r >= 5 ? pdf__crypt_key_sha(crypt, &obj->dict, r)
+	      : pdf__crypt_key_md5(crypt, &obj->dict, trailer, r);
+	if (ret) {
+		PDF_FREE(crypt);
+		return 1;
+	}
+	pdf->ctx->crypt = crypt;
+	return 0;
+}
+
+static int pdf__load_stream(struct pdf *pdf, struct pdf_objid id,
+                            struct pdf_baseobj *baseobj)
+{
+	struct pdf_obj_name filters[PDF_FILTER_MAX];
+	int filter_cnt = pdf__stream_filters(baseobj, filters);
+
+	PDF_ERRIF(filter_cnt < 0, 1, "failed to read stream filters\n");
+	baseobj->stream = PDF_MALLOC(baseobj->raw_sz+1);
+	memcpy(baseobj->stream,
+	       pdf->ctx->mem + (baseobj->raw_off - pdf->ctx->mem_off),
+	       baseobj->raw_sz);
+	baseobj->stream_sz = pdf__decrypt(pdf->ctx->crypt,
+	                                  pdf__stream_cipher(pdf->ctx->crypt, baseobj,
+	                                                     filters, filter_cnt),
+	                                  id, (unsigned char *)baseobj->stream,
+	                                  baseobj->raw_sz);
+	baseobj->stream[baseobj->stream_sz] = '\0';
+	baseobj->stream_type = PDF_STREAM_CMD;
+	for (int i = 0; i < filter_cnt; ++i) {
+		PDF_ERRIF(baseobj->stream_type == PDF_STREAM_JPEG, 1,
+		          "filter '%.*s' follows DCTDecode\n",
+		          (int)filters[i].len, filters[i].val);
+		if (pdf__decode_stream(&baseobj->stream_type, &baseobj->stream,
+		                       &baseobj->stream_sz, filters + i,
+		                       pdf__stream_parms(baseobj, i)))
+			PDF_ERR(1, "Failed to decode stream\n");
+	}
+	return 0;
+}
+
+static struct pdf_xref *pdf__lookup_xref(struct pdf *pdf,
+                                         struct pdf_objid id)
+{
+	for (size_t i = 0; i < pdf->xref_tbl_sz; ++i)
+		if (   pdf->xref_tbl[i].id.num == id.num
+		    && pdf->xref_tbl[i].id.gen == id.gen)
+			return pdf->xref_tbl + i;
+	return NULL;
+}
+
+static struct pdf_xref *pdf__find_xref(struct pdf *pdf, struct pdf_objid id)
+{
+	struct pdf_xref *xref = pdf__lookup_xref(pdf, id);
+	if (!xref && pdf->ctx->main_xref && PDF_OK(pdf__load_main_xref(pdf)))
+		return pdf__find_xref(pdf, id);
+	return xref;
+}
+
+static struct pdf_baseobj *pdf__cached_baseobj(struct pdf_xref *xref)
+{
+#ifdef PDF_THREADS
+	return __atomic_load_n(&xref->baseobj, __ATOMIC_ACQUIRE);
+#else
+	return xref->baseobj;
+#endif
+}
+
+/*
+ * Returns 0, with *baseobj swapped for the cached one, if another
+ * pdf_load_all thread got there first.
+ */
+static int pdf__publish_baseobj(struct pdf_xref *xref,
+                                struct pdf_baseobj **baseobj)
+{
+#ifdef PDF_THREADS
+	struct pdf_baseobj *cached = NULL;
+	if (__atomic_compare_exchange_n(&xref->baseobj, &cached, *baseobj, 0,
+	                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return 1;
+	/* the loser's copy stays in its arena until pdf_free */
+	*baseobj = cached;
+	return 0;
+#else
+	xref->baseobj = *baseobj;
+	return 1;
+#endif
+}
+
+/*
+ * Finds the endstream keyword ending a stream, skipping any occurrence
+ * inside the data by requiring endobj to follow it.  The rarer 'm' is
+ * searched for rather than the leading 'e'.
+ */
+static const char *pdf__find_endstream(const char *p, const char *end)
+{
+	const char *m = p + 8, *q;
+	while (m < end && (m = memchr(m, 'm', end - m))) {
+		if (memcmp(m - 8, "endstream", 9) == 0) {
+			for (q = m + 1; q < end && isspace((unsigned char)*q); ++q)
+				;
+			if (end - q >= 6 && memcmp(q, "endobj", 6) == 0)
+				return m - 8;
+		}
+		++m;
+	}
+	return NULL;
+}
+
+/*
+ * An indirect Length is only used if that object is already parsed, so
+ * that reading a stream never seeks away to parse another object.
+ */
+static struct pdf_obj *pdf__cached_length(struct pdf *pdf,
+                                          struct pdf_obj *length)
+{
+	struct pdf_xref *xref;
+	struct pdf_baseobj *baseobj;
+
+	if (length->type != PDF_OBJ_REF)
+		return length;
+	xref = pdf__lookup_xref(pdf, length->ref.id);
+	baseobj = xref ? pdf__cached_baseobj(xref) : NULL;
+	return baseobj ? &baseobj->obj : NULL;
+}
+
+/* Checks the object's "num gen obj" header and moves past it */
+static int pdf__seek_obj(struct pdf *pdf, struct pdf_xref *xref_entry,
+                         struct pdf_objid id)
+{
+	struct pdf_objid local_id;
+	const char *start;
+	char *id_end;
+
+	if (pdf__seek(pdf->ctx, xref_entry->offset))
+		PDF_ERR(1, "failed to lookup base object\n");
+	start = pdf->ctx->pos;
+	pdf__readline(pdf->ctx);
+	if (pdf__parse_ushort_pair_ex(pdf->ctx->buf, &local_id.num,
+	                              &local_id.gen, &id_end))
+		PDF_ERR(1, "failed to parse base object header\n");
+	PDF_ERRIF(id.num != local_id.num || id.gen != local_id.gen, 1,
+	          "base object id mismatch\n");
+	PDF_ERRIF(strncmp(id_end, " obj", 4), 1, "invalid base object header\n");
+	/* the object may start on the header line */
+	pdf->ctx->pos = start + (id_end - pdf->ctx->buf) + 4;
+	return 0;
+}
+
+/*
+ * Parses the object's dict and locates its stream data.  Nothing is
+ * cached, so a failed parse leaves no trace.
+ */
+static struct pdf_baseobj *pdf__parse_baseobj(struct pdf *pdf,
+                                              struct pdf_xref *xref_entry,
+                                              struct pdf_objid id)
+{
+	struct pdf_baseobj *baseobj;
+	int ret;
+
+	if (pdf__seek_obj(pdf, xref_entry, id))
+		return NULL;
+	baseobj = pdf__arena_alloc(pdf->ctx, sizeof(struct pdf_baseobj));
+	pdf->ctx->crypt_strs = pdf->ctx->crypt != NULL;
+	pdf->ctx->crypt_id = id;
+	ret = pdf__parse_obj(pdf->ctx, &baseobj->obj);
+	pdf->ctx->crypt_strs = 0;
+	if (ret)
+		PDF_ERR(NULL, "failed to parse base object properties\n");
+	baseobj->stream = NULL;
+	baseobj->stream_sz = 0;
+	baseobj->stream_type = PDF_STREAM_UNKNOWN;
+	baseobj->raw_off = baseobj->raw_sz = 0;
+	pdf__consume_ws(pdf->ctx); // consume rest of line
+	pdf__readline(pdf->ctx);
+	if (strncmp(pdf->ctx->buf, "stream", 6) == 0) {
+		struct pdf_obj *obj = &baseobj->obj, *length;
+		const char *pos = pdf->ctx->pos;
+
+		PDF_ERRIF(obj->type != PDF_OBJ_DICT, NULL,
+		          "base object has stream but no properties\n");
+		length = pdf_dict_find(&obj->dict, "Length");
+		PDF_ERRIF(!length, NULL, "base object has stream but no Length\n");
+		length = pdf__cached_length(pdf, length);
+		baseobj->raw_off = pos - pdf->ctx->mem + pdf->ctx->mem_off;
+		if (length) {
+			PDF_ERRIF(length->type != PDF_OBJ_INT, NULL,
+			          "base object Length is not an int\n");
+			PDF_ERRIF(   length->intg.val < 0
+			          || length->intg.val > pdf->ctx->end - pos, NULL,
+			          "base object Length is out of bounds\n");
+			baseobj->raw_sz = length->intg.val;
+			pdf->ctx->pos += length->intg.val;
+			pdf__readline(pdf->ctx); // consume rest of line
+		} else {
+			const char *end = pdf__find_endstream(pos, pdf->ctx->end);
+			PDF_ERRIF(!end, NULL, "missing endstream token\n");
+			pdf->ctx->pos = end;
+			/* the EOL before endstream is not part of the data */
+			if (end > pos && end[-1] == '\n')
+				--end;
+			if (end > pos && end[-1] == '\r')
+				--end;
+			baseobj->raw_sz = end - pos;
+		}
+		pdf__readline(pdf->ctx);
+		PDF_ERRIF(strncmp(pdf->ctx->buf, "endstream", 9), NULL,
+		          "missing endstream token (%s)\n", pdf->ctx->buf);
+		pdf__readline(pdf->ctx);
+	}
+	PDF_ERRIF(strncmp(pdf->ctx->buf, "endobj", 6), NULL,
+	          "missing endobj token\n");
+	return baseobj;
+}
+
+/*
+ * Parses and caches the object, only reading the stream in if load_stream
+ * is set.  Only a complete object is published to the cache.
+ */
+static struct pdf_baseobj *pdf__get_baseobj(struct pdf *pdf,
+                                            struct pdf_objid id,
+                                            int load_stream)
+{
+	struct pdf_xref *xref_entry = pdf__find_xref(pdf, id);
+	struct pdf_baseobj *baseobj;
+
+	PDF_ERRIF(!xref_entry, NULL, "No such object\n");
+
+	baseobj = pdf__cached_baseobj(xref_entry);
+	if (!baseobj) {
+		baseobj = pdf__parse_baseobj(pdf, xref_entry, id);
+		if (!baseobj)
+			return NULL;
+		pdf__publish_baseobj(xref_entry, &baseobj);
+	}
+
+	if (load_stream && !baseobj->stream && baseobj->raw_off)
+		if (pdf__load_stream(pdf, id, baseobj))
+			return NULL;
+	return baseobj;
+}
+
+AMFDEF struct pdf_baseobj *pdf_get_baseobj(struct pdf *pdf, struct pdf_objid id)
+{
+	return pdf__get_baseobj(pdf, id, 1);
+}
+
+/* Passes over a value, nested containers included, without building it */
+static int pdf__skip_value(struct pdf__ctx *ctx, enum pdf__token token)
+{
+	struct pdf_obj obj;
+	int depth = 0;
+
+	do {
+		switch (token) {
+		case PDF_TOK_ARR_BEGIN:
+		case PDF_TOK_DICT_BEGIN:
+			++depth;
+		break;
+		case PDF_TOK_ARR_END:
+		case PDF_TOK_DICT_END:
+			PDF_ERRIF(--depth < 0, 1,
+			          "Unexpected token (%s) when skipping obj\n",
+			          pdf__token_names[token]);
+		break;
+		default:
+			/* a dict key is read as a name value */
+			if (pdf__parse_obj_after(ctx, &obj, token))
+				PDF_ERR(1, "failed to skip obj\n");
+		break;
+		}
+		if (depth)
+			token = pdf__next_token(ctx);
+	} while (depth);
+	return 0;
+}
+
+static int pdf__walk_value(struct pdf__ctx *ctx, enum pdf__token token,
+                           pdf_walk_fn fn, void *udata)
+{
+	struct pdf_obj obj;
+	int ret;
+
+	switch (token) {
+	case PDF_TOK_ARR_BEGIN:
+		ret = fn(udata, PDF_WALK_ARR_BEGIN, NULL);
+		if (ret == PDF_WALK_SKIP)
+			return pdf__skip_value(ctx, token);
+		if (ret)
+			return ret;
+		while ((token = pdf__next_token(ctx)) != PDF_TOK_ARR_END)
+			if ((ret = pdf__walk_value(ctx, token, fn, udata)))
+				return ret;
+		ret = fn(udata, PDF_WALK_ARR_END, NULL);
+	break;
+	case PDF_TOK_DICT_BEGIN:
+		ret = fn(udata, PDF_WALK_DICT_BEGIN, NULL);
+		if (ret == PDF_WALK_SKIP)
+			return pdf__skip_value(ctx, token);
+		if (ret)
+			return ret;
+		while ((token = pdf__next_token(ctx)) != PDF_TOK_DICT_END) {
+			obj.type = PDF_OBJ_NAME;
+			if (token != PDF_TOK_NAME_BEGIN || pdf__read_name(ctx, &obj.name))
+				PDF_ERR(1, "failed to walk dict entry name\n");
+			ret = fn(udata, PDF_WALK_KEY, &obj);
+			if (ret == PDF_WALK_SKIP)
+				ret = pdf__skip_value(ctx, pdf__next_token(ctx));
+			else if (!ret)
+				ret = pdf__walk_value(ctx, pdf__next_token(ctx), fn, udata);
+			if (ret)
+				return ret;
+		}
+		ret = fn(udata, PDF_WALK_DICT_END, NULL);
+	break;
+	default:
+		if (pdf__parse_obj_after(ctx, &obj, token))
+			PDF_ERR(1, "failed to walk obj\n");
+		ret = fn(udata, PDF_WALK_VALUE, &obj);
+	break;
+	}
+	return ret == PDF_WALK_SKIP ? 0 : ret;
+}
+
+AMFDEF int pdf_walk_obj(struct pdf *pdf, struct pdf_objid id,
+                        pdf_walk_fn fn, void *udata)
+{
+	struct pdf_xref *xref_entry = pdf__find_xref(pdf, id);
+	int ret;
+
+	PDF_ERRIF(!xref_entry, 1, "No such object\n");
+	if (pdf__seek_obj(pdf, xref_entry, id))
+		return 1;
+	pdf->ctx->crypt_strs = pdf->ctx->crypt != NULL;
+	pdf->ctx->crypt_id = id;
+	ret = pdf__walk_value(pdf->ctx, pdf__next_token(pdf->ctx), fn, udata);
+	pdf->ctx->crypt_strs = 0;
+	return ret;
+}
+
+#ifndef PDF_PREFETCH_GAP
+#define PDF_PREFETCH_GAP (64 * 1024)
+#endif
+
+struct pdf__obj_range
+{
+	size_t off, end;
+	struct pdf_objid id;
+};
+
+static int pdf__cmp_offset(const void *lhs, const void *rhs)
+{
+	size_t a = *(const size_t*)lhs, b = *(const size_t*)rhs;
+	return (a > b) - (a < b);
+}
+
+static int pdf__cmp_obj_range(const void *lhs, const void *rhs)
+{
+	return pdf__cmp_offset(&((const struct pdf__obj_range*)lhs)->off,
+	                       &((const struct pdf__obj_range*)rhs)->off);
+}
+
+/*
+ * Finds the byte ranges of the objects that still need reading, sorted by
+ * offset, out of ids or (if NULL) the whole xref table.  An object extends
+ * up to the next one in the file.
+ */
+static size_t pdf__obj_ranges(struct pdf *pdf, const struct pdf_objid *ids,
+                              size_t n, struct pdf__obj_range **ranges)
+{
+	size_t file_sz = pdf->ctx->end - pdf->ctx->mem;
+	size_t *offs, cnt = 0, off_cnt = 0;
+
+	if (!ids)
+		n = pdf->xref_tbl_sz;
+	*ranges = PDF_MALLOC(n * sizeof(struct pdf__obj_range));
+	for (size_t i = 0; i < n; ++i) {
+		struct pdf_xref *xref = ids ? pdf__find_xref(pdf, ids[i])
+		                            : pdf->xref_tbl + i;
+		if (   xref && xref->in_use
+		    && (   !xref->baseobj
+		        || (!xref->baseobj->stream && xref->baseobj->raw_off))) {
+			/* past the end, it reads nothing and fails to parse */
+			(*ranges)[cnt].off =   xref->offset < file_sz
+			                     ? xref->offset : file_sz;
+			(*ranges)[cnt++].id = xref->id;
+		}
+	}
+	offs = PDF_MALLOC(pdf->xref_tbl_sz * sizeof(size_t));
+	for (size_t i = 0; i < pdf->xref_tbl_sz; ++i)
+		if (pdf->xref_tbl[i].in_use)
+			offs[off_cnt++] = pdf->xref_tbl[i].offset;
+	qsort(*ranges, cnt, sizeof(struct pdf__obj_range), pdf__cmp_obj_range);
+	qsort(offs, off_cnt, sizeof(size_t), pdf__cmp_offset);
+
+	for (size_t i = 0; i < cnt; ++i) {
+		size_t lo = 0, hi = off_cnt;
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			if (offs[mid] <= (*ranges)[i].off)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		(*ranges)[i].end = lo < off_cnt && offs[lo] < file_sz
+		                 ? offs[lo] : file_sz;
+	}
+	PDF_FREE(offs);
+	return cnt;
+}
+
+/*
+ * Ranges are sorted by file offset and merged across gaps of up to
+ * PDF_PREFETCH_GAP bytes, and each merged run is paged in with one
+ * madvise.
+ */
+AMFDEF void pdf_prefetch(struct pdf *pdf, const struct pdf_objid *ids,
+                         size_t n)
+{
+#ifdef PDF__MMAP
+	struct pdf__ctx *ctx = pdf->ctx;
+	size_t page = sysconf(_SC_PAGESIZE), cnt;
+	struct pdf__obj_range *ranges;
+
+	if (ctx->mem_type != PDF__MEM_MAPPED || n == 0)
+		return;
+
+	cnt = pdf__obj_ranges(pdf, ids, n, &ranges);
+	for (size_t i = 0; i < cnt; ) {
+		size_t begin = ranges[i].off, end = ranges[i].end;
+		while (++i < cnt && ranges[i].off <= end + PDF_PREFETCH_GAP)
+			if (ranges[i].end > end)
+				end = ranges[i].end;
+		begin -= begin % page;
+		if (begin < end)
+			madvise((void*)(ctx->mem + begin), end - begin, MADV_WILLNEED);
+	}
+	PDF_FREE(ranges);
+#endif
+}
+
+#ifndef PDF_IO_QUEUE_DEPTH
+#define PDF_IO_QUEUE_DEPTH 32
+#endif
+
+#ifndef PDF_IO_CHUNK
+#define PDF_IO_CHUNK (128 * 1024)
+#endif
+
+#ifdef PDF__MMAP
+/*
+ * pdf_load_objects merges object ranges into groups as pdf_prefetch does
+ * and reads each group into an arena buffer in file order, PDF_IO_CHUNK
+ * bytes at a time.  The objects are parsed from that buffer, so their
+ * names and strings point into it until pdf_free.  io_uring keeps up to
+ * PDF_IO_QUEUE_DEPTH reads in flight; where it is unavailable or fails
+ * part way, the remaining groups are read with pread.
+ */
+struct pdf__io_group
+{
+	size_t off, end;
+	size_t first, last;
+	size_t pending;
+	char *buf;
+	int failed, loaded;
+};
+
+/*
+ * Parses the group's objects from buf, its bytes as read from the file,
+ * so their names and strings point there rather than into the mapping.
+ * An object the buffer cannot satisfy (or every object, if the read
+ * failed) is parsed from the mapping instead.
+ */
+static int pdf__load_group(struct pdf *pdf,
+                           const struct pdf__obj_range *ranges,
+                           struct pdf__io_group *group)
+{
+	struct pdf__ctx *ctx = pdf->ctx;
+	const char *mem = ctx->mem, *end = ctx->end;
+	struct pdf_baseobj *baseobj;
+	int ret = 0;
+
+	group->loaded = 1;
+	for (size_t i = group->first; i < group->last; ++i) {
+		if (group->buf && !group->failed) {
+			ctx->mem = group->buf;
+			ctx->end = group->buf + (group->end - group->off);
+			ctx->mem_off = group->off;
+			baseobj = pdf__get_baseobj(pdf, ranges[i].id, 1);
+			ctx->mem = mem;
+			ctx->end = end;
+			ctx->mem_off = 0;
+			if (baseobj)
+				continue;
+		}
+		if (!pdf__get_baseobj(pdf, ranges[i].id, 1))
+			ret = 1;
+	}
+	return ret;
+}
+
+#ifdef PDF__IO_URING
+/* A bare io_uring: one submission and one completion ring, no SQPOLL */
+struct pdf__uring
+{
+	int fd;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_sz, cq_ring_sz;
+	struct io_uring_sqe *sqes;
+	size_t sqes_sz;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+static void pdf__uring_free(struct pdf__uring *ring)
+{
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_sz);
+	if (ring->cq_ring && ring->cq_ring != MAP_FAILED
+	    && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_sz);
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_sz);
+	close(ring->fd);
+}
+
+static int pdf__uring_init(struct pdf__uring *ring, unsigned entries)
+{
+	struct io_uring_params params;
+	char *sq, *cq;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0)
+		return 1;
+
+	ring->sq_ring_sz = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+	ring->cq_ring_sz =   params.cq_off.cqes
+	                   + params.cq_entries*sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_sz > ring->sq_ring_sz)
+			ring->sq_ring_sz = ring->cq_ring_sz;
+		ring->cq_ring_sz = ring->sq_ring_sz;
+	}
+	ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE,
+	                     MAP_SHARED | MAP_POPULATE, ring->fd,
+	                     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto err;
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ring = ring->sq_ring;
+	else
+		ring->cq_ring = mmap(NULL, ring->cq_ring_sz, PROT_READ | PROT_WRITE,
+		                     MAP_SHARED | MAP_POPULATE, ring->fd,
+		                     IORING_OFF_CQ_RING);
+	if (ring->cq_ring == MAP_FAILED)
+		goto err;
+	ring->sqes_sz = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto err;
+
+	sq = ring->sq_ring;
+	cq = ring->cq_ring;
+	ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+	ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+	return 0;
+
+err:
+	pdf__uring_free(ring);
+	return 1;
+}
+
+static void pdf__uring_read(struct pdf__uring *ring, int fd, char *buf,
+                            size_t len, size_t off, unsigned slot)
+{
+	unsigned tail = *ring->sq_tail, idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = ring->sqes + idx;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = slot;
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Returns the number of reads submitted, or -1 */
+static int pdf__uring_enter(struct pdf__uring *ring, unsigned to_submit,
+                            unsigned min_complete)
+{
+	int ret;
+	do
+		ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete,
+		              IORING_ENTER_GETEVENTS, NULL, 0);
+	while (ret < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY));
+	return ret;
+}
+
+/*
+ * Keeps up to PDF_IO_QUEUE_DEPTH chunk reads in flight, each straight into
+ * its group's buffer, and loads a group's objects as soon as the last of
+ * its chunks completes.  Groups are left unloaded if io_uring fails.
+ */
+static int pdf__read_groups_uring(struct pdf *pdf, struct pdf__uring *ring,
+                                  const struct pdf__obj_range *ranges,
+                                  struct pdf__io_group *groups,
+                                  size_t group_cnt)
+{
+	unsigned free_slots[PDF_IO_QUEUE_DEPTH], free_cnt = 0;
+	size_t slot_group[PDF_IO_QUEUE_DEPTH], slot_len[PDF_IO_QUEUE_DEPTH];
+	unsigned inflight = 0, to_submit = 0;
+	size_t g = 0, pos = 0;
+	int ret = 0, submitted;
+
+	while (free_cnt < PDF_IO_QUEUE_DEPTH)
+		free_slots[free_cnt] = free_cnt, ++free_cnt;
+
+	while (g < group_cnt || inflight) {
+		unsigned head, tail;
+
+		while (g < group_cnt && free_cnt) {
+			struct pdf__io_group *group = groups + g;
+			unsigned slot;
+			size_t len;
+
+			if (!group->buf) {
+				/* nothing to read, e.g. offsets past the end */
+				if (group->off == group->end) {
+					if (pdf__load_group(pdf, ranges, group))
+						ret = 1;
+					++g;
+					continue;
+				}
+				group->buf = pdf__arena_alloc(pdf->ctx,
+				                              group->end - group->off);
+				pos = group->off;
+			}
+			len = group->end - pos < PDF_IO_CHUNK ? group->end - pos
+			                                      : PDF_IO_CHUNK;
+			slot = free_slots[--free_cnt];
+			pdf__uring_read(ring, pdf->ctx->fd,
+			                group->buf + (pos - group->off), len, pos, slot);
+			slot_group[slot] = g;
+			slot_len[slot] = len;
+			++to_submit;
+			++inflight;
+			pos += len;
+			if (pos >= group->end)
+				++g;
+		}
+		if (!inflight)
+			continue;
+		submitted = pdf__uring_enter(ring, to_submit, 1);
+		if (submitted < 0) {
+			PDF_LOG("io_uring_enter failed (%d)\n", errno);
+			/* reads in flight may still land in these, so drop them */
+			for (size_t i = 0; i < group_cnt; ++i)
+				if (!groups[i].loaded)
+					groups[i].buf = NULL;
+			return ret;
+		}
+		to_submit -= submitted;
+
+		head = *ring->cq_head;
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head) {
+			struct io_uring_cqe *cqe = ring->cqes + (head & *ring->cq_mask);
+			unsigned slot = cqe->user_data;
+			struct pdf__io_group *group = groups + slot_group[slot];
+			free_slots[free_cnt++] = slot;
+			--inflight;
+			if (cqe->res < 0 || (size_t)cqe->res != slot_len[slot])
+				group->failed = 1;
+			if (--group->pending == 0 && pdf__load_group(pdf, ranges, group))
+				ret = 1;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return ret;
+}
+#endif // PDF__IO_URING
+
+/* Reads and loads the groups io_uring did not, one pread at a time */
+static int pdf__read_groups(struct pdf *pdf,
+                            const struct pdf__obj_range *ranges,
+                            struct pdf__io_group *groups, size_t group_cnt)
+{
+	int ret = 0;
+
+#ifdef PDF__IO_URING
+	struct pdf__uring ring;
+	if (PDF_OK(pdf__uring_init(&ring, PDF_IO_QUEUE_DEPTH))) {
+		ret = pdf__read_groups_uring(pdf, &ring, ranges, groups, group_cnt);
+		pdf__uring_free(&ring);
+	}
+#endif
+
+	for (size_t i = 0; i < group_cnt; ++i) {
+		struct pdf__io_group *group = groups + i;
+		size_t sz = group->end - group->off;
+		ssize_t n;
+
+		if (group->loaded)
+			continue;
+		group->buf = sz ? pdf__arena_alloc(pdf->ctx, sz) : NULL;
+		for (size_t done = 0; group->buf && done < sz; done += n) {
+			n = pread(pdf->ctx->fd, group->buf + done, sz - done,
+			          group->off + done);
+			if (n <= 0) {
+				group->failed = 1;
+				break;
+			}
+		}
+		if (pdf__load_group(pdf, ranges, group))
+			ret = 1;
+	}
+	return ret;
+}
+#endif // PDF__MMAP
+
+AMFDEF int pdf_load_objects(struct pdf *pdf, const struct pdf_objid *ids,
+                            size_t n)
+{
+	struct pdf__obj_range *ranges;
+	size_t cnt;
+	int ret = 0;
+
+	if (n == 0)
+		return 0;
+	cnt = pdf__obj_ranges(pdf, ids, n, &ranges);
+#ifdef PDF__MMAP
+	if (cnt && pdf->ctx->mem_type == PDF__MEM_MAPPED && pdf->ctx->fd >= 0) {
+		struct pdf__io_group *groups = PDF_MALLOC(  cnt
+		                                          * sizeof(struct pdf__io_group));
+		size_t group_cnt = 0;
+		for (size_t i = 0; i < cnt; ++i) {
+			struct pdf__io_group *group = groups + group_cnt - 1;
+			if (group_cnt && ranges[i].off <= group->end + PDF_PREFETCH_GAP) {
+				if (ranges[i].end > group->end)
+					group->end = ranges[i].end;
+				group->last = i + 1;
+			} else {
+				group = groups + group_cnt++;
+				group->off = ranges[i].off;
+				group->end = ranges[i].end;
+				group->first = i;
+				group->last = i + 1;
+			}
+		}
+		for (size_t i = 0; i < group_cnt; ++i) {
+			groups[i].pending =   (groups[i].end - groups[i].off + PDF_IO_CHUNK - 1)
+			                    / PDF_IO_CHUNK;
+			groups[i].buf = NULL;
+			groups[i].failed = groups[i].loaded = 0;
+		}
+		ret = pdf__read_groups(pdf, ranges, groups, group_cnt);
+		PDF_FREE(groups);
+		PDF_FREE(ranges);
+		return ret;
+	}
+#endif
+	for (size_t i = 0; i < cnt; ++i)
+		if (!pdf__get_baseobj(pdf, ranges[i].id, 1))
+			ret = 1;
+	PDF_FREE(ranges);
+	return ret;
+}
+
+struct pdf__loader
+{
+	struct pdf pdf;
+	struct pdf__ctx ctx;
+	const struct pdf__obj_range *ranges;
+	size_t first, last;
+	int ret;
+#ifdef PDF_THREADS
+	pthread_t thread;
+	int threaded;
+#endif
+};
+
+static void *pdf__load_range(void *arg)
+{
+	struct pdf__loader *loader = arg;
+	loader->ret = 0;
+	for (size_t i = loader->first; i < loader->last; ++i)
+		if (!pdf__get_baseobj(&loader->pdf, loader->ranges[i].id, 1))
+			loader->ret = 1;
+	return NULL;
+}
+
+/*
+ * The objects are sorted by offset and split into nthreads contiguous
+ * ranges of roughly equal size, each parsed on its own thread with its
+ * own tokenizer.
+ */
+AMFDEF int pdf_load_all(struct pdf *pdf, int nthreads)
+{
+	struct pdf__obj_range *ranges;
+	struct pdf__loader *loaders;
+	size_t cnt, total = 0, done = 0, first = 0;
+	int ret = 0;
+
+	/* the table must not grow under the threads */
+	if (pdf->ctx->main_xref && pdf__load_main_xref(pdf))
+		return 1;
+
+	cnt = pdf__obj_ranges(pdf, NULL, 0, &ranges);
+#ifndef PDF_THREADS
+	nthreads = 1;
+#endif
+	if (nthreads > cnt)
+		nthreads = cnt;
+	if (nthreads < 1)
+		nthreads = 1;
+	for (size_t i = 0; i < cnt; ++i)
+		total += ranges[i].end - ranges[i].off;
+
+	loaders = PDF_MALLOC(nthreads * sizeof(struct pdf__loader));
+	for (int t = 0; t < nthreads; ++t) {
+		struct pdf__loader *loader = loaders + t;
+		size_t last = first;
+		/* split by bytes rather than object count */
+		while (   last < cnt
+		       && (   last == first
+		           || done < total / nthreads * (t + 1)
+		           || t == nthreads - 1))
+			done += ranges[last].end - ranges[last].off, ++last;
+		loader->pdf = *pdf;
+		loader->pdf.ctx = &loader->ctx;
+		loader->ctx = *pdf->ctx;
+		loader->ctx.arena = NULL;
+		loader->ctx.arr_stack = NULL;
+		loader->ctx.arr_stack_sz = loader->ctx.arr_stack_cap = 0;
+		loader->ctx.dict_stack = NULL;
+		loader->ctx.dict_stack_sz = loader->ctx.dict_stack_cap = 0;
+		loader->ctx.shared = NULL;
+		loader->ctx.shared_cnt = loader->ctx.shared_cap = 0;
+		loader->ctx.share_hits = loader->ctx.share_misses = 0;
+		loader->ctx.share_bytes = 0;
+		loader->ranges = ranges;
+		loader->first = first;
+		loader->last = last;
+		first = last;
+	}
+
+#ifdef PDF_THREADS
+	for (int t = 1; t < nthreads; ++t)
+		loaders[t].threaded = !pthread_create(&loaders[t].thread, NULL,
+		                                      pdf__load_range, loaders + t);
+	pdf__load_range(loaders);
+	for (int t = 1; t < nthreads; ++t) {
+		if (loaders[t].threaded)
+			pthread_join(loaders[t].thread, NULL);
+		else
+			pdf__load_range(loaders + t);
+	}
+#else
+	pdf__load_range(loaders);
+#endif
+	for (int t = 0; t < nthreads; ++t) {
+		struct pdf__ctx *ctx = &loaders[t].ctx;
+		if (loaders[t].ret)
+			ret = 1;
+		/* the loaded objects now belong to the document */
+		if (ctx->arena) {
+			struct pdf__arena *tail = ctx->arena;
+			while (tail->next)
+				tail = tail->next;
+			tail->next = pdf->ctx->arena;
+			pdf->ctx->arena = ctx->arena;
+		}
+		PDF_FREE(ctx->arr_stack);
+		PDF_FREE(ctx->dict_stack);
+		/* each thread shares only among its own objects */
+		PDF_FREE(ctx->shared);
+		pdf->ctx->share_hits += ctx->share_hits;
+		pdf->ctx->share_misses += ctx->share_misses;
+		pdf->ctx->share_bytes += ctx->share_bytes;
+	}
+	PDF_FREE(loaders);
+	PDF_FREE(ranges);
+	return ret;
+}
+
+AMFDEF void pdf_obj_share(struct pdf *pdf, int enable)
+{
+	pdf->ctx->share = enable;
+}
+
+AMFDEF void pdf_obj_share_stats(struct pdf *pdf,
+                                struct pdf_obj_share_stats *stats)
+{
+	stats->hits = pdf->ctx->share_hits;
+	stats->misses = pdf->ctx->share_misses;
+	stats->bytes = pdf->ctx->share_bytes;
+}
+
+AMFDEF int pdf_get_stream_view(struct pdf *pdf, struct pdf_objid id,
+                               struct pdf_stream_view *view)
+{
+	struct pdf_baseobj *baseobj = pdf__get_baseobj(pdf, id, 0);
+	enum pdf__cipher cipher;
+	unsigned char *plain;
+
+	PDF_ERRIF(!baseobj, 1, "failed to retrieve stream object\n");
+	PDF_ERRIF(!baseobj->raw_off, 1, "object has no stream\n");
+	view->data = pdf->ctx->mem + baseobj->raw_off;
+	view->sz = baseobj->raw_sz;
+	view->filter_cnt = pdf__stream_filters(baseobj, view->filters);
+	PDF_ERRIF(view->filter_cnt < 0, 1, "failed to read stream filters\n");
+	cipher = pdf__stream_cipher(pdf->ctx->crypt, baseobj, view->filters,
+	                            view->filter_cnt);
+	if (cipher != PDF__CIPHER_NONE) {
+		plain = pdf__arena_alloc(pdf->ctx, view->sz);
+		memcpy(plain, view->data, view->sz);
+		view->sz = pdf__decrypt(pdf->ctx->crypt, cipher, id, plain, view->sz);
+		view->data = (const char *)plain;
+	}
+	return 0;
+}
+
+/* Component count of a color space, 0 if it isn't known */
+static int pdf__color_space_comps(struct pdf *pdf, struct pdf_obj *cs)
+{
+	struct pdf_baseobj *icc;
+	struct pdf_obj *n;
+	if (!cs)
+		return 0;
+	if (cs->type == PDF_OBJ_NAME) {
+		if (   pdf_name_eq(&cs->name, "DeviceGray")
+		    || pdf_name_eq(&cs->name, "CalGray"))
+			return 1;
+		if (   pdf_name_eq(&cs->name, "DeviceRGB")
+		    || pdf_name_eq(&cs->name, "CalRGB"))
+			return 3;
+		if (pdf_name_eq(&cs->name, "DeviceCMYK"))
+			return 4;
+		return 0;
+	}
+	if (   cs->type == PDF_OBJ_ARR && cs->arr.sz == 2
+	    && cs->arr.entries[0].type == PDF_OBJ_NAME
+	    && pdf_name_eq(&cs->arr.entries[0].name, "ICCBased")
+	    && cs->arr.entries[1].type == PDF_OBJ_REF) {
+		icc = pdf__get_baseobj(pdf, cs->arr.entries[1].ref.id, 0);
+		if (icc && icc->obj.type == PDF_OBJ_DICT) {
+			n = pdf_dict_find_deref(pdf, &icc->obj.dict, "N");
+			if (n && n->type == PDF_OBJ_INT)
+				return n->intg.val;
+		}
+	}
+	return 0;
+}
+
+/* Reads /Decode and checks /ColorSpace against the JPEG's components */
+static int pdf__image_dct_opts(struct pdf *pdf, struct pdf_objid id,
+                               const struct pdf_dct_opts *opts,
+                               struct pdf_dct_opts *image_opts,
+                               struct pdf_stream_view *view)
+{
+	struct pdf_baseobj *image;
+	struct pdf_obj *decode;
+	struct pdf_dct_opts header_opts = {0};
+	struct pdf_image_desc desc;
+	double d0, d1;
+	int comps;
+
+	PDF_ERRIF(pdf_get_stream_view(pdf, id, view), 1,
+	          "failed to retrieve image stream\n");
+	PDF_ERRIF(   view->filter_cnt != 1
+	          || !pdf_name_eq(&view->filters[0], "DCTDecode"), 1,
+	          "image is not a DCTDecode stream\n");
+	image = pdf__get_baseobj(pdf, id, 0);
+	if (opts)
+		*image_opts = *opts;
+	else
+		memset(image_opts, 0, sizeof(*image_opts));
+	decode = pdf_dict_find_deref(pdf, &image->obj.dict, "Decode");
+	image_opts->decode_inverted =    decode && decode->type == PDF_OBJ_ARR
+	                              && decode->arr.sz >= 2
+	                              && !pdf__obj_num(decode->arr.entries, &d0)
+	                              && !pdf__obj_num(decode->arr.entries+1, &d1)
+	                              && d0 == 1 && d1 == 0;
+
+	comps = pdf__color_space_comps(pdf,
+		pdf_dict_find_deref(pdf, &image->obj.dict, "ColorSpace"));
+	if (!comps)
+		return 0;
+	header_opts.header_only = 1;
+	if (pdf_decode_dct(view->data, view->sz, &header_opts, &desc, NULL))
+		return 1;
+	PDF_ERRIF(desc.components != comps, 1,
+	          "image ColorSpace has %d components, jpeg has %d\n",
+	          comps, desc.components);
+	return 0;
+}
+
+AMFDEF int pdf_decode_image(struct pdf *pdf, struct pdf_objid id,
+                            const struct pdf_dct_opts *opts,
+                            struct pdf_image_desc *desc,
+                            unsigned char **pixels)
+{
+	struct pdf_dct_opts image_opts;
+	struct pdf_stream_view view;
+	if (pdf__image_dct_opts(pdf, id, opts, &image_opts, &view))
+		return 1;
+	return pdf_decode_dct(view.data, view.sz, &image_opts, desc, pixels);
+}
+
+AMFDEF int pdf_decode_image_strips(struct pdf *pdf, struct pdf_objid id,
+                                   const struct pdf_dct_opts *opts,
+                                   struct pdf_image_desc *desc,
+                                   pdf_dct_strip_fn fn, void *udata)
+{
+	struct pdf_dct_opts image_opts;
+	struct pdf_stream_view view;
+	if (pdf__image_dct_opts(pdf, id, opts, &image_opts, &view))
+		return 1;
+	return pdf_decode_dct_strips(view.data, view.sz, &image_opts, desc,
+	                             fn, udata);
+}
+
+AMFDEF struct pdf_image *pdf_image_acquire(struct pdf *pdf,
+                                           struct pdf_objid id,
+                                           const struct pdf_dct_opts *opts)
+{
+	struct pdf__ctx *ctx = pdf->ctx;
+	struct pdf_dct_opts key = {0};
+	struct pdf_image *image;
+
+	if (opts) {
+		key.max_width = opts->max_width;
+		key.max_height = opts->max_height;
+		key.fmt = opts->fmt;
+	}
+	for (size_t i = 0; i < ctx->image_cnt; ++i) {
+		image = ctx->images[i];
+		if (   image->id.num == id.num && image->id.gen == id.gen
+		    && image->max_width == key.max_width
+		    && image->max_height == key.max_height
+		    && image->fmt == key.fmt) {
+			++ctx->image_hits;
+			++image->refs;
+			return image;
+		}
+	}
+
+	++ctx->image_misses;
+	image = PDF_MALLOC(sizeof(struct pdf_image));
+	image->pixels = NULL;
+	if (pdf_decode_image(pdf, id, &key, &image->desc, &image->pixels)) {
+		PDF_FREE(image);
+		PDF_ERR(NULL, "failed to decode image %u.%u\n", id.num, id.gen);
+	}
+	image->id = id;
+	image->max_width = key.max_width;
+	image->max_height = key.max_height;
+	image->fmt = key.fmt;
+	image->refs = 1;
+	if (ctx->image_cnt == ctx->image_cap) {
+		ctx->image_cap = ctx->image_cap ? 2*ctx->image_cap : 8;
+		ctx->images = PDF_REALLOC(ctx->images,
+		                          ctx->image_cap*sizeof(struct pdf_image *));
+	}
+	ctx->images[ctx->image_cnt++] = image;
+	return image;
+}
+
+AMFDEF void pdf_image_release(struct pdf *pdf, struct pdf_image *image)
+{
+	(void)pdf;
+	assert(image->refs > 0);
+	--image->refs;
+}
+
+AMFDEF void pdf_image_cache_trim(struct pdf *pdf)
+{
+	struct pdf__ctx *ctx = pdf->ctx;
+	size_t cnt = 0;
+	for (size_t i = 0; i < ctx->image_cnt; ++i) {
+		if (ctx->images[i]->refs) {
+			ctx->images[cnt++] = ctx->images[i];
+		} else {
+			PDF_FREE(ctx->images[i]->pixels);
+			PDF_FREE(ctx->images[i]);
+		}
+	}
+	ctx->image_cnt = cnt;
+}
+
+AMFDEF void pdf_image_cache_stats(struct pdf *pdf,
+                                  struct pdf_image_cache_stats *stats)
+{
+	stats->hits = pdf->ctx->image_hits;
+	stats->misses = pdf->ctx->image_misses;
+	stats->images = pdf->ctx->image_cnt;
+	stats->bytes = 0;
+	for (size_t i = 0; i < pdf->ctx->image_cnt; ++i) {
+		const struct pdf_image_desc *desc = &pdf->ctx->images[i]->desc;
+		stats->bytes += desc->height * desc->stride;
+	}
+}
+
+static struct pdf_obj *pdf__pages(struct pdf *pdf)
+{
+	struct pdf_baseobj *catalog, *pages;
+	struct pdf_obj *pages_ref;
+
+	catalog = pdf_get_baseobj(pdf, pdf->root);
+	PDF_ERRIF(!catalog, NULL, "failed to retrive Catalog object\n");
+	PDF_ERRIF(catalog->obj.type != PDF_OBJ_DICT, NULL,
+	          "Catalog object is not a dict\n");
+	pages_ref = pdf_dict_find(&catalog->obj.dict, "Pages");
+	PDF_ERRIF(!pages_ref, NULL, "Catalog dict has no Pages property\n");
+	PDF_ERRIF(pages_ref->type != PDF_OBJ_REF, NULL,
+	          "Catalog Pages not a ref\n");
+	pages = pdf_get_baseobj(pdf, pages_ref->ref.id);
+	PDF_ERRIF(!pages, NULL, "failed to retrive Pages object\n");
+	PDF_ERRIF(pages->obj.type != PDF_OBJ_DICT, NULL,
+	          "Pages object is not a dict\n");
+	return &pages->obj;
+}
+
+AMFDEF int pdf_page_cnt(struct pdf *pdf)
+{
+	struct pdf_obj *pages, *count;
+
+	if (pdf->ctx->linear_page_cnt)
+		return pdf->ctx->linear_page_cnt;
+	pages = pdf__pages(pdf);
+	PDF_ERRIF(!pages, -1, "failed to retrive Pages object\n");
+	count = pdf_dict_find(&pages->dict, "Count");
+	PDF_ERRIF(!count, -1, "Pages dict has no Count property\n");
+	PDF_ERRIF(count->type != PDF_OBJ_INT, -1, "Pages Count not an int\n");
+	return count->intg.val;
+}
+
+AMFDEF struct pdf_obj *pdf_get_page(struct pdf *pdf, int page_idx)
+{
+	struct pdf_obj *pages, *kids, *page_ref;
+	struct pdf_baseobj *page;
+
+	/* avoid the page tree, which may lie outside the first page section */
+	if (page_idx == 0 && pdf->ctx->linear_page.num) {
+		page = pdf_get_baseobj(pdf, pdf->ctx->linear_page);
+		PDF_ERRIF(!page, NULL, "failed to get Page 0 baseobj\n");
+		return &page->obj;
+	}
+
+	pages = pdf__pages(pdf);
+	PDF_ERRIF(!pages, NULL, "failed to retrive Pages object\n");
+	kids = pdf_dict_find(&pages->dict, "Kids");
+	PDF_ERRIF(!kids, NULL, "failed to retrieve Pages Kids\n");
+	PDF_ERRIF(kids->type != PDF_OBJ_ARR, NULL,
+	          "Pages Kids is not an array\n");
+	PDF_ERRIF(page_idx < 0 || page_idx >= kids->arr.sz, NULL,
+	          "Invalid page num\n");
+	page_ref = kids->arr.entries+page_idx;
+	PDF_ERRIF(page_ref->type != PDF_OBJ_REF, NULL,
+	          "Pages Kids element is not a reference\n");
+	page = pdf_get_baseobj(pdf, page_ref->ref.id);
+	PDF_ERRIF(!page, NULL, "failed to get Page %i baseobj\n", page_idx);
+	return &page->obj;
+}
+
+AMFDEF int pdf_get_page_bounds(struct pdf *pdf, int page_idx, int bounds[4])
+{
+	struct pdf_obj *page, *box;
+	page = pdf_get_page(pdf, page_idx);
+	PDF_ERRIF(!page, 1, "failed to get Page %i\n", page_idx);
+	box = pdf_dict_find(&page->dict, "MediaBox");
+	if (!box) {
+		struct pdf_obj *parent_ref;
+		struct pdf_baseobj *pages;
+		parent_ref = pdf_dict_find(&page->dict, "Parent");
+		PDF_ERRIF(!parent_ref, 1, "Page %i missing Parent\n", page_idx);
+		PDF_ERRIF(parent_ref->type != PDF_OBJ_REF, 1,
+		          "Page %i Parent is not a reference\n", page_idx);
+		pages = pdf_get_baseobj(pdf, parent_ref->ref.id);
+		PDF_ERRIF(!pages, 1, "failed to locate Pages baseobj\n");
+		PDF_ERRIF(pages->obj.type != PDF_OBJ_DICT, 1,
+		          "Pages baseobj obj is not a dict\n");
+		box = pdf_dict_find(&pages->obj.dict, "MediaBox");
+		PDF_ERRIF(!box, 1, "No MediaBox in Pages or Page %i\n", page_idx);
+	}
+	PDF_ERRIF(box->type != PDF_OBJ_ARR, 1, "MediaBox is not an array\n");
+	PDF_ERRIF(box->arr.sz != 4, 1, "MediaBox does not have 4 elements\n");
+	for (size_t i = 0; i < box->arr.sz; ++i) {
+		double dim;
+		PDF_ERRIF(pdf__obj_num(box->arr.entries+i, &dim), 1,
+		          "MediaBox[%lu] is not a number\n", i);
+		bounds[i] = (int)dim;
+	}
+	return 0;
+}
+
+AMFDEF struct pdf_obj* pdf_dict_find(struct pdf_obj_dict *dict,
+                                     const char *name)
+{
+	size_t len = strlen(name);
+	for (size_t i = 0; i < dict->sz; ++i)
+		if (   (dict->entries+i)->name_len == len
+		    && memcmp((dict->entries+i)->name, name, len) == 0)
+			return &(dict->entries+i)->obj;
+	return NULL;
+}
+
+AMFDEF int pdf_name_eq(const struct pdf_obj_name *name, const char *str)
+{
+	size_t len = strlen(str);
+	return name->len == len && memcmp(name->val, str, len) == 0;
+}
+
+static size_t ps__text_decode_str(const char *p, const char *end, char *out);
+static size_t ps__text_decode_hex(const char *p, const char *end, char *out);
+
+AMFDEF char *pdf_obj_decode(const struct pdf_obj *obj, size_t *sz)
+{
+	char *out;
+	int hi, lo;
+
+	switch (obj->type) {
+	case PDF_OBJ_HEX:
+		out = PDF_MALLOC(obj->hex.len/2 + 2);
+		*sz = ps__text_decode_hex(obj->hex.val, obj->hex.val + obj->hex.len,
+		                          out);
+	break;
+	case PDF_OBJ_NAME:
+		out = PDF_MALLOC(obj->name.len + 1);
+		*sz = 0;
+		for (size_t i = 0; i < obj->name.len; ++i) {
+			const char *p = obj->name.val + i;
+			if (   *p == '#' && i + 2 < obj->name.len
+			    && (hi = ps__hex_digit(p[1])) >= 0
+			    && (lo = ps__hex_digit(p[2])) >= 0) {
+				out[(*sz)++] = (char)(hi << 4 | lo);
+				i += 2;
+			} else {
+				out[(*sz)++] = *p;
+			}
+		}
+	break;
+	case PDF_OBJ_STR:
+		out = PDF_MALLOC(obj->str.len + 1);
+		*sz = ps__text_decode_str(obj->str.val, obj->str.val + obj->str.len,
+		                          out);
+	break;
+	default:
+		PDF_ERR(NULL, "object is not a string or name\n");
+	}
+	out[*sz] = '\0';
+	return out;
+}
+
+AMFDEF struct pdf_obj *pdf_dict_find_deref(struct pdf *pdf,
+                                           struct pdf_obj_dict *dict,
+                                           const char *name)
+{
+	struct pdf_baseobj *baseobj;
+	struct pdf_obj *obj = pdf_dict_find(dict, name);
+	if (!obj)
+		return NULL;
+	if (obj->type != PDF_OBJ_REF)
+		return obj;
+	baseobj = pdf__get_baseobj(pdf, obj->ref.id, 0);
+	if (!baseobj)
+		return NULL;
+	return baseobj->obj.type != PDF_OBJ_REF ? &baseobj->obj : NULL;
+}
+
+static const char *pdf__res_names[PDF_RES_CNT] = {
+	"ColorSpace",
+	"ExtGState",
+	"Font",
+	"Pattern",
+	"Properties",
+	"Shading",
+	"XObject",
+};
+
+static struct pdf_obj *pdf__deref(struct pdf *pdf, struct pdf_obj *obj,
+                                  struct pdf_baseobj **baseobj)
+{
+	*baseobj = NULL;
+	if (!obj || obj->type != PDF_OBJ_REF)
+		return obj;
+	*baseobj = pdf__get_baseobj(pdf, obj->ref.id, 0);
+	return *baseobj ? &(*baseobj)->obj : NULL;
+}
+
+static struct pdf_resources *pdf__resolve_resources(struct pdf *pdf,
+                                                    struct pdf_obj_dict *dict)
+{
+	struct pdf__ctx *ctx = pdf->ctx;
+	struct pdf_resources *res;
+	struct pdf_baseobj *baseobj;
+	struct pdf_obj *category;
+
+	for (size_t i = 0; i < ctx->resources_cnt; ++i)
+		if (ctx->resources[i]->dict == dict)
+			return ctx->resources[i];
+
+	res = PDF_MALLOC(sizeof(struct pdf_resources));
+	res->dict = dict;
+	for (int type = 0; type < PDF_RES_CNT; ++type) {
+		res->entries[type] = NULL;
+		res->entry_cnt[type] = 0;
+		category = pdf__deref(pdf, pdf_dict_find(dict, pdf__res_names[type]),
+		                      &baseobj);
+		if (!category || category->type != PDF_OBJ_DICT)
+			continue;
+		res->entries[type] = PDF_MALLOC(  category->dict.sz
+		                                * sizeof(struct pdf_res_entry));
+		for (size_t i = 0; i < category->dict.sz; ++i) {
+			struct pdf_dict_entry *src = category->dict.entries + i;
+			struct pdf_res_entry *entry = res->entries[type]
+			                            + res->entry_cnt[type];
+			entry->obj = pdf__deref(pdf, &src->obj, &entry->baseobj);
+			if (!entry->obj)
+				continue;
+			entry->name = src->name;
+			entry->name_len = src->name_len;
+			if (entry->baseobj)
+				entry->id = src->obj.ref.id;
+			++res->entry_cnt[type];
+		}
+	}
+
+	if (ctx->resources_cnt == ctx->resources_cap) {
+		ctx->resources_cap = ctx->resources_cap ? 2*ctx->resources_cap : 8;
+		ctx->resources = PDF_REALLOC(ctx->resources,
+		                               ctx->resources_cap
+		                             * sizeof(struct pdf_resources *));
+	}
+	ctx->resources[ctx->resources_cnt++] = res;
+	return res;
+}
+
+#ifndef PDF_PAGE_TREE_DEPTH
+#define PDF_PAGE_TREE_DEPTH 64
+#endif
+
+AMFDEF struct pdf_resources *pdf_get_page_resources(struct pdf *pdf,
+                                                    int page_idx)
+{
+	struct pdf_obj *node, *res, *parent;
+	struct pdf_baseobj *baseobj;
+
+	node = pdf_get_page(pdf, page_idx);
+	PDF_ERRIF(!node, NULL, "failed to get Page %i\n", page_idx);
+	/* Resources is inheritable from the ancestor Pages nodes */
+	for (int depth = 0; depth < PDF_PAGE_TREE_DEPTH; ++depth) {
+		res = pdf__deref(pdf, pdf_dict_find(&node->dict, "Resources"),
+		                 &baseobj);
+		if (res && res->type == PDF_OBJ_DICT)
+			return pdf__resolve_resources(pdf, &res->dict);
+		parent = pdf__deref(pdf, pdf_dict_find(&node->dict, "Parent"),
+		                    &baseobj);
+		if (!parent || parent->type != PDF_OBJ_DICT)
+			break;
+		node = parent;
+	}
+	PDF_ERR(NULL, "Page %i has no Resources\n", page_idx);
+}
+
+AMFDEF struct pdf_resources *pdf_get_form_resources(struct pdf *pdf,
+                                                    struct pdf_baseobj *form,
+                                                    struct pdf_resources *parent)
+{
+	struct pdf_baseobj *baseobj;
+	struct pdf_obj *res;
+	if (form->obj.type != PDF_OBJ_DICT)
+		return parent;
+	res = pdf__deref(pdf, pdf_dict_find(&form->obj.dict, "Resources"),
+	                 &baseobj);
+	if (!res || res->type != PDF_OBJ_DICT)
+		return parent;
+	return pdf__resolve_resources(pdf, &res->dict);
+}
+
+AMFDEF struct pdf_res_entry *pdf_res_find(struct pdf_resources *res,
+                                          enum pdf_res_type type,
+                                          const char *name)
+{
+	size_t len = strlen(name);
+	if (!res)
+		return NULL;
+	for (size_t i = 0; i < res->entry_cnt[type]; ++i)
+		if (   res->entries[type][i].name_len == len
+		    && memcmp(res->entries[type][i].name, name, len) == 0)
+			return res->entries[type] + i;
+	return NULL;
+}
+
+AMFDEF void pdf_free(struct pdf *pdf)
+{
+	if (!pdf->ctx)
+		return;
+	switch (pdf->ctx->mem_type) {
+	case PDF__MEM_BORROWED:
+	break;
+	case PDF__MEM_HEAP:
+		PDF_FREE((char*)pdf->ctx->mem);
+	break;
+	case PDF__MEM_MAPPED:
+#ifdef PDF__MMAP
+		munmap((void*)pdf->ctx->mem, pdf->ctx->end - pdf->ctx->mem);
+		if (pdf->ctx->fd >= 0)
+			close(pdf->ctx->fd);
+#endif
+	break;
+	}
+	PDF_FREE(pdf->ctx->triage_memo);
+	for (size_t i = 0; i < pdf->ctx->image_cnt; ++i) {
+		PDF_FREE(pdf->ctx->images[i]->pixels);
+		PDF_FREE(pdf->ctx->images[i]);
+	}
+	PDF_FREE(pdf->ctx->images);
+	for (size_t i = 0; i < pdf->ctx->resources_cnt; ++i) {
+		for (int type = 0; type < PDF_RES_CNT; ++type)
+			PDF_FREE(pdf->ctx->resources[i]->entries[type]);
+		PDF_FREE(pdf->ctx->resources[i]);
+	}
+	PDF_FREE(pdf->ctx->resources);
+	PDF_FREE(pdf->ctx->arr_stack);
+	PDF_FREE(pdf->ctx->dict_stack);
+	PDF_FREE(pdf->ctx->shared);
+	PDF_FREE(pdf->ctx->crypt);
+	if (pdf->xref_tbl) {
+		for (size_t i = 0; i < pdf->xref_tbl_sz; ++i)
+			if (pdf->xref_tbl[i].baseobj)
+				PDF_FREE(pdf->xref_tbl[i].baseobj->stream);
+		PDF_FREE(pdf->xref_tbl);
+	}
+	pdf__free_arena(pdf->ctx->arena);
+	PDF_FREE(pdf->ctx);
+	pdf->ctx = NULL;
+}
+
+/*
+ * Postscript parser implementation
+ */
+
+AMFDEF const char *ps_cmd_name(enum ps_cmd_type type)
+{
+	switch (type) {
+	case PS_CMD_BEGIN_MARK:                 return "Begin mark";
+	case PS_CMD_BEGIN_TEXT:                 return "Begin text";
+	case PS_CMD_CHAR_SPACING:               return "Char spacing";
+	case PS_CMD_CLIP:                       return "Clip";
+	case PS_CMD_CLIP_EVEN_ODD:              return "Clip even-odd";
+	case PS_CMD_CLOSE_FILL_STROKE:          return "Close fill stroke";
+	case PS_CMD_CLOSE_FILL_STROKE_EVEN_ODD: return "Close fill stroke even-odd";
+	case PS_CMD_CLOSE_PATH:                 return "Close path";
+	case PS_CMD_CLOSE_STROKE:               return "Close stroke";
+	case PS_CMD_CURVE_TO:                   return "Curve to";
+	case PS_CMD_CURVE_TO_V:                 return "Curve to v";
+	case PS_CMD_CURVE_TO_Y:                 return "Curve to y";
+	case PS_CMD_DASH:                       return "Dash";
+	case PS_CMD_END_MARK:                   return "End mark";
+	case PS_CMD_END_PATH:                   return "End path";
+	case PS_CMD_END_TEXT:                   return "End text";
+	case PS_CMD_EXT_GSTATE:                 return "Ext gstate";
+	case PS_CMD_FILL:                       return "Fill";
+	case PS_CMD_FILL_CMYK:                  return "Fill cmyk";
+	case PS_CMD_FILL_COLOR:                 return "Fill color";
+	case PS_CMD_FILL_COLOR_SPACE:           return "Fill color space";
+	case PS_CMD_FILL_EVEN_ODD:              return "Fill even-odd";
+	case PS_CMD_FILL_GRAY:                  return "Fill gray";
+	case PS_CMD_FILL_RGB:                   return "Fill rgb";
+	case PS_CMD_FILL_STROKE:                return "Fill stroke";
+	case PS_CMD_FILL_STROKE_EVEN_ODD:       return "Fill stroke even-odd";
+	case PS_CMD_FLATNESS:                   return "Flatness";
+	case PS_CMD_GLYPH_WIDTH:                return "Glyph width";
+	case PS_CMD_HORIZ_SCALING:              return "Horiz scaling";
+	case PS_CMD_INLINE_IMAGE:               return "Inline image";
+	case PS_CMD_LEADING:                    return "Leading";
+	case PS_CMD_LINE_CAP:                   return "Line cap";
+	case PS_CMD_LINE_JOIN:                  return "Line join";
+	case PS_CMD_LINE_TO:                    return "Line to";
+	case PS_CMD_LINE_WIDTH:                 return "Line width";
+	case PS_CMD_MARK:                       return "Mark";
+	case PS_CMD_MITER_LIMIT:                return "Miter limit";
+	case PS_CMD_MOVE_TEXT:                  return "Move text";
+	case PS_CMD_MOVE_TEXT_LEADING:          return "Move text leading";
+	case PS_CMD_MOVE_TO:                    return "Move to";
+	case PS_CMD_NEXT_LINE:                  return "Next line";
+	case PS_CMD_NEXT_LINE_SHOW_TEXT:        return "Next line show text";
+	case PS_CMD_NEXT_LINE_SHOW_TEXT_SPACED: return "Next line show text spaced";
+	case PS_CMD_OBJ:                        return "Object";
+	case PS_CMD_RECTANGLE:                  return "Rectangle";
+	case PS_CMD_RENDERING_INTENT:           return "Rendering intent";
+	case PS_CMD_RESTORE_STATE:              return "Restore state";
+	case PS_CMD_SAVE_STATE:                 return "Save state";
+	case PS_CMD_SET_FONT:                   return "Set font";
+	case PS_CMD_SHADING:                    return "Shading";
+	case PS_CMD_SHOW_TEXT:                  return "Show text";
+	case PS_CMD_SHOW_TEXT_ARR:              return "Show text array";
+	case PS_CMD_STROKE:                     return "Stroke";
+	case PS_CMD_STROKE_CMYK:                return "Stroke cmyk";
+	case PS_CMD_STROKE_COLOR:               return "Stroke color";
+	case PS_CMD_STROKE_COLOR_SPACE:         return "Stroke color space";
+	case PS_CMD_STROKE_GRAY:                return "Stroke gray";
+	case PS_CMD_STROKE_RGB:                 return "Stroke rgb";
+	case PS_CMD_TEXT_MATRIX:                return "Text matrix";
+	case PS_CMD_TEXT_RENDER:                return "Text render";
+	case PS_CMD_TEXT_RISE:                  return "Text rise";
+	case PS_CMD_TRANSFORM:                  return "Transform";
+	case PS_CMD_WORD_SPACING:               return "Word spacing";
+	}
+	assert(0);
+	return "";
+}
+
+AMFDEF void ps_init(struct ps_ctx *ctx, char *str)
+{
+	ps_init_ex(ctx, str, strlen(str), PS_CMD_ALL);
+}
+
+AMFDEF void ps_init_filtered(struct ps_ctx *ctx, char *str,
+                             unsigned long long cmd_mask)
+{
+	ps_init_ex(ctx, str, strlen(str), cmd_mask);
+}
+
+AMFDEF void ps_init_ex(struct ps_ctx *ctx, char *str, size_t sz,
+                       unsigned long long cmd_mask)
+{
+	struct ps_segment seg = { str, sz };
+	ps_init_chain(ctx, &seg, 1, cmd_mask);
+}
+
+/* Only the segments after the first are kept */
+AMFDEF void ps_init_chain(struct ps_ctx *ctx, const struct ps_segment *segs,
+                          size_t cnt, unsigned long long cmd_mask)
+{
+	ctx->stream = cnt ? segs[0].str : NULL;
+	ctx->end = cnt ? segs[0].str + segs[0].sz : NULL;
+	ctx->segs = cnt > 1 ? segs + 1 : NULL;
+	ctx->seg_cnt = cnt > 1 ? cnt - 1 : 0;
+	ctx->args.sz = 0;
+	ctx->args.cap = 0;
+	ctx->args.entries = NULL;
+	ctx->args.parent = NULL;
+	ctx->cmd_mask = cmd_mask & PS_CMD_BUILD_MASK;
+	ctx->compat = 0;
+	ctx->text_elems = NULL;
+	ctx->text_elems_cap = 0;
+}
+
+enum ps__argtype
+{
+	PS_ARG_ARR,
+	PS_ARG_DICT,
+	PS_ARG_HEX,
+	PS_ARG_KEYWORD,
+	PS_ARG_NAME,
+	PS_ARG_REAL,
+	PS_ARG_STR,
+};
+
+struct ps__arg_scalar
+{
+	char *start, *end, replacement;
+};
+
+struct ps__arg
+{
+	enum ps__argtype type;
+	union
+	{
+		struct ps__arg_arr arr;
+		struct ps__arg_scalar val;
+	};
+};
+
+static int ps__is_ws(int c)
+{
+	return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\f'
+	    || c == '\0';
+}
+
+/* The end of a segment is whitespace too */
+static void ps__consume_ws(struct ps_ctx *ctx)
+{
+	while (ctx->stream != ctx->end || ctx->seg_cnt) {
+		if (ctx->stream == ctx->end) {
+			ctx->stream = ctx->segs->str;
+			ctx->end = ctx->segs->str + ctx->segs->sz;
+			++ctx->segs;
+			--ctx->seg_cnt;
+		} else if (*ctx->stream == '%') {
+			while (   ctx->stream != ctx->end
+			       && *ctx->stream != '\n'
+			       && *ctx->stream != '\r')
+				++ctx->stream;
+		} else if (ps__is_ws(*ctx->stream))
+			++ctx->stream;
+		else
+			break;
+	}
+}
+
+static void ps__consume_name(struct ps_ctx *ctx)
+{
+	while (   ctx->stream != ctx->end
+	       && !ps__is_ws(*ctx->stream)
+	       && !pdf__is_delim(*ctx->stream))
+		++ctx->stream;
+}
+
+static void ps__consume_digits(struct ps_ctx *ctx)
+{
+	while (   ctx->stream != ctx->end
+	       && (isdigit(*ctx->stream) || *ctx->stream == '.'))
+		++ctx->stream;
+}
+
+/* Leaves the stream on the closing paren, skipping nested pairs */
+static int ps__consume_str(struct ps_ctx *ctx)
+{
+	int depth = 1;
+	for (char *p = ctx->stream; p < ctx->end; ++p) {
+		switch (*p) {
+		case '\\':
+			++p;
+		break;
+		case '(':
+			++depth;
+		break;
+		case ')':
+			if (--depth == 0) {
+				ctx->stream = p;
+				return 0;
+			}
+		break;
+		}
+	}
+	return 1;
+}
+
+static int ps__consume_to(struct ps_ctx *ctx, char c)
+{
+	char *p = memchr(ctx->stream, c, ctx->end - ctx->stream);
+	if (!p)
+		return 1;
+	ctx->stream = p;
+	return 0;
+}
+
+static struct ps__arg *ps__arg_arr_grow(struct ps__arg_arr *args)
+{
+	if (args->sz == args->cap) {
+		args->cap = args->cap ? 2*args->cap : 8;
+		args->entries = PDF_REALLOC(args->entries,
+		                            args->cap*sizeof(struct ps__arg));
+	}
+	return args->entries + args->sz++;
+}
+
+static struct ps__arg_arr *ps__arg_arr_push(struct ps__arg_arr *args,
+                                            enum ps__argtype type)
+{
+	struct ps__arg *arg = ps__arg_arr_grow(args);
+	arg->type = type;
+	arg->arr.entries = NULL;
+	arg->arr.sz = 0;
+	arg->arr.cap = 0;
+	arg->arr.parent = args;
+	return &arg->arr;
+}
+
+static struct ps__arg *ps__arg_arr_owner(struct ps__arg_arr *args)
+{
+	struct ps__arg_arr *parent = args->parent;
+	return parent->entries + parent->sz - 1;
+}
+
+static int ps__word_is(const char *start, const char *end, const char *word)
+{
+	size_t len = strlen(word);
+	return (size_t)(end - start) == len && strncmp(start, word, len) == 0;
+}
+
+/* Leaves the stream at the start of the operator following the args */
+static int ps__parse_args(struct ps_ctx *ctx)
+{
+	struct ps__arg_arr *args = &ctx->args;
+	struct ps__arg *arg;
+	char *start;
+	while (1) {
+		ps__consume_ws(ctx);
+		if (ctx->stream == ctx->end) {
+			PDF_ERRIF(args->parent, PS_ERR, "Unterminated array\n");
+			return PS_END;
+		}
+		switch (*ctx->stream) {
+		case '/':
+			arg = ps__arg_arr_grow(args);
+			arg->type = PS_ARG_NAME;
+			++ctx->stream;
+			arg->val.start = ctx->stream;
+			ps__consume_name(ctx);
+			arg->val.end = ctx->stream;
+		break;
+		case '-':
+		case '+':
+		case '.':
+		case '0':
+		case '1':
+		case '2':
+		case '3':
+		case '4':
+		case '5':
+		case '6':
+		case '7':
+		case '8':
+		case '9':
+			arg = ps__arg_arr_grow(args);
+			arg->type = PS_ARG_REAL;
+			arg->val.start = ctx->stream;
+			/* '9' - '-' = 12; '9' - '+' = 14; '9' - '.' = 11 */
+			ctx->stream += ('9' - *ctx->stream)/10;
+			ps__consume_digits(ctx);
+			arg->val.end = ctx->stream;
+		break;
+		case '(':
+			arg = ps__arg_arr_grow(args);
+			arg->type = PS_ARG_STR;
+			arg->val.start = ++ctx->stream;
+			if (ps__consume_str(ctx))
+				PDF_ERR(PS_ERR, "Unterminated text string\n");
+			arg->val.end = ctx->stream;
+			++ctx->stream;
+		break;
+		case '<':
+			if (ctx->stream + 1 != ctx->end && ctx->stream[1] == '<') {
+				args = ps__arg_arr_push(args, PS_ARG_DICT);
+				ctx->stream += 2;
+				break;
+			}
+			arg = ps__arg_arr_grow(args);
+			arg->type = PS_ARG_HEX;
+			arg->val.start = ++ctx->stream;
+			if (ps__consume_to(ctx, '>'))
+				PDF_ERR(PS_ERR, "Unterminated hex string\n");
+			arg->val.end = ctx->stream;
+			++ctx->stream;
+		break;
+		case '>':
+			PDF_ERRIF(   !args->parent
+			          || ps__arg_arr_owner(args)->type != PS_ARG_DICT
+			          || ctx->stream + 1 == ctx->end
+			          || ctx->stream[1] != '>',
+			          PS_ERR, "Unexpected end of dict token\n");
+			args = args->parent;
+			ctx->stream += 2;
+		break;
+		case '[':
+			args = ps__arg_arr_push(args, PS_ARG_ARR);
+			++ctx->stream;
+		break;
+		case ']':
+			PDF_ERRIF(   !args->parent
+			          || ps__arg_arr_owner(args)->type != PS_ARG_ARR,
+			          PS_ERR, "Unexpected end of array text token\n");
+			args = args->parent;
+			++ctx->stream;
+		break;
+		default:
+			start = ctx->stream;
+			ps__consume_name(ctx);
+			PDF_ERRIF(ctx->stream == start, PS_ERR,
+			          "Unexpected '%c' in content stream\n", *start);
+			if (   ps__word_is(start, ctx->stream, "true")
+			    || ps__word_is(start, ctx->stream, "false")
+			    || ps__word_is(start, ctx->stream, "null")) {
+				arg = ps__arg_arr_grow(args);
+				arg->type = PS_ARG_KEYWORD;
+				arg->val.start = start;
+				arg->val.end = ctx->stream;
+				break;
+			}
+			ctx->stream = start;
+			PDF_ERRIF(args->parent, PS_ERR, "Unterminated array\n");
+			return PS_OK;
+		break;
+		}
+	}
+}
+
+/*
+ * Inline image data runs from the byte after "ID" and its single
+ * whitespace char up to the "EI" operator.  The data is binary, so rather
+ * than tokenize it, use its Length if given, otherwise memchr for an "EI"
+ * surrounded by whitespace.
+ */
+static int ps__skip_inline_image(struct ps_ctx *ctx, struct ps_cmd *cmd)
+{
+	char *start, *p;
+	size_t len = 0;
+
+	for (size_t i = 0; i + 1 < ctx->args.sz; i += 2) {
+		struct ps__arg *key = ctx->args.entries+i;
+		struct ps__arg *val = ctx->args.entries+i+1;
+		if (key->type != PS_ARG_NAME || val->type != PS_ARG_REAL)
+			continue;
+		if (   ps__word_is(key->val.start, key->val.end, "L")
+		    || ps__word_is(key->val.start, key->val.end, "Length"))
+			len = strtoul(val->val.start, NULL, 10);
+	}
+
+	start = ctx->stream + 2;
+	PDF_ERRIF(start >= ctx->end || !ps__is_ws(*start), PS_ERR,
+	          "Inline image missing data\n");
+	++start;
+
+	/* the data and its EI are never split across segments */
+	if (len && len <= (size_t)(ctx->end - start)) {
+		p = start + len;
+		while (p != ctx->end && ps__is_ws(*p))
+			++p;
+		if (ctx->end - p >= 2 && strncmp(p, "EI", 2) == 0)
+			goto found;
+	}
+
+	p = start;
+	while ((p = memchr(p, 'E', ctx->end - p))) {
+		if (   p + 1 != ctx->end && p[1] == 'I'
+		    && p > start && ps__is_ws(p[-1])
+		    && (   p + 2 == ctx->end
+		        || ps__is_ws(p[2])
+		        || pdf__is_delim(p[2])))
+			goto found;
+		++p;
+	}
+	PDF_ERR(PS_ERR, "Unterminated inline image\n");
+
+found:
+	cmd->inline_image.data = start;
+	cmd->inline_image.sz = p - start;
+	/* the whitespace preceding EI is not part of the data */
+	if (cmd->inline_image.sz && !len)
+		--cmd->inline_image.sz;
+	else if (len && len < cmd->inline_image.sz)
+		cmd->inline_image.sz = len;
+	ctx->stream = p + 2;
+	return PS_OK;
+}
+
+/* Operators are at most 3 chars, so pack them into a switchable key */
+#define PS__OP(a, b, c) \
+	((unsigned)(a) | (unsigned)(b) << 8 | (unsigned)(c) << 16)
+
+#define PS__OP_CMD     0
+#define PS__OP_UNKNOWN 1
+#define PS__OP_BX      2
+#define PS__OP_EX      3
+
+static int ps__lookup_op(const char *start, const char *end,
+                         enum ps_cmd_type *type)
+{
+	size_t len = end - start;
+	unsigned key;
+
+	if (len == 0 || len > 3)
+		return PS__OP_UNKNOWN;
+	key = PS__OP(start[0], len > 1 ? start[1] : 0, len > 2 ? start[2] : 0);
+
+	switch (key) {
+	case PS__OP('b', 0, 0):   *type = PS_CMD_CLOSE_FILL_STROKE; break;
+	case PS__OP('B', 0, 0):   *type = PS_CMD_FILL_STROKE; break;
+	case PS__OP('b', '*', 0): *type = PS_CMD_CLOSE_FILL_STROKE_EVEN_ODD; break;
+	case PS__OP('B', '*', 0): *type = PS_CMD_FILL_STROKE_EVEN_ODD; break;
+	case PS__OP('B','D','C'): *type = PS_CMD_BEGIN_MARK; break;
+	case PS__OP('B', 'I', 0): *type = PS_CMD_INLINE_IMAGE; break;
+	case PS__OP('B','M','C'): *type = PS_CMD_BEGIN_MARK; break;
+	case PS__OP('B', 'T', 0): *type = PS_CMD_BEGIN_TEXT; break;
+	case PS__OP('B', 'X', 0): return PS__OP_BX;
+	case PS__OP('c', 0, 0):   *type = PS_CMD_CURVE_TO; break;
+	case PS__OP('c', 'm', 0): *type = PS_CMD_TRANSFORM; break;
+	case PS__OP('C', 'S', 0): *type = PS_CMD_STROKE_COLOR_SPACE; break;
+	case PS__OP('c', 's', 0): *type = PS_CMD_FILL_COLOR_SPACE; break;
+	case PS__OP('d', 0, 0):   *type = PS_CMD_DASH; break;
+	case PS__OP('d', '0', 0): *type = PS_CMD_GLYPH_WIDTH; break;
+	case PS__OP('d', '1', 0): *type = PS_CMD_GLYPH_WIDTH; break;
+	case PS__OP('D', 'o', 0): *type = PS_CMD_OBJ; break;
+	case PS__OP('D', 'P', 0): *type = PS_CMD_MARK; break;
+	case PS__OP('E','M','C'): *type = PS_CMD_END_MARK; break;
+	case PS__OP('E', 'T', 0): *type = PS_CMD_END_TEXT; break;
+	case PS__OP('E', 'X', 0): return PS__OP_EX;
+	case PS__OP('f', 0, 0):   *type = PS_CMD_FILL; break;
+	case PS__OP('F', 0, 0):   *type = PS_CMD_FILL; break;
+	case PS__OP('f', '*', 0): *type = PS_CMD_FILL_EVEN_ODD; break;
+	case PS__OP('G', 0, 0):   *type = PS_CMD_STROKE_GRAY; break;
+	case PS__OP('g', 0, 0):   *type = PS_CMD_FILL_GRAY; break;
+	case PS__OP('g', 's', 0): *type = PS_CMD_EXT_GSTATE; break;
+	case PS__OP('h', 0, 0):   *type = PS_CMD_CLOSE_PATH; break;
+	case PS__OP('i', 0, 0):   *type = PS_CMD_FLATNESS; break;
+	case PS__OP('j', 0, 0):   *type = PS_CMD_LINE_JOIN; break;
+	case PS__OP('J', 0, 0):   *type = PS_CMD_LINE_CAP; break;
+	case PS__OP('K', 0, 0):   *type = PS_CMD_STROKE_CMYK; break;
+	case PS__OP('k', 0, 0):   *type = PS_CMD_FILL_CMYK; break;
+	case PS__OP('l', 0, 0):   *type = PS_CMD_LINE_TO; break;
+	case PS__OP('m', 0, 0):   *type = PS_CMD_MOVE_TO; break;
+	case PS__OP('M', 0, 0):   *type = PS_CMD_MITER_LIMIT; break;
+	case PS__OP('M', 'P', 0): *type = PS_CMD_MARK; break;
+	case PS__OP('n', 0, 0):   *type = PS_CMD_END_PATH; break;
+	case PS__OP('q', 0, 0):   *type = PS_CMD_SAVE_STATE; break;
+	case PS__OP('Q', 0, 0):   *type = PS_CMD_RESTORE_STATE; break;
+	case PS__OP('r', 'e', 0): *type = PS_CMD_RECTANGLE; break;
+	case PS__OP('R', 'G', 0): *type = PS_CMD_STROKE_RGB; break;
+	case PS__OP('r', 'g', 0): *type = PS_CMD_FILL_RGB; break;
+	case PS__OP('r', 'i', 0): *type = PS_CMD_RENDERING_INTENT; break;
+	case PS__OP('s', 0, 0):   *type = PS_CMD_CLOSE_STROKE; break;
+	case PS__OP('S', 0, 0):   *type = PS_CMD_STROKE; break;
+	case PS__OP('S', 'C', 0): *type = PS_CMD_STROKE_COLOR; break;
+	case PS__OP('s', 'c', 0): *type = PS_CMD_FILL_COLOR; break;
+	case PS__OP('S','C','N'): *type = PS_CMD_STROKE_COLOR; break;
+	case PS__OP('s','c','n'): *type = PS_CMD_FILL_COLOR; break;
+	case PS__OP('s', 'h', 0): *type = PS_CMD_SHADING; break;
+	case PS__OP('T', '*', 0): *type = PS_CMD_NEXT_LINE; break;
+	case PS__OP('T', 'c', 0): *type = PS_CMD_CHAR_SPACING; break;
+	case PS__OP('T', 'd', 0): *type = PS_CMD_MOVE_TEXT; break;
+	case PS__OP('T', 'D', 0): *type = PS_CMD_MOVE_TEXT_LEADING; break;
+	case PS__OP('T', 'f', 0): *type = PS_CMD_SET_FONT; break;
+	case PS__OP('T', 'j', 0): *type = PS_CMD_SHOW_TEXT; break;
+	case PS__OP('T', 'J', 0): *type = PS_CMD_SHOW_TEXT_ARR; break;
+	case PS__OP('T', 'L', 0): *type = PS_CMD_LEADING; break;
+	case PS__OP('T', 'm', 0): *type = PS_CMD_TEXT_MATRIX; break;
+	case PS__OP('T', 'r', 0): *type = PS_CMD_TEXT_RENDER; break;
+	case PS__OP('T', 's', 0): *type = PS_CMD_TEXT_RISE; break;
+	case PS__OP('T', 'w', 0): *type = PS_CMD_WORD_SPACING; break;
+	case PS__OP('T', 'z', 0): *type = PS_CMD_HORIZ_SCALING; break;
+	case PS__OP('v', 0, 0):   *type = PS_CMD_CURVE_TO_V; break;
+	case PS__OP('w', 0, 0):   *type = PS_CMD_LINE_WIDTH; break;
+	case PS__OP('W', 0, 0):   *type = PS_CMD_CLIP; break;
+	case PS__OP('W', '*', 0): *type = PS_CMD_CLIP_EVEN_ODD; break;
+	case PS__OP('y', 0, 0):   *type = PS_CMD_CURVE_TO_Y; break;
+	case PS__OP('\'', 0, 0):  *type = PS_CMD_NEXT_LINE_SHOW_TEXT; break;
+	case PS__OP('"', 0, 0):   *type = PS_CMD_NEXT_LINE_SHOW_TEXT_SPACED; break;
+	default:                  return PS__OP_UNKNOWN;
+	}
+	return PS__OP_CMD;
+}
+
+static int ps__next_cmd(struct ps_ctx *ctx, struct ps_cmd *cmd)
+{
+	int ret;
+	char *start;
+
+	ret = ps__parse_args(ctx);
+	if (ret != PS_OK)
+		return ret;
+
+	start = ctx->stream;
+	ps__consume_name(ctx);
+	switch (ps__lookup_op(start, ctx->stream, &cmd->type)) {
+	case PS__OP_CMD:
+		if (cmd->type != PS_CMD_INLINE_IMAGE)
+			return PS_OK;
+		/* BI is followed by key/value pairs up to the ID operator */
+		PDF_ERRIF(ctx->args.sz, PS_ERR,
+		          "%s called with params when none expected\n",
+		          ps_cmd_name(cmd->type));
+		ret = ps__parse_args(ctx);
+		if (ret != PS_OK)
+			PDF_ERR(PS_ERR, "Unterminated inline image\n");
+		start = ctx->stream;
+		ps__consume_name(ctx);
+		PDF_ERRIF(!ps__word_is(start, ctx->stream, "ID"), PS_ERR,
+		          "Inline image missing ID\n");
+		ctx->stream = start;
+		return ps__skip_inline_image(ctx, cmd);
+	case PS__OP_BX:
+		++ctx->compat;
+		return PS_META_CMD;
+	case PS__OP_EX:
+		PDF_ERRIF(!ctx->compat, PS_ERR, "EX without matching BX\n");
+		--ctx->compat;
+		return PS_META_CMD;
+	}
+	/* unknown operators are permitted within a compatibility section */
+	if (ctx->compat)
+		return PS_META_CMD;
+	PDF_LOG("Unknown command '%.*s'\n", (int)(ctx->stream - start), start);
+	return PS_ERR;
+}
+
+/* Drops the args but keeps the top-level storage for the next command */
+static void ps__clear_arg_arr(struct ps__arg_arr *arr)
+{
+	for (size_t i = 0; i < arr->sz; ++i) {
+		switch (arr->entries[i].type) {
+		case PS_ARG_ARR:
+		case PS_ARG_DICT:
+			ps__clear_arg_arr(&arr->entries[i].arr);
+			PDF_FREE(arr->entries[i].arr.entries);
+		break;
+		default:
+		break;
+		}
+	}
+	arr->sz = 0;
+}
+
+static void ps__free_arg_arr(struct ps__arg_arr *arr)
+{
+	ps__clear_arg_arr(arr);
+	PDF_FREE(arr->entries);
+	arr->entries = NULL;
+	arr->cap = 0;
+}
+
+static void ps__restore_arg_ends(struct ps__arg_arr *arr)
+{
+	for (size_t i = 0; i < arr->sz; ++i) {
+		switch (arr->entries[i].type) {
+		case PS_ARG_ARR:
+		case PS_ARG_DICT:
+			ps__restore_arg_ends(&arr->entries[i].arr);
+		break;
+		default:
+			*arr->entries[i].val.end = arr->entries[i].val.replacement;
+		break;
+		}
+	}
+}
+
+static void ps__replace_arg_ends(struct ps__arg_arr *arr)
+{
+	for (size_t i = 0; i < arr->sz; ++i) {
+		switch (arr->entries[i].type) {
+		case PS_ARG_ARR:
+		case PS_ARG_DICT:
+			ps__replace_arg_ends(&arr->entries[i].arr);
+		break;
+		default:
+			arr->entries[i].val.replacement = *arr->entries[i].val.end;
+			*arr->entries[i].val.end = '\0';
+		break;
+		}
+	}
+}
+
+static int ps__real_args(struct ps__arg_arr *args, struct ps_cmd *cmd,
+                         size_t cnt, float *vals)
+{
+	PDF_ERRIF(args->sz != cnt, PS_ERR, "%s called with incorrect params\n",
+	          ps_cmd_name(cmd->type));
+	for (size_t i = 0; i < cnt; ++i) {
+		PDF_ERRIF(args->entries[i].type != PS_ARG_REAL, PS_ERR,
+		          "%s called with incorrect params\n",
+		          ps_cmd_name(cmd->type));
+		vals[i] = strtof(args->entries[i].val.start, NULL);
+	}
+	return PS_OK;
+}
+
+static int ps__name_arg(struct ps__arg_arr *args, struct ps_cmd *cmd,
+                        const char **name)
+{
+	PDF_ERRIF(!(   args->sz == 1
+	            && args->entries[0].type == PS_ARG_NAME),
+	          PS_ERR, "%s called with incorrect params\n",
+	          ps_cmd_name(cmd->type));
+	*name = args->entries[0].val.start;
+	return PS_OK;
+}
+
+static int ps__str_arg(struct ps__arg *arg, const char **str, size_t *len,
+                       int *hex)
+{
+	if (arg->type != PS_ARG_STR && arg->type != PS_ARG_HEX)
+		return PS_ERR;
+	*str = arg->val.start;
+	*len = arg->val.end - arg->val.start;
+	*hex = arg->type == PS_ARG_HEX;
+	return PS_OK;
+}
+
+static int ps__assign_text_arr(struct ps_ctx *ctx, struct ps_cmd *cmd)
+{
+	struct ps__arg_arr *args = &ctx->args, *arr;
+
+	PDF_ERRIF(!(   args->sz == 1
+	            && args->entries[0].type == PS_ARG_ARR),
+	          PS_ERR, "%s called with incorrect params\n",
+	          ps_cmd_name(cmd->type));
+	arr = &args->entries[0].arr;
+	if (arr->sz > ctx->text_elems_cap) {
+		ctx->text_elems_cap = arr->sz;
+		ctx->text_elems = PDF_REALLOC(ctx->text_elems,
+		                              arr->sz*sizeof(struct ps_text_elem));
+	}
+	for (size_t i = 0; i < arr->sz; ++i) {
+		struct ps__arg *arg = arr->entries+i;
+		struct ps_text_elem *elem = ctx->text_elems+i;
+		if (arg->type == PS_ARG_REAL) {
+			elem->str = NULL;
+			elem->len = 0;
+			elem->hex = 0;
+			elem->adjust = strtof(arg->val.start, NULL);
+		} else {
+			PDF_ERRIF(ps__str_arg(arg, &elem->str, &elem->len, &elem->hex), PS_ERR,
+			          "%s array has invalid element\n",
+			          ps_cmd_name(cmd->type));
+			elem->adjust = 0;
+		}
+	}
+	cmd->show_text_arr.elems = ctx->text_elems;
+	cmd->show_text_arr.sz = arr->sz;
+	return PS_OK;
+}
+
+static int ps__assign_color(struct ps__arg_arr *args, struct ps_cmd *cmd)
+{
+	size_t cnt = args->sz;
+
+	cmd->color.pattern = NULL;
+	if (cnt && args->entries[cnt-1].type == PS_ARG_NAME)
+		cmd->color.pattern = args->entries[--cnt].val.start;
+	PDF_ERRIF(cnt > PS_COLOR_SZ, PS_ERR,
+	          "%s components exceed implementation limit\n",
+	          ps_cmd_name(cmd->type));
+	for (size_t i = 0; i < cnt; ++i) {
+		PDF_ERRIF(args->entries[i].type != PS_ARG_REAL, PS_ERR,
+		          "%s called with incorrect params\n",
+		          ps_cmd_name(cmd->type));
+		cmd->color.val[i] = strtof(args->entries[i].val.start, NULL);
+	}
+	cmd->color.sz = cnt;
+	return PS_OK;
+}
+
+static void ps__assign_inline_image(struct ps__arg_arr *args,
+                                    struct ps_cmd *cmd)
+{
+	cmd->inline_image.width = 0;
+	cmd->inline_image.height = 0;
+	for (size_t i = 0; i + 1 < args->sz; i += 2) {
+		struct ps__arg *key = args->entries+i, *val = args->entries+i+1;
+		if (key->type != PS_ARG_NAME || val->type != PS_ARG_REAL)
+			continue;
+		if (   strcmp(key->val.start, "W") == 0
+		    || strcmp(key->val.start, "Width") == 0)
+			cmd->inline_image.width = atoi(val->val.start);
+		else if (   strcmp(key->val.start, "H") == 0
+		         || strcmp(key->val.start, "Height") == 0)
+			cmd->inline_image.height = atoi(val->val.start);
+	}
+}
+
+/* Constant, so cases excluded by PS_CMD_BUILD_MASK are compiled out */
+#define PS__BUILT(mask) (((mask) & PS_CMD_BUILD_MASK) != 0)
+
+static int ps__assign_cmd_args(struct ps_ctx *ctx, struct ps_cmd *cmd)
+{
+	struct ps__arg_arr *args = &ctx->args;
+	float v[6];
+
+	switch (cmd->type) {
+	case PS_CMD_BEGIN_MARK:
+	case PS_CMD_MARK:
+		if (!PS__BUILT(PS_CMD_BIT(PS_CMD_BEGIN_MARK) | PS_CMD_BIT(PS_CMD_MARK)))
+			break;
+		PDF_ERRIF(!(   (args->sz == 1 || args->sz == 2)
+		            && args->entries[0].type == PS_ARG_NAME),
+		          PS_ERR, "%s called with incorrect params\n",
+		          ps_cmd_name(cmd->type));
+		cmd->mark.tag = args->entries[0].val.start;
+		cmd->mark.props =    args->sz == 2
+		                  && args->entries[1].type == PS_ARG_NAME
+		                ? args->entries[1].val.start : NULL;
+	break;
+	case PS_CMD_CHAR_SPACING:
+	case PS_CMD_FLATNESS:
+	case PS_CMD_HORIZ_SCALING:
+	case PS_CMD_LEADING:
+	case PS_CMD_MITER_LIMIT:
+	case PS_CMD_TEXT_RISE:
+	case PS_CMD_WORD_SPACING:
+		if (!PS__BUILT(  PS_CMD_BIT(PS_CMD_CHAR_SPACING)
+		                | PS_CMD_BIT(PS_CMD_FLATNESS)
+		                | PS_CMD_BIT(PS_CMD_HORIZ_SCALING)
+		                | PS_CMD_BIT(PS_CMD_LEADING)
+		                | PS_CMD_BIT(PS_CMD_MITER_LIMIT)
+		                | PS_CMD_BIT(PS_CMD_TEXT_RISE)
+		                | PS_CMD_BIT(PS_CMD_WORD_SPACING)))
+			break;
+		if (ps__real_args(args, cmd, 1, v))
+			return PS_ERR;
+		cmd->real.val = v[0];
+	break;
+	case PS_CMD_CURVE_TO:
+		if (!PS__BUILT(PS_CMD_BIT(PS_CMD_CURVE_TO)))
+			break;
+		if (ps__real_args(args, cmd, 6, v))
+			return PS_ERR;
+		cmd->curve.x1 = v[0];
+		cmd->curve.y1 = v[1];
+		cmd->curve.x2 = v[2];
+		cmd->curve.y2 = v[3];
+		cmd->curve.x3 = v[4];
+		cmd->curve.y3 = v[5];
+	break;
+	case PS_CMD_CURVE_TO_V:
+		if (!PS__BUILT(PS_CMD_BIT(PS_CMD_CURVE_TO_V)))
+			break;
+		if (ps__real_args(args, cmd, 4, v))
+			return PS_ERR;
+		cmd->curve.x2 = v[0];
+		cmd->curve.y2 = v[1];
+		cmd->curve.x3 = v[2];
+		cmd->curve.y3 = v[3];
+	break;
+	case PS_CMD_CURVE_TO_Y:
+		if (!PS__BUILT(PS_CMD_BIT(PS_CMD_CURVE_TO_Y)))
+			break;
+		if (ps__real_args(args, cmd, 4, v))
+			return PS_ERR;
+		cmd->curve.x1 = v[0];
+		cmd->curve.y1 = v[1];
+		cmd->curve.x3 = v[2];
+		cmd->curve.y3 = v[3];
+	break;
+	case PS_CMD_DASH:
+		if (!PS__BUILT(PS_CMD_BIT(PS_CMD_DASH)))
+			break;
+		PDF_ERRIF(!(   args->sz == 2
+		            && args->entries[0].type == PS_ARG_ARR
+		            && args->entries[1].type == PS_ARG_REAL),
+		          PS_ERR, "%s called with incorrect params\n",
+		          ps_cmd_name(cmd->type));
+		PDF_ERRIF(args->entries[0].arr.sz > PS_DASH_SZ, PS_ERR,
+		          "%s array exceeds implementation limit\n",
+		          ps_cmd_name(cmd->type));
+		for (size_t i = 0; i < args->entries[0].arr.sz; ++i) {
+			struct ps__arg *arg = args->entries[0].arr.entries+i;
+			PDF_ERRIF(arg->type != PS_ARG_REAL, PS_ERR,
+			          "%s array has non-real value\n",
+			          ps_cmd_name(cmd->type));
+			cmd->dash.arr[i] = atoi(arg->val.start);
+		}
+		if (args->entries[0].arr.sz < PS_DASH_SZ)
+			cmd->dash.arr[args->entries[0].arr.sz] = -1;
+		cmd->dash.phase = atoi(args->entries[1].val.start);
+	break;
+	case PS_CMD_EXT_GSTATE:
+	case PS_CMD_FILL_COLOR_SPACE:
+	case PS_CMD_RENDERING_INTENT:
+	case PS_CMD_SHADING:
+	case PS_CMD_STROKE_COLOR_SPACE:
+		if (!PS__BUILT(  PS_CMD_BIT(PS_CMD_EXT_GSTATE)
+		                | PS_CMD_BIT(PS_CMD_FILL_COLOR_SPACE)
+		                | PS_CMD_BIT(PS_CMD_RENDERING_INTENT)
+		                | PS_CMD_BIT(PS_CMD_SHADING)
+		                | PS_CMD_BIT(PS_CMD_STROKE_COLOR_SPACE)))
+			break;
+		if (ps__name_arg(args, cmd, &cmd->name.val))
+			return PS_ERR;
+	break;
+	case PS_CMD_FILL_CMYK:
+	case PS_CMD_STROKE_CMYK:
+		if (!PS__BUILT(  PS_CMD_BIT(PS_CMD_FILL_CMYK)
+		                | PS_CMD_BIT(PS_CMD_STROKE_CMYK)))
+			break;
+		if (ps__real_args(args, cmd, 4, v))
+			return PS_ERR;
+		cmd->cmyk.c = v[0];
+		cmd->cmyk.m = v[1];
+		cmd->cmyk.y = v[2];
+		cmd->cmyk.k = v[3];
+	break;
+	case PS_CMD_FILL_COLOR:
+	case PS_CMD_STROKE_COLOR:
+		if (!PS__BUILT(  PS_CMD_BIT(PS_CMD_FILL_COLOR)
+		                | PS_CMD_BIT(PS_CMD_STROKE_COLOR)))
+			break;
+		return ps__assign_color(args, cmd);
+	case PS_CMD_FILL_GRAY:
+	case PS_CMD_STROKE_GRAY:
+		if (!PS__BUILT(  PS_CMD_BIT(PS_CMD_FILL_GRAY)
+		                | PS_CMD_BIT(PS_CMD_STROKE_GRAY)))
+			break;
+		if (ps__real_args(args, cmd, 1, v))
+			return PS_ERR;
+		cmd->gray.val = v[0];
+	break;
+	case PS_CMD_FILL_RGB:
+	case PS_CMD_STROKE_RGB:
+		if (!PS__BUILT(  PS_CMD_BIT(PS_CMD_FILL_RGB)
+		                | PS_CMD_BIT(PS_CMD_STROKE_RGB)))
+			break;
+		if (ps__real_args(args, cmd, 3, v))
+			return PS_ERR;
+		cmd->rgb.r = v[0];
+		cmd->rgb.g = v[1];
+		cmd->rgb.b = v[2];
+	break;
+	case PS_CMD_GLYPH_WIDTH:
+		if (!PS__BUILT(PS_CMD_BIT(PS_CMD_GLYPH_WIDTH)))
+			break;
+		cmd->glyph_width.bbox = args->sz == 6;
+		if (ps__real_args(args, cmd, cmd->glyph_width.bbox ? 6 : 2, v))
+			return PS_ERR;
+		cmd->glyph_width.wx = v[0];
+		cmd->glyph_width.wy = v[1];
+		if (cmd->glyph_width.bbox) {
+			cmd->glyph_width.llx = v[2];
+			cmd->glyph_width.lly = v[3];
+			cmd->glyph_width.urx = v[4];
+			cmd->glyph_width.ury = v[5];
+		}
+	break;
+	case PS_CMD_INLINE_IMAGE:
+		if (!PS__BUILT(PS_CMD_BIT(PS_CMD_INLINE_IMAGE)))
+			break;
+		ps__assign_inline_image(args, cmd);
+	break;
+	case PS_CMD_LINE_CAP:
+	case PS_CMD_LINE_JOIN:
+	case PS_CMD_TEXT_RENDER:
+		if (!PS__BUILT(  PS_CMD_BIT(PS_CMD_LINE_CAP)
+		                | PS_CMD_BIT(PS_CMD_LINE_JOIN)
+		                | PS_CMD_BIT(PS_CMD_TEXT_RENDER)))
+			break;
+		if (ps__real_args(args, cmd, 1, v))
+			return PS_ERR;
+		cmd->intg.val = v[0];
+	break;
+	case PS_CMD_LINE_TO:
+	case PS_CMD_MOVE_TO:
+		if (!PS__BUILT(PS_CMD_BIT(PS_CMD_LINE_TO) | PS_CMD_BIT(PS_CMD_MOVE_TO)))
+			break;
+		if (ps__real_args(args, cmd, 2, v))
+			return PS_ERR;
+		cmd->pos.x = v[0];
+		cmd->pos.y = v[1];
+	break;
+	case PS_CMD_LINE_WIDTH:
+		if (!PS__BUILT(PS_CMD_BIT(PS_CMD_LINE_WIDTH)))
+			break;
+		if (ps__real_args(args, cmd, 1, v))
+			return PS_ERR;
+		cmd->line_width.val = v[0];
+	break;
+	case PS_CMD_MOVE_TEXT:
+	case PS_CMD_MOVE_TEXT_LEADING:
+		if (!PS__BUILT(  PS_CMD_BIT(PS_CMD_MOVE_TEXT)
+		                | PS_CMD_BIT(PS_CMD_MOVE_TEXT_LEADING)))
+			break;
+		if (ps__real_args(args, cmd, 2, v))
+			return PS_ERR;
+		cmd->pos.x = v[0];
+		cmd->pos.y = v[1];
+	break;
+	case PS_CMD_NEXT_LINE_SHOW_TEXT:
+	case PS_CMD_SHOW_TEXT:
+		if (!PS__BUILT(  PS_CMD_BIT(PS_CMD_NEXT_LINE_SHOW_TEXT)
+		                | PS_CMD_BIT(PS_CMD_SHOW_TEXT)))
+			break;
+		PDF_ERRIF(   args->sz != 1
+		          || ps__str_arg(args->entries, &cmd->show_text.str,
+		                         &cmd->show_text.len, &cmd->show_text.hex),
+		          PS_ERR, "%s called with incorrect params\n",
+		          ps_cmd_name(cmd->type));
+	break;
+	case PS_CMD_NEXT_LINE_SHOW_TEXT_SPACED:
+		if (!PS__BUILT(PS_CMD_BIT(PS_CMD_NEXT_LINE_SHOW_TEXT_SPACED)))
+			break;
+		PDF_ERRIF(!(   args->sz == 3
+		            && args->entries[0].type == PS_ARG_REAL
+		            && args->entries[1].type == PS_ARG_REAL
+		            && PDF_OK(ps__str_arg(args->entries+2,
+		                                  &cmd->spaced_text.str,
+		                                  &cmd->spaced_text.len,
+		                                  &cmd->spaced_text.hex))),
+		          PS_ERR, "%s called with incorrect params\n",
+		          ps_cmd_name(cmd->type));
+		cmd->spaced_text.word_spacing =
+			strtof(args->entries[0].val.start, NULL);
+		cmd->spaced_text.char_spacing =
+			strtof(args->entries[1].val.start, NULL);
+	break;
+	case PS_CMD_OBJ:
+		if (!PS__BUILT(PS_CMD_BIT(PS_CMD_OBJ)))
+			break;
+		if (ps__name_arg(args, cmd, &cmd->obj.name))
+			return PS_ERR;
+	break;
+	case PS_CMD_RECTANGLE:
+		if (!PS__BUILT(PS_CMD_BIT(PS_CMD_RECTANGLE)))
+			break;
+		if (ps__real_args(args, cmd, 4, v))
+			return PS_ERR;
+		cmd->rectangle.x = v[0];
+		cmd->rectangle.y = v[1];
+		cmd->rectangle.width = v[2];
+		cmd->rectangle.height = v[3];
+	break;
+	case PS_CMD_SET_FONT:
+		if (!PS__BUILT(PS_CMD_BIT(PS_CMD_SET_FONT)))
+			break;
+		PDF_ERRIF(!(   args->sz == 2
+		            && args->entries[0].type == PS_ARG_NAME
+		            && args->entries[1].type == PS_ARG_REAL),
+		          PS_ERR, "%s called with incorrect params\n",
+		          ps_cmd_name(cmd->type));
+		cmd->set_font.font = args->entries[0].val.start;
+		cmd->set_font.sz = strtof(args->entries[1].val.start, NULL);
+	break;
+	case PS_CMD_SHOW_TEXT_ARR:
+		if (!PS__BUILT(PS_CMD_BIT(PS_CMD_SHOW_TEXT_ARR)))
+			break;
+		return ps__assign_text_arr(ctx, cmd);
+	case PS_CMD_TEXT_MATRIX:
+	case PS_CMD_TRANSFORM:
+		if (!PS__BUILT(  PS_CMD_BIT(PS_CMD_TEXT_MATRIX)
+		                | PS_CMD_BIT(PS_CMD_TRANSFORM)))
+			break;
+		if (ps__real_args(args, cmd, 6, v))
+			return PS_ERR;
+		cmd->transform.a = v[0];
+		cmd->transform.b = v[1];
+		cmd->transform.c = v[2];
+		cmd->transform.d = v[3];
+		cmd->transform.e = v[4];
+		cmd->transform.f = v[5];
+	break;
+	case PS_CMD_BEGIN_TEXT:
+	case PS_CMD_CLIP:
+	case PS_CMD_CLIP_EVEN_ODD:
+	case PS_CMD_CLOSE_FILL_STROKE:
+	case PS_CMD_CLOSE_FILL_STROKE_EVEN_ODD:
+	case PS_CMD_CLOSE_PATH:
+	case PS_CMD_CLOSE_STROKE:
+	case PS_CMD_END_MARK:
+	case PS_CMD_END_PATH:
+	case PS_CMD_END_TEXT:
+	case PS_CMD_FILL:
+	case PS_CMD_FILL_EVEN_ODD:
+	case PS_CMD_FILL_STROKE:
+	case PS_CMD_FILL_STROKE_EVEN_ODD:
+	case PS_CMD_NEXT_LINE:
+	case PS_CMD_RESTORE_STATE:
+	case PS_CMD_SAVE_STATE:
+	case PS_CMD_STROKE:
+		PDF_ERRIF(!(args->sz == 0),
+		          PS_ERR, "%s called with params when none expected\n",
+		          ps_cmd_name(cmd->type));
+	break;
+	}
+	return PS_OK;
+}
+
+AMFDEF int ps_exec(struct ps_ctx *ctx, struct ps_cmd *cmd)
 {
-	struct jpeg_decompress_struct cinfo;
-	struct pdf__jpeg_error_mgr err_mgr;
-	unsigned char *buffer, *row, *rows[1];
-	int row_stride;
+	int ret = PS_META_CMD;
 
-	cinfo.err = jpeg_std_error(&err_mgr.pub);
-	err_mgr.pub.error_exit = pdf__jpeg_error_exit;
-	if (setjmp(err_mgr.setjmp_buffer)) {
-		jpeg_destroy_decompress(&cinfo);
-		PDF_ERR(1, "Failed to setup jpeg decode error handling");
+	if (ctx->args.sz) {
+		ps__restore_arg_ends(&ctx->args);
+		ps__clear_arg_arr(&ctx->args);
 	}
 
-	jpeg_create_decompress(&cinfo);
-	jpeg_mem_src(&cinfo, (unsigned char*)*stream, len);
-
-	jpeg_read_header(&cinfo, TRUE);
-	jpeg_start_decompress(&cinfo);
+	while (ret == PS_META_CMD) {
+		ret = ps__next_cmd(ctx, cmd);
+		/* unwanted commands are skipped with their operands unconverted */
+		if (ret == PS_OK && !(ctx->cmd_mask & PS_CMD_BIT(cmd->type)))
+			ret = PS_META_CMD;
+		if (ret == PS_META_CMD)
+			ps__clear_arg_arr(&ctx->args);
+	}
 
-	row_stride = cinfo.output_width * cinfo.output_components;
-	buffer = PDF_MALLOC(cinfo.output_height * row_stride);
-	row = buffer;
-	while (cinfo.output_scanline < cinfo.output_height) {
-		rows[0] = row;
-		jpeg_read_scanlines(&cinfo, rows, 1);
-		row += row_stride;
+	if (ret == PS_OK) {
+		ps__replace_arg_ends(&ctx->args);
+		ret = ps__assign_cmd_args(ctx, cmd);
+		if (ret == PS_ERR)
+			ps__restore_arg_ends(&ctx->args);
+	}
+	if (ret == PS_ERR || ret == PS_END) {
+		ps__free_arg_arr(&ctx->args);
+		PDF_FREE(ctx->text_elems);
+		ctx->text_elems = NULL;
+		ctx->text_elems_cap = 0;
 	}
 
-	jpeg_finish_decompress(&cinfo);
-	jpeg_destroy_decompress(&cinfo);
+	return ret;
+}
 
-	PDF_FREE(*stream);
-	*stream = (char*)buffer;
+/*
+ * Graphics state implementation
+ */
 
-	return 0;
+AMFDEF void ps_mat_mul(const float a[6], const float b[6], float out[6])
+{
+	float m[6];
+	m[0] = a[0]*b[0] + a[1]*b[2];
+	m[1] = a[0]*b[1] + a[1]*b[3];
+	m[2] = a[2]*b[0] + a[3]*b[2];
+	m[3] = a[2]*b[1] + a[3]*b[3];
+	m[4] = a[4]*b[0] + a[5]*b[2] + b[4];
+	m[5] = a[4]*b[1] + a[5]*b[3] + b[5];
+	memcpy(out, m, sizeof(m));
 }
-#endif
 
-static int pdf__decode_stream(enum pdf_stream_type *type, char **stream,
-                              int len, const char *decoder)
+/* src and dst are x,y pairs and may alias */
+AMFDEF void ps_transform_pts(const float m[6], const float *src,
+                             float *dst, size_t cnt)
 {
-	int ret = 1;
-	if (strcmp(decoder, "FlateDecode") == 0) {
-		*type = PDF_STREAM_CMD;
-#ifdef PDF_ZLIB
-		ret = pdf__zlib_inflate(stream, len);
-		if (ret != Z_OK)
-			PDF_LOG("zlib error (%d)\n", ret);
-		return ret;
-#endif
+	size_t i = 0;
+#if defined(PDF__SSE2)
+	const __m128 ab = _mm_setr_ps(m[0], m[1], m[0], m[1]);
+	const __m128 cd = _mm_setr_ps(m[2], m[3], m[2], m[3]);
+	const __m128 ef = _mm_setr_ps(m[4], m[5], m[4], m[5]);
+	for (; i + 4 <= cnt; i += 4) {
+		__m128 p0 = _mm_loadu_ps(src + 2*i);
+		__m128 p1 = _mm_loadu_ps(src + 2*i + 4);
+		__m128 x0 = _mm_shuffle_ps(p0, p0, _MM_SHUFFLE(2, 2, 0, 0));
+		__m128 y0 = _mm_shuffle_ps(p0, p0, _MM_SHUFFLE(3, 3, 1, 1));
+		__m128 x1 = _mm_shuffle_ps(p1, p1, _MM_SHUFFLE(2, 2, 0, 0));
+		__m128 y1 = _mm_shuffle_ps(p1, p1, _MM_SHUFFLE(3, 3, 1, 1));
+		p0 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x0, ab), _mm_mul_ps(y0, cd)), ef);
+		p1 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x1, ab), _mm_mul_ps(y1, cd)), ef);
+		_mm_storeu_ps(dst + 2*i, p0);
+		_mm_storeu_ps(dst + 2*i + 4, p1);
 	}
-	if (strcmp(decoder, "DCTDecode") == 0) {
-		*type = PDF_STREAM_JPEG;
-#ifdef PDF_JPEG
-		ret = pdf__jpeg_decode(stream, len);
-		if (ret != Z_OK)
-			PDF_LOG("jpeg error (%d)\n", ret);
-		return ret;
 #endif
+	for (; i < cnt; ++i) {
+		float x = src[2*i], y = src[2*i+1];
+		dst[2*i]   = m[0]*x + m[2]*y + m[4];
+		dst[2*i+1] = m[1]*x + m[3]*y + m[5];
 	}
-	PDF_LOG("Filter '%s' not supported\n", decoder);
-	return ret;
 }
 
-AMFDEF struct pdf_baseobj *pdf_get_baseobj(struct pdf *pdf, struct pdf_objid id)
+/* Path construction, painting and clipping, which build ps_path */
+#define PS__GS_PATH_MASK (  PS_CMD_BIT(PS_CMD_CLIP) \
+                          | PS_CMD_BIT(PS_CMD_CLIP_EVEN_ODD) \
+                          | PS_CMD_BIT(PS_CMD_CLOSE_FILL_STROKE) \
+                          | PS_CMD_BIT(PS_CMD_CLOSE_FILL_STROKE_EVEN_ODD) \
+                          | PS_CMD_BIT(PS_CMD_CLOSE_PATH) \
+                          | PS_CMD_BIT(PS_CMD_CLOSE_STROKE) \
+                          | PS_CMD_BIT(PS_CMD_CURVE_TO) \
+                          | PS_CMD_BIT(PS_CMD_CURVE_TO_V) \
+                          | PS_CMD_BIT(PS_CMD_CURVE_TO_Y) \
+                          | PS_CMD_BIT(PS_CMD_END_PATH) \
+                          | PS_CMD_BIT(PS_CMD_FILL) \
+                          | PS_CMD_BIT(PS_CMD_FILL_EVEN_ODD) \
+                          | PS_CMD_BIT(PS_CMD_FILL_STROKE) \
+                          | PS_CMD_BIT(PS_CMD_FILL_STROKE_EVEN_ODD) \
+                          | PS_CMD_BIT(PS_CMD_LINE_TO) \
+                          | PS_CMD_BIT(PS_CMD_MOVE_TO) \
+                          | PS_CMD_BIT(PS_CMD_RECTANGLE) \
+                          | PS_CMD_BIT(PS_CMD_STROKE))
+
+/* Commands consumed by the graphics state layer itself */
+#define PS__GS_STATE_MASK (  PS_CMD_BIT(PS_CMD_DASH) \
+                           | PS_CMD_BIT(PS_CMD_FILL_CMYK) \
+                           | PS_CMD_BIT(PS_CMD_FILL_COLOR) \
+                           | PS_CMD_BIT(PS_CMD_FILL_COLOR_SPACE) \
+                           | PS_CMD_BIT(PS_CMD_FILL_GRAY) \
+                           | PS_CMD_BIT(PS_CMD_FILL_RGB) \
+                           | PS_CMD_BIT(PS_CMD_LINE_WIDTH) \
+                           | PS_CMD_BIT(PS_CMD_RESTORE_STATE) \
+                           | PS_CMD_BIT(PS_CMD_SAVE_STATE) \
+                           | PS_CMD_BIT(PS_CMD_STROKE_CMYK) \
+                           | PS_CMD_BIT(PS_CMD_STROKE_COLOR) \
+                           | PS_CMD_BIT(PS_CMD_STROKE_COLOR_SPACE) \
+                           | PS_CMD_BIT(PS_CMD_STROKE_GRAY) \
+                           | PS_CMD_BIT(PS_CMD_STROKE_RGB) \
+                           | PS_CMD_BIT(PS_CMD_TRANSFORM) \
+                           | PS__GS_PATH_MASK)
+
+AMFDEF void ps_gs_init(struct ps_gs *gs, char *str, size_t sz,
+                       const float ctm[6], unsigned long long cmd_mask)
 {
-	struct pdf_xref *xref_entry = NULL;
-	for (size_t i = 0; i < pdf->xref_tbl_sz; ++i) {
-		if (   (pdf->xref_tbl+i)->id.num == id.num
-		    && (pdf->xref_tbl+i)->id.gen == id.gen) {
-			xref_entry = pdf->xref_tbl+i;
-			break;
-		}
-	}
-	PDF_ERRIF(!xref_entry, NULL, "No such object\n");
+	struct ps_segment seg = { str, sz };
+	ps_gs_init_chain(gs, &seg, 1, ctm, cmd_mask);
+}
 
-	if (!xref_entry->baseobj) {
-		struct pdf_objid local_id;
-		char *id_end;
-		if (fseek(pdf->ctx->fp, xref_entry->offset, SEEK_SET))
-			PDF_ERR(NULL, "failed to lookup base object\n");
-		pdf__readline(pdf->ctx);
-		if (pdf__parse_ushort_pair_ex(pdf->ctx->buf, &local_id.num,
-		                              &local_id.gen, &id_end))
-			PDF_ERR(NULL, "failed to parse base object header\n");
-		PDF_ERRIF(id.num != local_id.num || id.gen != local_id.gen, NULL,
-		          "base object id mismatch\n");
-		PDF_ERRIF(strncmp(id_end, " obj", 4), NULL,
-		          "invalid base object header\n");
-		xref_entry->baseobj = PDF_MALLOC(sizeof(struct pdf_baseobj));
-		if (pdf__parse_obj(pdf->ctx, &xref_entry->baseobj->obj)) {
-			free(xref_entry->baseobj);
-			PDF_ERR(NULL, "failed to parse base object properties\n");
-		}
-		pdf__consume_ws(pdf->ctx); // consume rest of line
-		pdf__readline(pdf->ctx);
-		if (strncmp(pdf->ctx->buf, "stream", 6) == 0) {
-			struct pdf_obj *obj = &xref_entry->baseobj->obj, *length, *filter;
-			fpos_t pos;
-
-			PDF_ERRIF(fgetpos(pdf->ctx->fp, &pos), NULL,
-			          "failed to save file pos when parsing stream\n");
-			PDF_ERRIF(obj->type != PDF_OBJ_DICT, NULL,
-			          "base object has stream but no properties\n");
-			length = pdf_dict_find_deref(pdf, &obj->dict, "Length");
-			PDF_ERRIF(!length, NULL, "base object has stream but no Length\n");
-			PDF_ERRIF(length->type != PDF_OBJ_INT, NULL,
-			          "base object Length is not an int\n");
-			xref_entry->baseobj->stream = PDF_MALLOC(length->intg.val+1);
-			xref_entry->baseobj->stream_type = PDF_STREAM_UNKNOWN;
-			/* pdf_dict_find_deref can move the stream position */
-			PDF_ERRIF(fsetpos(pdf->ctx->fp, &pos), NULL,
-			          "failed to restore file pos when parsing stream\n");
-			fread(xref_entry->baseobj->stream, 1, length->intg.val,
-			      pdf->ctx->fp);
-			xref_entry->baseobj->stream[length->intg.val] = '\0';
-
-			filter = pdf_dict_find(&obj->dict, "Filter");
-			if (filter) {
-				PDF_ERRIF(filter->type != PDF_OBJ_NAME, NULL,
-				          "stream filter is not a name\n");
-				if (pdf__decode_stream(&xref_entry->baseobj->stream_type,
-				                       &xref_entry->baseobj->stream,
-				                       length->intg.val, filter->name.val))
-					PDF_ERR(NULL, "Failed to decode stream\n");
-			}
-			else
-				xref_entry->baseobj->stream_type = PDF_STREAM_CMD;
+AMFDEF void ps_gs_init_chain(struct ps_gs *gs, const struct ps_segment *segs,
+                             size_t cnt, const float ctm[6],
+                             unsigned long long cmd_mask)
+{
+	static const float identity[6] = { 1, 0, 0, 1, 0, 0 };
+	struct ps_gstate *state = gs->stack;
+
+	ps_init_chain(&gs->ctx, segs, cnt, cmd_mask | PS__GS_STATE_MASK);
+	gs->cmd_mask = cmd_mask;
+	gs->depth = 0;
+	memcpy(state->ctm, ctm ? ctm : identity, sizeof(state->ctm));
+	state->line_width = 1;
+	state->fill.val[0] = 0;
+	state->fill.sz = 1;
+	state->stroke = state->fill;
+	state->dash[0] = -1;
+	state->dash_phase = 0;
+	gs->verbs = NULL;
+	gs->verb_cnt = gs->verb_cap = 0;
+	gs->pts = NULL;
+	gs->pt_cnt = gs->pt_cap = 0;
+	gs->cur[0] = gs->cur[1] = gs->start[0] = gs->start[1] = 0;
+	gs->clip = -1;
+}
 
-			pdf__readline(pdf->ctx); // consume rest of line
-			pdf__readline(pdf->ctx);
-			PDF_ERRIF(strncmp(pdf->ctx->buf, "endstream", 9), NULL,
-			          "missing endstream token (%s)\n", pdf->ctx->buf);
-			pdf__readline(pdf->ctx);
-		} else {
-			xref_entry->baseobj->stream = NULL;
-			xref_entry->baseobj->stream_type = PDF_STREAM_UNKNOWN;
-		}
-		PDF_ERRIF(strncmp(pdf->ctx->buf, "endobj", 6), NULL,
-		          "missing endobj token\n");
+AMFDEF void ps_gs_free(struct ps_gs *gs)
+{
+	ps__free_arg_arr(&gs->ctx.args);
+	PDF_FREE(gs->ctx.text_elems);
+	gs->ctx.text_elems = NULL;
+	gs->ctx.text_elems_cap = 0;
+	PDF_FREE(gs->verbs);
+	PDF_FREE(gs->pts);
+	gs->verbs = NULL;
+	gs->pts = NULL;
+	gs->verb_cap = gs->pt_cap = 0;
+}
+
+static void ps__gs_add(struct ps_gs *gs, enum ps_path_verb verb,
+                       const float *pts, size_t cnt)
+{
+	if (gs->verb_cnt == gs->verb_cap) {
+		gs->verb_cap = gs->verb_cap ? 2*gs->verb_cap : 64;
+		gs->verbs = PDF_REALLOC(gs->verbs, gs->verb_cap);
 	}
-	return xref_entry->baseobj;
+	gs->verbs[gs->verb_cnt++] = verb;
+	if (!cnt)
+		return;
+	if (gs->pt_cnt + cnt > gs->pt_cap) {
+		gs->pt_cap = gs->pt_cap ? 2*gs->pt_cap : 64;
+		gs->pts = PDF_REALLOC(gs->pts, 2*gs->pt_cap*sizeof(float));
+	}
+	memcpy(gs->pts + 2*gs->pt_cnt, pts, 2*cnt*sizeof(float));
+	gs->pt_cnt += cnt;
+	gs->cur[0] = pts[2*cnt-2];
+	gs->cur[1] = pts[2*cnt-1];
 }
 
-static struct pdf_obj *pdf__pages(struct pdf *pdf)
+static void ps__gs_set_color_space(struct ps_color *color, const char *name)
 {
-	struct pdf_baseobj *catalog, *pages;
-	struct pdf_obj *pages_ref;
+	color->val[0] = color->val[1] = color->val[2] = 0;
+	color->val[3] = 1;
+	if (strcmp(name, "DeviceRGB") == 0)
+		color->sz = 3;
+	else if (strcmp(name, "DeviceCMYK") == 0)
+		color->sz = 4;
+	else
+		color->sz = 1;
+}
 
-	catalog = pdf_get_baseobj(pdf, pdf->root);
-	PDF_ERRIF(!catalog, NULL, "failed to retrive Catalog object\n");
-	PDF_ERRIF(catalog->obj.type != PDF_OBJ_DICT, NULL,
-	          "Catalog object is not a dict\n");
-	pages_ref = pdf_dict_find(&catalog->obj.dict, "Pages");
-	PDF_ERRIF(!pages_ref, NULL, "Catalog dict has no Pages property\n");
-	PDF_ERRIF(pages_ref->type != PDF_OBJ_REF, NULL,
-	          "Catalog Pages not a ref\n");
-	pages = pdf_get_baseobj(pdf, pages_ref->ref.id);
-	PDF_ERRIF(!pages, NULL, "failed to retrive Pages object\n");
-	PDF_ERRIF(pages->obj.type != PDF_OBJ_DICT, NULL,
-	          "Pages object is not a dict\n");
-	return &pages->obj;
+/* Returns PS_PATH if cmd painted the path, PS_META_CMD if it was consumed */
+static int ps__gs_apply(struct ps_gs *gs, struct ps_cmd *cmd,
+                        struct ps_path *path)
+{
+	struct ps_gstate *state = gs->stack + gs->depth;
+	float pts[8];
+
+	switch (cmd->type) {
+	case PS_CMD_SAVE_STATE:
+		PDF_ERRIF(gs->depth + 1 == PS_GSTATE_DEPTH, PS_ERR,
+		          "graphics state stack overflow\n");
+		gs->stack[gs->depth+1] = *state;
+		++gs->depth;
+	break;
+	case PS_CMD_RESTORE_STATE:
+		/* unbalanced restores are ignored, as viewers do */
+		if (gs->depth)
+			--gs->depth;
+	break;
+	case PS_CMD_TRANSFORM:
+		pts[0] = cmd->transform.a;
+		pts[1] = cmd->transform.b;
+		pts[2] = cmd->transform.c;
+		pts[3] = cmd->transform.d;
+		pts[4] = cmd->transform.e;
+		pts[5] = cmd->transform.f;
+		ps_mat_mul(pts, state->ctm, state->ctm);
+	break;
+	case PS_CMD_LINE_WIDTH:
+		state->line_width = cmd->line_width.val;
+	break;
+	case PS_CMD_DASH:
+		memcpy(state->dash, cmd->dash.arr, sizeof(state->dash));
+		state->dash_phase = cmd->dash.phase;
+	break;
+	case PS_CMD_FILL_COLOR_SPACE:
+		ps__gs_set_color_space(&state->fill, cmd->name.val);
+	break;
+	case PS_CMD_STROKE_COLOR_SPACE:
+		ps__gs_set_color_space(&state->stroke, cmd->name.val);
+	break;
+	case PS_CMD_FILL_GRAY:
+	case PS_CMD_STROKE_GRAY: {
+		struct ps_color *color =   cmd->type == PS_CMD_FILL_GRAY
+		                         ? &state->fill : &state->stroke;
+		color->val[0] = cmd->gray.val;
+		color->sz = 1;
+	} break;
+	case PS_CMD_FILL_RGB:
+	case PS_CMD_STROKE_RGB: {
+		struct ps_color *color =   cmd->type == PS_CMD_FILL_RGB
+		                         ? &state->fill : &state->stroke;
+		color->val[0] = cmd->rgb.r;
+		color->val[1] = cmd->rgb.g;
+		color->val[2] = cmd->rgb.b;
+		color->sz = 3;
+	} break;
+	case PS_CMD_FILL_CMYK:
+	case PS_CMD_STROKE_CMYK: {
+		struct ps_color *color =   cmd->type == PS_CMD_FILL_CMYK
+		                         ? &state->fill : &state->stroke;
+		color->val[0] = cmd->cmyk.c;
+		color->val[1] = cmd->cmyk.m;
+		color->val[2] = cmd->cmyk.y;
+		color->val[3] = cmd->cmyk.k;
+		color->sz = 4;
+	} break;
+	case PS_CMD_FILL_COLOR:
+	case PS_CMD_STROKE_COLOR: {
+		struct ps_color *color =   cmd->type == PS_CMD_FILL_COLOR
+		                         ? &state->fill : &state->stroke;
+		memcpy(color->val, cmd->color.val, sizeof(color->val));
+		color->sz = cmd->color.sz;
+	} break;
+	case PS_CMD_MOVE_TO:
+		pts[0] = cmd->pos.x;
+		pts[1] = cmd->pos.y;
+		ps__gs_add(gs, PS_PATH_MOVE_TO, pts, 1);
+		gs->start[0] = pts[0];
+		gs->start[1] = pts[1];
+	break;
+	case PS_CMD_LINE_TO:
+		pts[0] = cmd->pos.x;
+		pts[1] = cmd->pos.y;
+		ps__gs_add(gs, PS_PATH_LINE_TO, pts, 1);
+	break;
+	case PS_CMD_CURVE_TO:
+	case PS_CMD_CURVE_TO_V:
+	case PS_CMD_CURVE_TO_Y:
+		pts[0] = cmd->type == PS_CMD_CURVE_TO_V ? gs->cur[0] : cmd->curve.x1;
+		pts[1] = cmd->type == PS_CMD_CURVE_TO_V ? gs->cur[1] : cmd->curve.y1;
+		pts[2] = cmd->type == PS_CMD_CURVE_TO_Y ? cmd->curve.x3 : cmd->curve.x2;
+		pts[3] = cmd->type == PS_CMD_CURVE_TO_Y ? cmd->curve.y3 : cmd->curve.y2;
+		pts[4] = cmd->curve.x3;
+		pts[5] = cmd->curve.y3;
+		ps__gs_add(gs, PS_PATH_CURVE_TO, pts, 3);
+	break;
+	case PS_CMD_RECTANGLE:
+		pts[0] = cmd->rectangle.x;
+		pts[1] = cmd->rectangle.y;
+		ps__gs_add(gs, PS_PATH_MOVE_TO, pts, 1);
+		pts[0] += cmd->rectangle.width;
+		pts[2] = pts[0];
+		pts[3] = pts[1] + cmd->rectangle.height;
+		pts[4] = cmd->rectangle.x;
+		pts[5] = pts[3];
+		ps__gs_add(gs, PS_PATH_LINE_TO, pts, 1);
+		ps__gs_add(gs, PS_PATH_LINE_TO, pts+2, 1);
+		ps__gs_add(gs, PS_PATH_LINE_TO, pts+4, 1);
+		ps__gs_add(gs, PS_PATH_CLOSE, NULL, 0);
+		gs->cur[0] = gs->start[0] = cmd->rectangle.x;
+		gs->cur[1] = gs->start[1] = cmd->rectangle.y;
+	break;
+	case PS_CMD_CLOSE_PATH:
+		ps__gs_add(gs, PS_PATH_CLOSE, NULL, 0);
+		gs->cur[0] = gs->start[0];
+		gs->cur[1] = gs->start[1];
+	break;
+	case PS_CMD_CLIP:
+	case PS_CMD_CLIP_EVEN_ODD:
+		gs->clip = cmd->type;
+	break;
+	case PS_CMD_CLOSE_FILL_STROKE:
+	case PS_CMD_CLOSE_FILL_STROKE_EVEN_ODD:
+	case PS_CMD_CLOSE_STROKE:
+		ps__gs_add(gs, PS_PATH_CLOSE, NULL, 0);
+		/* fall through */
+	case PS_CMD_END_PATH:
+	case PS_CMD_FILL:
+	case PS_CMD_FILL_EVEN_ODD:
+	case PS_CMD_FILL_STROKE:
+	case PS_CMD_FILL_STROKE_EVEN_ODD:
+	case PS_CMD_STROKE:
+		/* transform the whole path in one batch */
+		ps_transform_pts(state->ctm, gs->pts, gs->pts, gs->pt_cnt);
+		path->verbs = gs->verbs;
+		path->verb_cnt = gs->verb_cnt;
+		path->pts = gs->pts;
+		path->pt_cnt = gs->pt_cnt;
+		path->paint = cmd->type;
+		path->clip = gs->clip;
+		gs->verb_cnt = 0;
+		gs->pt_cnt = 0;
+		gs->clip = -1;
+		return PS_PATH;
+	default:
+		return PS_OK;
+	}
+	return PS_META_CMD;
 }
 
-AMFDEF int pdf_page_cnt(struct pdf *pdf)
+AMFDEF int ps_gs_exec(struct ps_gs *gs, struct ps_cmd *cmd,
+                      struct ps_path *path)
 {
-	struct pdf_obj *pages, *count;
+	int ret;
+	while ((ret = ps_exec(&gs->ctx, cmd)) == PS_OK) {
+		ret = ps__gs_apply(gs, cmd, path);
+		if (ret == PS_META_CMD)
+			continue;
+		if (ret == PS_OK && !(gs->cmd_mask & PS_CMD_BIT(cmd->type)))
+			continue;
+		break;
+	}
+	return ret;
+}
 
-	pages = pdf__pages(pdf);
-	PDF_ERRIF(!pages, -1, "failed to retrive Pages object\n");
-	count = pdf_dict_find(&pages->dict, "Count");
-	PDF_ERRIF(!count, -1, "Pages dict has no Count property\n");
-	PDF_ERRIF(count->type != PDF_OBJ_INT, -1, "Pages Count not an int\n");
-	return count->intg.val;
+/*
+ * Page triage implementation
+ *
+ * Rather than interpret the content with ps_exec, this scans it directly:
+ * operands are only tracked as the last few numbers and name, strings and
+ * inline image data are skipped with memchr, and only the operators that
+ * affect extents or flags are looked at.
+ */
+
+struct pdf__triage_state
+{
+	float ctm[PS_GSTATE_DEPTH][6];
+	int depth;
+	float nums[6];
+	int num_cnt;
+	const char *name;
+	size_t name_len;
+	float path[4];
+	struct pdf_triage *out;
+};
+
+static void pdf__bbox_reset(float bbox[4])
+{
+	bbox[0] = bbox[1] = FLT_MAX;
+	bbox[2] = bbox[3] = -FLT_MAX;
 }
 
-AMFDEF struct pdf_obj *pdf_get_page(struct pdf *pdf, int page_idx)
+static void pdf__bbox_add(float bbox[4], const float *pts, size_t cnt)
 {
-	struct pdf_obj *pages, *kids, *page_ref;
-	struct pdf_baseobj *page;
+	for (size_t i = 0; i < cnt; ++i) {
+		if (pts[2*i] < bbox[0])
+			bbox[0] = pts[2*i];
+		if (pts[2*i+1] < bbox[1])
+			bbox[1] = pts[2*i+1];
+		if (pts[2*i] > bbox[2])
+			bbox[2] = pts[2*i];
+		if (pts[2*i+1] > bbox[3])
+			bbox[3] = pts[2*i+1];
+	}
+}
 
-	pages = pdf__pages(pdf);
-	PDF_ERRIF(!pages, NULL, "failed to retrive Pages object\n");
-	kids = pdf_dict_find(&pages->dict, "Kids");
-	PDF_ERRIF(!kids, NULL, "failed to retrieve Pages Kids\n");
-	PDF_ERRIF(kids->type != PDF_OBJ_ARR, NULL,
-	          "Pages Kids is not an array\n");
-	PDF_ERRIF(page_idx < 0 || page_idx >= kids->arr.sz, NULL,
-	          "Invalid page num\n");
-	page_ref = kids->arr.entries+page_idx;
-	PDF_ERRIF(page_ref->type != PDF_OBJ_REF, NULL,
-	          "Pages Kids element is not a reference\n");
-	page = pdf_get_baseobj(pdf, page_ref->ref.id);
-	PDF_ERRIF(!page, NULL, "failed to get Page %i baseobj\n", page_idx);
-	return &page->obj;
+/* Adds the corners of a bbox under the given transform */
+static void pdf__bbox_add_xformed(float bbox[4], const float m[6],
+                                  const float src[4])
+{
+	float pts[8] = {
+		src[0], src[1], src[2], src[1], src[2], src[3], src[0], src[3]
+	};
+	ps_transform_pts(m, pts, pts, 4);
+	pdf__bbox_add(bbox, pts, 4);
 }
 
-AMFDEF int pdf_get_page_bounds(struct pdf *pdf, int page_idx, int bounds[4])
+static void pdf__triage_path(struct pdf__triage_state *st, int first,
+                             int cnt)
 {
-	struct pdf_obj *page, *box;
-	page = pdf_get_page(pdf, page_idx);
-	PDF_ERRIF(!page, 1, "failed to get Page %i\n", page_idx);
-	box = pdf_dict_find(&page->dict, "MediaBox");
-	if (!box) {
-		struct pdf_obj *parent_ref;
-		struct pdf_baseobj *pages;
-		parent_ref = pdf_dict_find(&page->dict, "Parent");
-		PDF_ERRIF(!parent_ref, 1, "Page %i missing Parent\n", page_idx);
-		PDF_ERRIF(parent_ref->type != PDF_OBJ_REF, 1,
-		          "Page %i Parent is not a reference\n", page_idx);
-		pages = pdf_get_baseobj(pdf, parent_ref->ref.id);
-		PDF_ERRIF(!pages, 1, "failed to locate Pages baseobj\n");
-		PDF_ERRIF(pages->obj.type != PDF_OBJ_DICT, 1,
-		          "Pages baseobj obj is not a dict\n");
-		box = pdf_dict_find(&pages->obj.dict, "MediaBox");
-		PDF_ERRIF(!box, 1, "No MediaBox in Pages or Page %i\n", page_idx);
+	float pts[6];
+	if (first < 0)
+		return;
+	memcpy(pts, st->nums + first, 2*cnt*sizeof(float));
+	ps_transform_pts(st->ctm[st->depth], pts, pts, cnt);
+	pdf__bbox_add(st->path, pts, cnt);
+}
+
+static const char *pdf__triage_num(const char *p, const char *end,
+                                   float *val)
+{
+	float v = 0, scale = 1;
+	int neg = 0, frac = 0;
+	if (*p == '-' || *p == '+')
+		neg = *p++ == '-';
+	for (; p < end; ++p) {
+		if (*p >= '0' && *p <= '9') {
+			v = 10*v + (*p - '0');
+			if (frac)
+				scale *= 10;
+		} else if (*p == '.' && !frac)
+			frac = 1;
+		else
+			break;
 	}
-	PDF_ERRIF(box->type != PDF_OBJ_ARR, 1, "MediaBox is not an array\n");
-	PDF_ERRIF(box->arr.sz != 4, 1, "MediaBox does not have 4 elements\n");
-	for (size_t i = 0; i < box->arr.sz; ++i) {
-		struct pdf_obj *dim = box->arr.entries+i;
-		PDF_ERRIF(dim->type != PDF_OBJ_INT, 1,
-		          "MediaBox[%lu] is not an int\n", i);
-		bounds[i] = dim->intg.val;
+	*val = (neg ? -v : v) / scale;
+	return p;
+}
+
+static const char *pdf__triage_skip_str(const char *p, const char *end)
+{
+	int depth = 1;
+	for (; p < end; ++p) {
+		if (*p == '\\')
+			++p;
+		else if (*p == '(')
+			++depth;
+		else if (*p == ')' && --depth == 0)
+			return p + 1;
 	}
-	return 0;
+	return end;
 }
 
-AMFDEF struct pdf_obj* pdf_dict_find(struct pdf_obj_dict *dict,
-                                     const char *name)
+static const char *pdf__triage_skip_inline_image(const char *p,
+                                                 const char *end)
 {
-	for (size_t i = 0; i < dict->sz; ++i)
-		if (strcmp((dict->entries+i)->name, name) == 0)
-			return &(dict->entries+i)->obj;
-	return NULL;
+	const char *id = p;
+	/* ID cannot appear in the image dict, so find it first */
+	while ((id = memchr(id, 'I', end - id)) && id + 1 < end) {
+		if (   id[1] == 'D' && id > p && ps__is_ws(id[-1])
+		    && id + 2 < end && ps__is_ws(id[2]))
+			break;
+		++id;
+	}
+	if (!id || id + 3 >= end)
+		return end;
+	p = id + 3;
+	while ((p = memchr(p, 'E', end - p)) && p + 1 < end) {
+		if (   p[1] == 'I' && ps__is_ws(p[-1])
+		    && (p + 2 == end || ps__is_ws(p[2]) || pdf__is_delim(p[2])))
+			return p + 2;
+		++p;
+	}
+	return end;
 }
 
-AMFDEF struct pdf_obj *pdf_dict_find_deref(struct pdf *pdf,
-                                           struct pdf_obj_dict *dict,
-                                           const char *name)
+static int pdf__triage_form(struct pdf *pdf, struct pdf_objid id,
+                            struct pdf_baseobj *form,
+                            struct pdf_resources *resources,
+                            struct pdf_triage *triage);
+
+static void pdf__triage_do(struct pdf *pdf, struct pdf__triage_state *st,
+                           struct pdf_resources *resources)
 {
-	struct pdf_baseobj *baseobj;
-	struct pdf_obj *obj = pdf_dict_find(dict, name);
-	if (!obj)
-		return NULL;
-	if (obj->type != PDF_OBJ_REF)
-		return obj;
-	baseobj = pdf_get_baseobj(pdf, obj->ref.id);
-	if (!baseobj)
-		return NULL;
-	return baseobj->obj.type != PDF_OBJ_REF ? &baseobj->obj : NULL;
+	static const float unit[4] = { 0, 0, 1, 1 };
+	struct pdf_res_entry *xobj;
+	struct pdf_obj *subtype;
+	struct pdf_triage form;
+	char name[128];
+
+	if (!st->name || st->name_len >= sizeof(name))
+		return;
+	memcpy(name, st->name, st->name_len);
+	name[st->name_len] = '\0';
+	xobj = pdf_res_find(resources, PDF_RES_XOBJECT, name);
+	if (!xobj || !xobj->baseobj || xobj->obj->type != PDF_OBJ_DICT)
+		return;
+	subtype = pdf_dict_find(&xobj->obj->dict, "Subtype");
+	if (!subtype || subtype->type != PDF_OBJ_NAME)
+		return;
+	if (pdf_name_eq(&subtype->name, "Image")) {
+		st->out->flags |= PDF_TRIAGE_IMAGE;
+		pdf__bbox_add_xformed(st->out->bbox, st->ctm[st->depth], unit);
+	} else if (   pdf_name_eq(&subtype->name, "Form")
+	           && PDF_OK(pdf__triage_form(pdf, xobj->id, xobj->baseobj,
+	                                      resources, &form))) {
+		st->out->flags |= form.flags;
+		/* a form that draws nothing leaves its bbox inverted */
+		if (form.bbox[0] <= form.bbox[2])
+			pdf__bbox_add_xformed(st->out->bbox, st->ctm[st->depth],
+			                      form.bbox);
+	}
 }
 
-static void pdf__free_obj(struct pdf_obj *obj)
+static void pdf__triage_op(struct pdf *pdf, struct pdf__triage_state *st,
+                           struct pdf_resources *resources,
+                           const char *op, size_t len)
 {
-	switch (obj->type) {
-	case PDF_OBJ_ARR:
-		for (size_t i = 0; i < obj->arr.sz; ++i)
-			pdf__free_obj(obj->arr.entries+i);
-		PDF_FREE(obj->arr.entries);
+	float *m;
+	int n = st->num_cnt;
+	if (len > 3)
+		return;
+	switch (PS__OP(op[0], len > 1 ? op[1] : 0, len > 2 ? op[2] : 0)) {
+	case PS__OP('q', 0, 0):
+		if (st->depth + 1 < PS_GSTATE_DEPTH) {
+			memcpy(st->ctm[st->depth+1], st->ctm[st->depth],
+			       sizeof(st->ctm[0]));
+			++st->depth;
+		}
 	break;
-	case PDF_OBJ_DICT:
-		pdf__free_dict(&obj->dict);
+	case PS__OP('Q', 0, 0):
+		if (st->depth)
+			--st->depth;
 	break;
-	case PDF_OBJ_HEX:
-		PDF_FREE(obj->hex.val);
+	case PS__OP('c', 'm', 0):
+		if (n == 6)
+			ps_mat_mul(st->nums, st->ctm[st->depth], st->ctm[st->depth]);
 	break;
-	case PDF_OBJ_INT:
+	case PS__OP('m', 0, 0):
+	case PS__OP('l', 0, 0):
+		pdf__triage_path(st, n - 2, 1);
 	break;
-	case PDF_OBJ_NAME:
-		PDF_FREE(obj->name.val);
+	case PS__OP('c', 0, 0):
+		pdf__triage_path(st, n - 6, 3);
 	break;
-	case PDF_OBJ_REF:
+	case PS__OP('v', 0, 0):
+	case PS__OP('y', 0, 0):
+		pdf__triage_path(st, n - 4, 2);
 	break;
-	case PDF_OBJ_STR:
-		PDF_FREE(obj->str.val);
+	case PS__OP('r', 'e', 0):
+		if (n >= 4) {
+			m = st->nums + n - 4;
+			/* a negative width or height extends left or down */
+			if (m[2] < 0) {
+				m[0] += m[2];
+				m[2] = -m[2];
+			}
+			if (m[3] < 0) {
+				m[1] += m[3];
+				m[3] = -m[3];
+			}
+			m[2] += m[0];
+			m[3] += m[1];
+			pdf__bbox_add_xformed(st->path, st->ctm[st->depth], m);
+		}
+	break;
+	case PS__OP('f', 0, 0):
+	case PS__OP('F', 0, 0):
+	case PS__OP('f', '*', 0):
+	case PS__OP('S', 0, 0):
+	case PS__OP('s', 0, 0):
+	case PS__OP('B', 0, 0):
+	case PS__OP('B', '*', 0):
+	case PS__OP('b', 0, 0):
+	case PS__OP('b', '*', 0):
+		if (st->path[0] <= st->path[2]) {
+			st->out->flags |= PDF_TRIAGE_VECTOR;
+			pdf__bbox_add(st->out->bbox, st->path, 1);
+			pdf__bbox_add(st->out->bbox, st->path + 2, 1);
+		}
+		pdf__bbox_reset(st->path);
+	break;
+	case PS__OP('n', 0, 0):
+		pdf__bbox_reset(st->path);
+	break;
+	case PS__OP('s', 'h', 0):
+		st->out->flags |= PDF_TRIAGE_VECTOR;
+	break;
+	case PS__OP('T', 'j', 0):
+	case PS__OP('T', 'J', 0):
+	case PS__OP('\'', 0, 0):
+	case PS__OP('"', 0, 0):
+		st->out->flags |= PDF_TRIAGE_TEXT;
+	break;
+	case PS__OP('D', 'o', 0):
+		pdf__triage_do(pdf, st, resources);
 	break;
 	}
 }
 
-AMFDEF void pdf_free(struct pdf *pdf)
+static void pdf__triage_scan(struct pdf *pdf, struct pdf__triage_state *st,
+                             struct pdf_resources *resources,
+                             const char *p, const char *end)
 {
-	fclose(pdf->ctx->fp);
-	PDF_FREE(pdf->ctx);
-	if (pdf->xref_tbl) {
-		for (size_t i = 0; i < pdf->xref_tbl_sz; ++i) {
-			struct pdf_xref *xref = pdf->xref_tbl + i;
-			if (xref->baseobj) {
-				pdf__free_obj(&xref->baseobj->obj);
-				PDF_FREE(xref->baseobj->stream);
-				PDF_FREE(xref->baseobj);
+	static const float unit[4] = { 0, 0, 1, 1 };
+	const char *start;
+	while (p < end) {
+		switch (*p) {
+		case ' ': case '\n': case '\r': case '\t': case '\f': case '\0':
+			++p;
+		break;
+		case '-': case '+': case '.':
+		case '0': case '1': case '2': case '3': case '4':
+		case '5': case '6': case '7': case '8': case '9':
+			if (st->num_cnt == 6) {
+				memmove(st->nums, st->nums + 1, 5*sizeof(float));
+				--st->num_cnt;
 			}
+			p = pdf__triage_num(p, end, st->nums + st->num_cnt++);
+		break;
+		case '/':
+			start = ++p;
+			while (p < end && !ps__is_ws(*p) && !pdf__is_delim(*p))
+				++p;
+			st->name = start;
+			st->name_len = p - start;
+		break;
+		case '(':
+			p = pdf__triage_skip_str(p + 1, end);
+		break;
+		case '<':
+			if (p + 1 < end && p[1] == '<')
+				p += 2;
+			else if (!(p = memchr(p, '>', end - p)))
+				p = end;
+			else
+				++p;
+		break;
+		case '%':
+			while (p < end && *p != '\n' && *p != '\r')
+				++p;
+		break;
+		case '[': case ']': case '>': case '{': case '}': case ')':
+			st->num_cnt = 0;
+			++p;
+		break;
+		default:
+			start = p;
+			while (p < end && !ps__is_ws(*p) && !pdf__is_delim(*p))
+				++p;
+			if (p - start == 2 && start[0] == 'B' && start[1] == 'I') {
+				st->out->flags |= PDF_TRIAGE_IMAGE;
+				pdf__bbox_add_xformed(st->out->bbox, st->ctm[st->depth],
+				                      unit);
+				p = pdf__triage_skip_inline_image(p, end);
+			} else
+				pdf__triage_op(pdf, st, resources, start, p - start);
+			st->num_cnt = 0;
+			st->name = NULL;
+		break;
 		}
-		PDF_FREE(pdf->xref_tbl);
-	}
-}
-
-/*
- * Postscript parser implementation
- */
-
-AMFDEF const char *ps_cmd_name(enum ps_cmd_type type)
-{
-	switch (type) {
-	case PS_CMD_DASH:          return "Dash";
-	case PS_CMD_FILL:          return "Fill";
-	case PS_CMD_FILL_CMYK:     return "Fill cmyk";
-	case PS_CMD_FILL_GRAY:     return "Fill gray";
-	case PS_CMD_LINE_TO:       return "Line to";
-	case PS_CMD_LINE_WIDTH:    return "Line width";
-	case PS_CMD_MOVE_TEXT:     return "Move text";
-	case PS_CMD_MOVE_TO:       return "Move to";
-	case PS_CMD_OBJ:           return "Object";
-	case PS_CMD_RECTANGLE:     return "Rectangle";
-	case PS_CMD_RESTORE_STATE: return "Restore state";
-	case PS_CMD_SAVE_STATE:    return "Save state";
-	case PS_CMD_SET_FONT:      return "Set font";
-	case PS_CMD_SHOW_TEXT:     return "Show text";
-	case PS_CMD_STROKE:        return "Stroke";
-	case PS_CMD_STROKE_CMYK:   return "Stroke cmyk";
-	case PS_CMD_STROKE_GRAY:   return "Stroke gray";
-	case PS_CMD_TRANSFORM:     return "Transform";
-	}
-	assert(0);
-	return "";
+	}
 }
 
-static int ps__next_base_cmd(struct ps_ctx *ctx, struct ps_cmd *cmd);
-
-AMFDEF void ps_init(struct ps_ctx *ctx, char *str)
+static void pdf__triage_init(struct pdf__triage_state *st,
+                             const float ctm[6], struct pdf_triage *out)
 {
-	ctx->stream = str;
-	ctx->args.sz = 0;
-	ctx->args.entries = NULL;
-	ctx->args.parent = NULL;
-	ctx->next_cmd = ps__next_base_cmd;
+	static const float identity[6] = { 1, 0, 0, 1, 0, 0 };
+	memcpy(st->ctm[0], ctm ? ctm : identity, sizeof(st->ctm[0]));
+	st->depth = 0;
+	st->num_cnt = 0;
+	st->name = NULL;
+	pdf__bbox_reset(st->path);
+	pdf__bbox_reset(out->bbox);
+	out->flags = 0;
+	st->out = out;
 }
 
-enum ps__argtype
-{
-	PS_ARG_ARR,
-	PS_ARG_NAME,
-	PS_ARG_REAL,
-	PS_ARG_STR,
-};
-
-struct ps__arg_scalar
+/* Extents of a form are memoized in the space its Do is executed in */
+static int pdf__triage_form(struct pdf *pdf, struct pdf_objid id,
+                            struct pdf_baseobj *form,
+                            struct pdf_resources *resources,
+                            struct pdf_triage *triage)
 {
-	char *start, *end, replacement;
-};
+	struct pdf__ctx *ctx = pdf->ctx;
+	struct pdf__triage_state *st;
+	struct pdf__triage_memo *memo;
+	struct pdf_obj *matrix;
+	float m[6] = { 1, 0, 0, 1, 0, 0 };
+	double val;
+	size_t idx;
+
+	for (size_t i = 0; i < ctx->triage_memo_sz; ++i) {
+		memo = ctx->triage_memo + i;
+		if (memo->id.num == id.num && memo->id.gen == id.gen) {
+			PDF_ERRIF(memo->busy, 1, "recursive form XObject\n");
+			*triage = memo->triage;
+			return 0;
+		}
+	}
+	form = pdf_get_baseobj(pdf, id);
+	PDF_ERRIF(!form || !form->stream, 1, "form XObject has no stream\n");
+
+	matrix = pdf_dict_find(&form->obj.dict, "Matrix");
+	if (matrix && matrix->type == PDF_OBJ_ARR && matrix->arr.sz == 6)
+		for (int i = 0; i < 6; ++i)
+			if (!pdf__obj_num(matrix->arr.entries+i, &val))
+				m[i] = val;
+	resources = pdf_get_form_resources(pdf, form, resources);
+
+	idx = ctx->triage_memo_sz++;
+	ctx->triage_memo = PDF_REALLOC(ctx->triage_memo,
+	                               ctx->triage_memo_sz*sizeof(*memo));
+	ctx->triage_memo[idx].id = id;
+	ctx->triage_memo[idx].busy = 1;
+
+	st = PDF_MALLOC(sizeof(*st));
+	pdf__triage_init(st, m, triage);
+	pdf__triage_scan(pdf, st, resources, form->stream,
+	                 form->stream + form->stream_sz);
+	PDF_FREE(st);
+
+	/* the memo table may have moved while scanning nested forms */
+	ctx->triage_memo[idx].busy = 0;
+	ctx->triage_memo[idx].triage = *triage;
+	return 0;
+}
 
-struct ps__arg
+AMFDEF int pdf_page_triage(struct pdf *pdf, int page_idx,
+                           struct pdf_triage *triage)
 {
-	enum ps__argtype type;
-	union
-	{
-		struct ps__arg_arr arr;
-		struct ps__arg_scalar val;
-	};
-};
+	struct pdf_obj *page, *contents;
+	struct pdf_resources *resources;
+	struct pdf__triage_state *st;
+	size_t cnt;
 
-static void ps__consume_ws(char **stream)
-{
-	while (isspace(**stream) && **stream != '\0')
-		++*stream;
-}
+	page = pdf_get_page(pdf, page_idx);
+	PDF_ERRIF(!page, 1, "failed to get Page %i\n", page_idx);
+	resources = pdf_get_page_resources(pdf, page_idx);
+
+	contents = pdf_dict_find(&page->dict, "Contents");
+	st = PDF_MALLOC(sizeof(*st));
+	pdf__triage_init(st, NULL, triage);
+	cnt = !contents ? 0 : contents->type == PDF_OBJ_ARR ? contents->arr.sz : 1;
+	for (size_t i = 0; i < cnt; ++i) {
+		struct pdf_obj *ref =   contents->type == PDF_OBJ_ARR
+		                      ? contents->arr.entries + i : contents;
+		struct pdf_baseobj *stream;
+		if (ref->type != PDF_OBJ_REF)
+			continue;
+		stream = pdf_get_baseobj(pdf, ref->ref.id);
+		if (stream && stream->stream)
+			pdf__triage_scan(pdf, st, resources, stream->stream,
+			                 stream->stream + stream->stream_sz);
+	}
+	PDF_FREE(st);
 
-static void ps__consume_name(char **stream)
-{
-	while (   !isspace(**stream)
-	       && !pdf__is_delim(**stream)
-	       && **stream != '\0')
-		++*stream;
+	if (triage->bbox[0] > triage->bbox[2])
+		triage->bbox[0] = triage->bbox[1] = triage->bbox[2]
+		                = triage->bbox[3] = 0;
+	return 0;
 }
 
-static void ps__consume_word(char **stream)
-{
-	while (!isspace(**stream) && **stream != '\0')
-		++*stream;
-}
+/*
+ * Text extraction implementation
+ */
 
-static void ps__consume_digits(char **stream)
+#define PS__TEXT_MASK (  PS_CMD_BIT(PS_CMD_BEGIN_TEXT) \
+                       | PS_CMD_BIT(PS_CMD_LEADING) \
+                       | PS_CMD_BIT(PS_CMD_MOVE_TEXT) \
+                       | PS_CMD_BIT(PS_CMD_MOVE_TEXT_LEADING) \
+                       | PS_CMD_BIT(PS_CMD_NEXT_LINE) \
+                       | PS_CMD_BIT(PS_CMD_NEXT_LINE_SHOW_TEXT) \
+                       | PS_CMD_BIT(PS_CMD_NEXT_LINE_SHOW_TEXT_SPACED) \
+                       | PS_CMD_BIT(PS_CMD_SET_FONT) \
+                       | PS_CMD_BIT(PS_CMD_SHOW_TEXT) \
+                       | PS_CMD_BIT(PS_CMD_SHOW_TEXT_ARR) \
+                       | PS_CMD_BIT(PS_CMD_TEXT_MATRIX) \
+                       | PS_CMD_BIT(PS_CMD_TEXT_RISE))
+
+struct ps__text_state
 {
-	while ((isdigit(**stream) || **stream == '.') && **stream != '\0')
-		++*stream;
-}
+	float tm[6], tlm[6];
+	float leading, rise, font_sz;
+	size_t font, font_len;
+	struct ps_text_run *run;
+};
 
-static int ps__consume_to(char **stream, char c)
+/* Finds the next byte of a literal string that needs decoding */
+static const char *ps__text_find_special(const char *p, const char *end)
 {
-	while (**stream != c && **stream != '\0')
-		++*stream;
-	return **stream == '\0';
+#if defined(PDF__SSE2)
+	const __m128i bs = _mm_set1_epi8('\\'), cr = _mm_set1_epi8('\r');
+	for (; end - p >= 16; p += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)p);
+		int m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, bs),
+		                                       _mm_cmpeq_epi8(v, cr)));
+		if (m)
+			return p + __builtin_ctz(m);
+	}
+#endif
+	for (; p < end; ++p)
+		if (*p == '\\' || *p == '\r')
+			return p;
+	return end;
 }
 
-static struct ps__arg *ps__arg_arr_grow(struct ps__arg_arr *args)
+/* Copies the spans between escapes whole, so decoding is one pass */
+static size_t ps__text_decode_str(const char *p, const char *end, char *out)
 {
-	++args->sz;
-	args->entries = PDF_REALLOC(args->entries,
-	                            args->sz*sizeof(struct ps__arg));
-	return args->entries + args->sz - 1;
-}
+	char *start = out;
+	const char *special;
+	int c;
 
-static int ps__parse_args(struct ps_ctx *ctx)
-{
-	struct ps__arg_arr *args = &ctx->args;
-	struct ps__arg *arg;
-	while (1) {
-		ps__consume_ws(&ctx->stream);
-		switch (*ctx->stream) {
-		case '/':
-			arg = ps__arg_arr_grow(args);
-			arg->type = PS_ARG_NAME;
-			++ctx->stream;
-			arg->val.start = ctx->stream;
-			ps__consume_name(&ctx->stream);
-			arg->val.end = ctx->stream;
-		break;
-		case '-':
-		case '+':
-		case '0':
-		case '1':
-		case '2':
-		case '3':
-		case '4':
-		case '5':
-		case '6':
-		case '7':
-		case '8':
-		case '9':
-			arg = ps__arg_arr_grow(args);
-			arg->type = PS_ARG_REAL;
-			arg->val.start = ctx->stream;
-			/* '9' - '-' = 12; '9' - '+' = 14 */
-			ctx->stream += ('9' - *ctx->stream)/10;
-			ps__consume_digits(&ctx->stream);
-			arg->val.end = ctx->stream;
-		break;
-		case '(':
-			arg = ps__arg_arr_grow(args);
-			arg->type = PS_ARG_STR;
-			arg->val.start = ++ctx->stream;
-			if (ps__consume_to(&ctx->stream, ')'))
-				PDF_ERR(PS_ERR, "Unterminated text string\n");
-			arg->val.end = ctx->stream;
-			++ctx->stream;
+	while (p < end) {
+		special = ps__text_find_special(p, end);
+		memcpy(out, p, special - p);
+		out += special - p;
+		if (special == end)
+			break;
+		p = special + 1;
+		if (*special == '\r') {
+			/* any unescaped end of line reads as a newline */
+			*out++ = '\n';
+			if (p < end && *p == '\n')
+				++p;
+			continue;
+		}
+		if (p == end)
+			break;
+		switch (*p) {
+		case 'n': *out++ = '\n'; ++p; break;
+		case 'r': *out++ = '\r'; ++p; break;
+		case 't': *out++ = '\t'; ++p; break;
+		case 'b': *out++ = '\b'; ++p; break;
+		case 'f': *out++ = '\f'; ++p; break;
+		case '\r':
+			if (++p < end && *p == '\n')
+				++p;
 		break;
-		case '[':
-			arg = ps__arg_arr_grow(args);
-			arg->type = PS_ARG_ARR;
-			arg->arr.entries = NULL;
-			arg->arr.sz = 0;
-			arg->arr.parent = args;
-			args = &arg->arr;
-			++ctx->stream;
+		case '\n':
+			++p;
 		break;
-		case ']':
-			args = args->parent;
-			PDF_ERRIF(!args, PS_ERR, "Unexpected end of array text token\n");
-			++ctx->stream;
+		case '0': case '1': case '2': case '3':
+		case '4': case '5': case '6': case '7':
+			c = 0;
+			for (int i = 0; i < 3 && p < end && *p >= '0' && *p <= '7'; ++i)
+				c = 8*c + (*p++ - '0');
+			*out++ = (char)c;
 		break;
 		default:
-			if (args->parent)
-				PDF_ERR(PS_ERR, "Unterminated array\n")
-			else
-				return ctx->stream == '\0' ? PS_END : PS_OK;
+			*out++ = *p++;
 		break;
 		}
 	}
+	return out - start;
 }
 
-static int ps__next_text_cmd(struct ps_ctx *ctx, struct ps_cmd *cmd)
+static int ps__hex_digit(int c)
 {
-	int ret;
-	const char *start;
-
-	ret = ps__parse_args(ctx);
-	if (ret != PS_OK)
-		return ret;
-
-	start = ctx->stream;
-	ps__consume_word(&ctx->stream);
-	if (ctx->stream - start == 2 && strncmp(start, "Td", 2) == 0)
-		cmd->type = PS_CMD_MOVE_TEXT;
-	else if (ctx->stream - start == 2 && strncmp(start, "Tf", 2) == 0)
-		cmd->type = PS_CMD_SET_FONT;
-	else if (ctx->stream - start == 2 && strncmp(start, "Tj", 2) == 0)
-		cmd->type =  PS_CMD_SHOW_TEXT;
-	else if (ctx->stream - start == 2 && strncmp(start, "ET", 2) == 0) {
-		ctx->next_cmd = ps__next_base_cmd;
-		return PS_META_CMD;
-	} else if (ctx->stream == '\0')
-		return PS_END;
-	else
-		PDF_ERR(PS_ERR, "Unknown text command '%.*s'\n",
-		        (int)(ctx->stream - start), start);
-	return PS_OK;
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
 }
 
-static int ps__next_base_cmd(struct ps_ctx *ctx, struct ps_cmd *cmd)
+/* Bytes other than digits and whitespace are skipped */
+static size_t ps__text_decode_hex(const char *p, const char *end, char *out)
 {
-	int ret;
-	const char *start;
-
-	ret = ps__parse_args(ctx);
-	if (ret != PS_OK)
-		return ret;
-
-	start = ctx->stream;
-	ps__consume_word(&ctx->stream);
-	if (ctx->stream - start == 2 && strncmp(start, "BT", 2) == 0) {
-		ctx->next_cmd = ps__next_text_cmd;
-		return PS_META_CMD;
-	} else if (ctx->stream - start == 1 && *start == 'q') {
-		cmd->type = PS_CMD_SAVE_STATE;
-		return PS_OK;
-	} else if (ctx->stream - start == 1 && *start == 'Q') {
-		cmd->type = PS_CMD_RESTORE_STATE;
-		return PS_OK;
-	} else if (ctx->stream - start == 1 && *start == 'k') {
-		cmd->type = PS_CMD_FILL_CMYK;
-		return PS_OK;
-	} else if (ctx->stream - start == 1 && *start == 'K') {
-		cmd->type = PS_CMD_STROKE_CMYK;
-		return PS_OK;
-	} else if (ctx->stream - start == 1 && *start == 'g') {
-		cmd->type = PS_CMD_FILL_GRAY;
-		return PS_OK;
-	} else if (ctx->stream - start == 1 && *start == 'G') {
-		cmd->type = PS_CMD_STROKE_GRAY;
-		return PS_OK;
-	} else if (ctx->stream - start == 1 && *start == 'w') {
-		cmd->type = PS_CMD_LINE_WIDTH;
-		return PS_OK;
-	} else if (ctx->stream - start == 2 && strncmp(start, "re", 2) == 0) {
-		cmd->type = PS_CMD_RECTANGLE;
-		return PS_OK;
-	} else if (ctx->stream - start == 1 && *start == 'm') {
-		cmd->type = PS_CMD_MOVE_TO;
-		return PS_OK;
-	} else if (ctx->stream - start == 1 && *start == 'l') {
-		cmd->type = PS_CMD_LINE_TO;
-		return PS_OK;
-	} else if (ctx->stream - start == 1 && *start == 'S') {
-		cmd->type = PS_CMD_STROKE;
-		return PS_OK;
-	} else if (ctx->stream - start == 1 && *start == 'd') {
-		cmd->type = PS_CMD_DASH;
-		return PS_OK;
-	} else if (   ctx->stream - start == 1
-	           && (*start == 'f' || *start == 'F')) {
-		cmd->type = PS_CMD_FILL;
-		return PS_OK;
-	} else if (ctx->stream - start == 2 && strncmp(start, "cm", 2) == 0) {
-		cmd->type = PS_CMD_TRANSFORM;
-		return PS_OK;
-	} else if (ctx->stream - start == 2 && strncmp(start, "Do", 2) == 0) {
-		cmd->type = PS_CMD_OBJ;
-		return PS_OK;
+	int hi = -1;
+	size_t sz = pdf__hex_decode(&p, end, out, &hi);
+	while (p < end) {
+		++p;
+		sz += pdf__hex_decode(&p, end, out + sz, &hi);
 	}
-	if (*ctx->stream == '\0')
-		return PS_END;
-	PDF_LOG("Unknown base command '%.*s'\n", (int)(ctx->stream - start),
-	        start);
-	return PS_ERR;
+	/* a final odd digit is followed by an implied 0 */
+	if (hi >= 0)
+		out[sz++] = (char)(hi << 4);
+	return sz;
 }
 
-static void ps__free_arg_arr(struct ps__arg_arr *arr)
+static void ps__text_begin_run(struct ps_text_buf *buf,
+                               struct ps__text_state *ts,
+                               const float ctm[6])
 {
-	for (size_t i = 0; i < arr->sz; ++i) {
-		switch (arr->entries[i].type) {
-		case PS_ARG_ARR:
-			ps__free_arg_arr(&arr->entries[i].arr);
-		break;
-		case PS_ARG_NAME:
-		case PS_ARG_REAL:
-		case PS_ARG_STR:
-			*arr->entries[i].val.end = arr->entries[i].val.replacement;
-		break;
-		}
-	}
-	PDF_FREE(arr->entries);
-	arr->entries = NULL;
-	arr->sz = 0;
+	struct ps_text_run *run = buf->runs + buf->run_cnt++;
+	float m[6] = { ts->font_sz, 0, 0, ts->font_sz, 0, ts->rise };
+	ps_mat_mul(m, ts->tm, run->trm);
+	ps_mat_mul(run->trm, ctm, run->trm);
+	run->font = ts->font;
+	run->font_len = ts->font_len;
+	run->text = buf->text_sz;
+	run->text_len = 0;
+	ts->run = run;
 }
 
-static void ps__replace_arg_ends(struct ps__arg_arr *arr)
+static void ps__text_append(struct ps_text_buf *buf,
+                            struct ps__text_state *ts,
+                            const char *str, size_t len, int hex)
 {
-	for (size_t i = 0; i < arr->sz; ++i) {
-		switch (arr->entries[i].type) {
-		case PS_ARG_ARR:
-			ps__replace_arg_ends(&arr->entries[i].arr);
-		break;
-		case PS_ARG_NAME:
-		case PS_ARG_REAL:
-		case PS_ARG_STR:
-			arr->entries[i].val.replacement = *arr->entries[i].val.end;
-			*arr->entries[i].val.end = '\0';
-		break;
-		}
-	}
+	char *out = buf->data + buf->text_sz;
+	size_t sz =   hex ? ps__text_decode_hex(str, str + len, out)
+	                  : ps__text_decode_str(str, str + len, out);
+	buf->text_sz += sz;
+	ts->run->text_len += sz;
+}
+
+static void ps__text_move(struct ps__text_state *ts, float x, float y)
+{
+	float m[6] = { 1, 0, 0, 1, x, y };
+	ps_mat_mul(m, ts->tlm, ts->tlm);
+	memcpy(ts->tm, ts->tlm, sizeof(ts->tm));
 }
 
-static int ps__assign_cmd_args(struct ps__arg_arr *args,
-                               struct ps_cmd *cmd)
+static void ps__text_apply(struct ps_text_buf *buf, struct ps__text_state *ts,
+                           const float ctm[6], const struct ps_cmd *cmd)
 {
+	static const float identity[6] = { 1, 0, 0, 1, 0, 0 };
+	const struct ps_text_elem *elem;
+
 	switch (cmd->type) {
-	case PS_CMD_DASH:
-		PDF_ERRIF(!(   args->sz == 2
-		            && args->entries[0].type == PS_ARG_ARR
-		            && args->entries[1].type == PS_ARG_REAL),
-		          PS_ERR, "%s called with incorrect params\n",
-		          ps_cmd_name(cmd->type));
-		PDF_ERRIF(args->entries[0].arr.sz > PS_DASH_SZ, PS_ERR,
-		          "%s array exceeds implementation limit\n",
-		          ps_cmd_name(cmd->type));
-		for (size_t i = 0; i < args->entries[0].arr.sz; ++i) {
-			struct ps__arg *arg = args->entries[0].arr.entries+i;
-			PDF_ERRIF(arg->type != PS_ARG_REAL, PS_ERR,
-			          "%s array has non-real value\n",
-			          ps_cmd_name(cmd->type));
-			cmd->dash.arr[i] = atoi(arg->val.start);
-		}
-		if (args->entries[0].arr.sz < PS_DASH_SZ)
-			cmd->dash.arr[args->entries[0].arr.sz] = -1;
-		cmd->dash.phase = atoi(args->entries[1].val.start);
-	break;
-	case PS_CMD_FILL_CMYK:
-	case PS_CMD_STROKE_CMYK:
-		PDF_ERRIF(!(   args->sz == 4
-		            && args->entries[0].type == PS_ARG_REAL
-		            && args->entries[1].type == PS_ARG_REAL
-		            && args->entries[2].type == PS_ARG_REAL
-		            && args->entries[3].type == PS_ARG_REAL),
-		          PS_ERR, "%s called with incorrect params\n",
-		          ps_cmd_name(cmd->type));
-		cmd->cmyk.c = strtof(args->entries[0].val.start, NULL);
-		cmd->cmyk.m = strtof(args->entries[1].val.start, NULL);
-		cmd->cmyk.y = strtof(args->entries[2].val.start, NULL);
-		cmd->cmyk.k = strtof(args->entries[3].val.start, NULL);
-	break;
-	case PS_CMD_FILL_GRAY:
-	case PS_CMD_STROKE_GRAY:
-		PDF_ERRIF(!(   args->sz == 1
-		            && args->entries[0].type == PS_ARG_REAL),
-		          PS_ERR, "%s called with incorrect params\n",
-		          ps_cmd_name(cmd->type));
-		cmd->gray.val = strtof(args->entries[0].val.start, NULL);
-	break;
-	case PS_CMD_LINE_TO:
-	case PS_CMD_MOVE_TO:
-		PDF_ERRIF(!(   args->sz == 2
-		            && args->entries[0].type == PS_ARG_REAL
-		            && args->entries[1].type == PS_ARG_REAL),
-		          PS_ERR, "%s called with incorrect params\n",
-		          ps_cmd_name(cmd->type));
-		cmd->pos.x = strtof(args->entries[0].val.start, NULL);
-		cmd->pos.y = strtof(args->entries[1].val.start, NULL);
+	case PS_CMD_BEGIN_TEXT:
+		memcpy(ts->tm, identity, sizeof(ts->tm));
+		memcpy(ts->tlm, identity, sizeof(ts->tlm));
 	break;
-	case PS_CMD_LINE_WIDTH:
-		PDF_ERRIF(!(   args->sz == 1
-		            && args->entries[0].type == PS_ARG_REAL),
-		          PS_ERR, "%s called with incorrect params\n",
-		          ps_cmd_name(cmd->type));
-		cmd->line_width.val = strtof(args->entries[0].val.start, NULL);
+	case PS_CMD_TEXT_MATRIX:
+		ts->tm[0] = ts->tlm[0] = cmd->transform.a;
+		ts->tm[1] = ts->tlm[1] = cmd->transform.b;
+		ts->tm[2] = ts->tlm[2] = cmd->transform.c;
+		ts->tm[3] = ts->tlm[3] = cmd->transform.d;
+		ts->tm[4] = ts->tlm[4] = cmd->transform.e;
+		ts->tm[5] = ts->tlm[5] = cmd->transform.f;
 	break;
+	case PS_CMD_MOVE_TEXT_LEADING:
+		ts->leading = -cmd->pos.y;
+		/* fall through */
 	case PS_CMD_MOVE_TEXT:
-		PDF_ERRIF(!(   args->sz == 2
-		            && args->entries[0].type == PS_ARG_REAL
-		            && args->entries[1].type == PS_ARG_REAL),
-		          PS_ERR, "%s called with incorrect params\n",
-		          ps_cmd_name(cmd->type));
-		cmd->pos.x = strtof(args->entries[0].val.start, NULL);
-		cmd->pos.y = strtof(args->entries[1].val.start, NULL);
+		ps__text_move(ts, cmd->pos.x, cmd->pos.y);
 	break;
-	case PS_CMD_OBJ:
-		PDF_ERRIF(!(   args->sz == 1
-		            && args->entries[0].type == PS_ARG_NAME),
-		          PS_ERR, "%s called with incorrect params\n",
-		          ps_cmd_name(cmd->type));
-		cmd->obj.name = args->entries[0].val.start;
+	case PS_CMD_NEXT_LINE:
+		ps__text_move(ts, 0, -ts->leading);
 	break;
-	case PS_CMD_RECTANGLE:
-		PDF_ERRIF(!(   args->sz == 4
-		            && args->entries[0].type == PS_ARG_REAL
-		            && args->entries[1].type == PS_ARG_REAL
-		            && args->entries[2].type == PS_ARG_REAL
-		            && args->entries[3].type == PS_ARG_REAL),
-		          PS_ERR, "%s called with incorrect params\n",
-		          ps_cmd_name(cmd->type));
-		cmd->rectangle.x = strtof(args->entries[0].val.start, NULL);
-		cmd->rectangle.y = strtof(args->entries[1].val.start, NULL);
-		cmd->rectangle.width = strtof(args->entries[2].val.start, NULL);
-		cmd->rectangle.height = strtof(args->entries[3].val.start, NULL);
+	case PS_CMD_LEADING:
+		ts->leading = cmd->real.val;
+	break;
+	case PS_CMD_TEXT_RISE:
+		ts->rise = cmd->real.val;
 	break;
 	case PS_CMD_SET_FONT:
-		PDF_ERRIF(!(   args->sz == 2
-		            && args->entries[0].type == PS_ARG_NAME
-		            && args->entries[1].type == PS_ARG_REAL),
-		          PS_ERR, "%s called with incorrect params\n",
-		          ps_cmd_name(cmd->type));
-		cmd->set_font.font = args->entries[0].val.start;
-		cmd->set_font.sz = atoi(args->entries[1].val.start);
+		ts->font = buf->text_sz;
+		ts->font_len = strlen(cmd->set_font.font);
+		memcpy(buf->data + ts->font, cmd->set_font.font, ts->font_len);
+		buf->text_sz += ts->font_len;
+		ts->font_sz = cmd->set_font.sz;
 	break;
+	case PS_CMD_NEXT_LINE_SHOW_TEXT:
+		ps__text_move(ts, 0, -ts->leading);
+		/* fall through */
 	case PS_CMD_SHOW_TEXT:
-		PDF_ERRIF(!(   args->sz == 1
-		            && args->entries[0].type == PS_ARG_STR),
-		          PS_ERR, "%s called with incorrect params\n",
-		          ps_cmd_name(cmd->type));
-		cmd->show_text.str = args->entries[0].val.start;
+		ps__text_begin_run(buf, ts, ctm);
+		ps__text_append(buf, ts, cmd->show_text.str, cmd->show_text.len,
+		                cmd->show_text.hex);
 	break;
-	case PS_CMD_TRANSFORM:
-		PDF_ERRIF(!(   args->sz == 6
-		            && args->entries[0].type == PS_ARG_REAL
-		            && args->entries[1].type == PS_ARG_REAL
-		            && args->entries[2].type == PS_ARG_REAL
-		            && args->entries[3].type == PS_ARG_REAL
-		            && args->entries[4].type == PS_ARG_REAL
-		            && args->entries[5].type == PS_ARG_REAL),
-		          PS_ERR, "%s called with incorrect params\n",
-		          ps_cmd_name(cmd->type));
-		cmd->transform.a = strtof(args->entries[0].val.start, NULL);
-		cmd->transform.b = strtof(args->entries[1].val.start, NULL);
-		cmd->transform.c = strtof(args->entries[2].val.start, NULL);
-		cmd->transform.d = strtof(args->entries[3].val.start, NULL);
-		cmd->transform.e = strtof(args->entries[4].val.start, NULL);
-		cmd->transform.f = strtof(args->entries[5].val.start, NULL);
+	case PS_CMD_NEXT_LINE_SHOW_TEXT_SPACED:
+		ps__text_move(ts, 0, -ts->leading);
+		ps__text_begin_run(buf, ts, ctm);
+		ps__text_append(buf, ts, cmd->spaced_text.str, cmd->spaced_text.len,
+		                cmd->spaced_text.hex);
 	break;
-	case PS_CMD_FILL:
-	case PS_CMD_RESTORE_STATE:
-	case PS_CMD_SAVE_STATE:
-	case PS_CMD_STROKE:
-		PDF_ERRIF(!(args->sz == 0),
-		          PS_ERR, "%s called with params when none expected\n",
-		          ps_cmd_name(cmd->type));
+	case PS_CMD_SHOW_TEXT_ARR:
+		ts->run = NULL;
+		for (size_t i = 0; i < cmd->show_text_arr.sz; ++i) {
+			elem = cmd->show_text_arr.elems + i;
+			if (elem->str) {
+				if (!ts->run)
+					ps__text_begin_run(buf, ts, ctm);
+				ps__text_append(buf, ts, elem->str, elem->len, elem->hex);
+			} else if (   ts->run && ts->run->text_len
+			           && elem->adjust <= -PS_TEXT_SPACE_ADJUST
+			           && buf->data[buf->text_sz-1] != ' ') {
+				buf->data[buf->text_sz++] = ' ';
+				++ts->run->text_len;
+			}
+		}
+	break;
+	default:
 	break;
 	}
-	return PS_OK;
 }
 
-AMFDEF int ps_exec(struct ps_ctx *ctx, struct ps_cmd *cmd)
+static size_t ps__count_byte(const char *p, const char *end, char c)
 {
-	int ret = PS_META_CMD;
+	size_t cnt = 0;
+	while ((p = memchr(p, c, end - p))) {
+		++cnt;
+		++p;
+	}
+	return cnt;
+}
 
-	if (ctx->args.sz)
-		ps__free_arg_arr(&ctx->args);
+AMFDEF int ps_text_extract(struct ps_text_buf *buf, char *str, size_t sz,
+                           const float ctm[6])
+{
+	struct ps_segment seg = { str, sz };
+	return ps_text_extract_chain(buf, &seg, 1, ctm);
+}
 
-	while (ret == PS_META_CMD)
-		ret = ctx->next_cmd(ctx, cmd);
+AMFDEF int ps_text_extract_chain(struct ps_text_buf *buf,
+                                 const struct ps_segment *segs, size_t cnt,
+                                 const float ctm[6])
+{
+	struct ps__text_state ts = {
+		.tm = { 1, 0, 0, 1, 0, 0 }, .tlm = { 1, 0, 0, 1, 0, 0 },
+	};
+	struct ps_gs gs;
+	struct ps_cmd cmd;
+	struct ps_path path;
+	size_t run_cap = 0, text_cap = 0, need;
+	int ret;
 
-	if (ret == PS_OK) {
-		ps__replace_arg_ends(&ctx->args);
-		ret = ps__assign_cmd_args(&ctx->args, cmd);
+	/*
+	 * Decoding never lengthens what it copies, so the stream size bounds
+	 * the text, and each run starts with its own string delimiter.
+	 */
+	for (size_t i = 0; i < cnt; ++i) {
+		const char *str = segs[i].str, *end = str + segs[i].sz;
+		run_cap += ps__count_byte(str, end, '(') + ps__count_byte(str, end, '<');
+		text_cap += segs[i].sz;
 	}
-	if (ret == PS_ERR || ret == PS_END)
-		ps__free_arg_arr(&ctx->args);
+	text_cap = (text_cap + 15) & ~(size_t)15;
+	need = text_cap + run_cap*sizeof(struct ps_text_run);
+	if (need > buf->cap) {
+		PDF_FREE(buf->data);
+		buf->data = PDF_MALLOC(need);
+		buf->cap = need;
+	}
+	buf->runs = (struct ps_text_run *)(buf->data + text_cap);
+	buf->text_sz = 0;
+	buf->run_cnt = 0;
+
+	ps_gs_init_chain(&gs, segs, cnt, ctm, PS__TEXT_MASK);
+	while ((ret = ps_gs_exec(&gs, &cmd, &path)) == PS_OK || ret == PS_PATH)
+		if (ret == PS_OK)
+			ps__text_apply(buf, &ts, gs.stack[gs.depth].ctm, &cmd);
+	ps_gs_free(&gs);
+	return ret == PS_END ? PS_OK : PS_ERR;
+}
 
-	return ret;
+AMFDEF void ps_text_buf_free(struct ps_text_buf *buf)
+{
+	PDF_FREE(buf->data);
+	buf->data = NULL;
+	buf->runs = NULL;
+	buf->cap = buf->text_sz = buf->run_cnt = 0;
 }
 
 #endif // AMETHYST_IMPLEMENTATION
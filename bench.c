@@ -0,0 +1,295 @@
+#define AMETHYST_IMPLEMENTATION
+#include "amethyst.h"
+#include <time.h>
+
+/*
+ * Microbenchmarks for the internal hot paths.  Inputs are generated in
+ * memory so the numbers do not depend on which PDFs are at hand.  Each
+ * benchmark reports the best of RUNS passes; filters are measured in
+ * decoded bytes.
+ */
+
+#define RUNS 5
+
+static const char page_dict[] =
+	"<< /Type /Page /Parent 3 0 R /MediaBox [0 0 612 792] "
+	"/Resources << /Font << /F1 12 0 R /F2 13 0 R >> "
+	"/XObject << /Im1 14 0 R >> /ProcSet [/PDF /Text /ImageC] >> "
+	"/Contents 15 0 R /Rotate 0 /UserUnit 1.0 /Annots [16 0 R 17 0 R] "
+	"/Title (Page \\(one\\)) /ID <0a1b2c3d> >>\n";
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, size_t bytes, size_t items,
+                   const char *unit, double secs)
+{
+	printf("%-8s %8.1f MB/s", name, bytes / secs / 1e6);
+	if (unit)
+		printf("  %8.2f M%s/s", items / secs / 1e6, unit);
+	putchar('\n');
+}
+
+static unsigned rand_state = 1;
+static unsigned rnd(unsigned n)
+{
+	rand_state = rand_state * 1103515245 + 12345;
+	return (rand_state >> 16) % n;
+}
+
+static char *repeat(const char *s, size_t cnt, size_t *sz)
+{
+	size_t len = strlen(s);
+	char *buf = PDF_MALLOC(len * cnt);
+	for (size_t i = 0; i < cnt; ++i)
+		memcpy(buf + i * len, s, len);
+	*sz = len * cnt;
+	return buf;
+}
+
+static size_t count_tokens(struct pdf__ctx *ctx)
+{
+	struct pdf_obj obj;
+	enum pdf__token token;
+	size_t cnt = 0;
+
+	while ((token = pdf__next_token(ctx)) != PDF_TOK_EOF) {
+		if (token == PDF_TOK_NAME_BEGIN)
+			pdf__read_name(ctx, &obj.name);
+		else if (token == PDF_TOK_STR_BEGIN)
+			pdf__read_str(ctx, &obj.str);
+		else if (token == PDF_TOK_HEX_BEGIN)
+			pdf__read_hex(ctx, &obj.hex);
+		++cnt;
+	}
+	return cnt;
+}
+
+static void bench_lex(void)
+{
+	struct pdf__ctx ctx = {0};
+	struct pdf_obj obj;
+	size_t sz, tokens;
+	double best = 1e9;
+	char *buf = repeat(page_dict, 100000, &sz);
+
+	ctx.mem = ctx.pos = buf;
+	ctx.end = buf + sz;
+	tokens = count_tokens(&ctx);
+	for (int run = 0; run < RUNS; ++run) {
+		double start = now();
+		ctx.pos = buf;
+		while (ctx.pos < ctx.end) {
+			if (pdf__parse_obj(&ctx, &obj)) {
+				fprintf(stderr, "lex: parse failed\n");
+				exit(1);
+			}
+			while (ctx.pos < ctx.end && *ctx.pos == '\n')
+				++ctx.pos;
+		}
+		start = now() - start;
+		if (start < best)
+			best = start;
+		pdf__free_arena(ctx.arena);
+		ctx.arena = NULL;
+	}
+	report("lex", sz, tokens, "tok", best);
+	PDF_FREE(ctx.arr_stack);
+	PDF_FREE(ctx.dict_stack);
+	PDF_FREE(buf);
+}
+
+/* Content-stream-like text, which is what LZW mostly holds in practice */
+static char *gen_text(size_t sz)
+{
+	static const char *const ops[] = {"Td", "Tj", "Tf", "re f", "l S", "cm"};
+	char *buf = PDF_MALLOC(sz + 64);
+	size_t len = 0;
+
+	while (len < sz)
+		len += sprintf(buf + len, "%u %u %s (w%u)\n", rnd(612), rnd(792),
+		               ops[rnd(6)], rnd(100));
+	return buf;
+}
+
+/* Scanlines of runs and short literal stretches */
+static char *gen_runs(size_t sz)
+{
+	char *buf = PDF_MALLOC(sz);
+	size_t len = 0, n;
+
+	while (len < sz) {
+		n = rnd(300) + 1;
+		if (n > sz - len)
+			n = sz - len;
+		if (rnd(3))
+			memset(buf + len, rnd(256), n);
+		else
+			for (size_t i = 0; i < n; ++i)
+				buf[len + i] = rnd(256);
+		len += n;
+	}
+	return buf;
+}
+
+struct bitbuf
+{
+	unsigned char *out;
+	size_t sz;
+	unsigned long long bits;
+	unsigned nbits;
+};
+
+static void put_bits(struct bitbuf *b, unsigned code, unsigned width)
+{
+	b->bits = b->bits << width | code;
+	b->nbits += width;
+	while (b->nbits >= 8) {
+		b->nbits -= 8;
+		b->out[b->sz++] = (unsigned char)(b->bits >> b->nbits);
+	}
+}
+
+/* Encodes with EarlyChange 1, clearing the table when it fills */
+static char *lzw_encode(const unsigned char *p, size_t sz, size_t *out_sz)
+{
+	unsigned short *codes = PDF_MALLOC(PDF__LZW_MAX * 256 * sizeof(*codes));
+	unsigned *gens = PDF_MALLOC(PDF__LZW_MAX * 256 * sizeof(*gens));
+	struct bitbuf b = {PDF_MALLOC(2 * sz + 16)};
+	unsigned gen = 1, next = 258, width = 9, w;
+
+	memset(gens, 0, PDF__LZW_MAX * 256 * sizeof(*gens));
+	put_bits(&b, PDF__LZW_CLEAR, width);
+	w = sz ? p[0] : 0;
+	for (size_t i = 1; i < sz; ++i) {
+		size_t k = (size_t)w * 256 + p[i];
+		if (gens[k] == gen) {
+			w = codes[k];
+			continue;
+		}
+		put_bits(&b, w, width);
+		gens[k] = gen;
+		codes[k] = next++;
+		if (next == 1u << width && width < 12)
+			++width;
+		if (next >= PDF__LZW_MAX - 1) {
+			put_bits(&b, PDF__LZW_CLEAR, width);
+			++gen;
+			next = 258;
+			width = 9;
+		}
+		w = p[i];
+	}
+	if (sz)
+		put_bits(&b, w, width);
+	put_bits(&b, PDF__LZW_EOD, width);
+	put_bits(&b, 0, 7);
+	PDF_FREE(codes);
+	PDF_FREE(gens);
+	*out_sz = b.sz;
+	return (char *)b.out;
+}
+
+static char *rl_encode(const unsigned char *p, size_t sz, size_t *out_sz)
+{
+	unsigned char *out = PDF_MALLOC(sz + sz / 128 + 2);
+	size_t i = 0, j, len = 0;
+
+	while (i < sz) {
+		for (j = i; j < sz && j - i < 128 && p[j] == p[i]; ++j)
+			;
+		if (j - i >= 2) {
+			out[len++] = (unsigned char)(257 - (j - i));
+			out[len++] = p[i];
+			i = j;
+			continue;
+		}
+		for (j = i + 1; j < sz && j - i < 128 && !(j + 1 < sz && p[j] == p[j+1]);
+		     ++j)
+			;
+		out[len++] = (unsigned char)(j - i - 1);
+		memcpy(out + len, p + i, j - i);
+		len += j - i;
+		i = j;
+	}
+	out[len++] = 128;
+	*out_sz = len;
+	return (char *)out;
+}
+
+static void bench_filter(const char *name, const char *data, size_t sz,
+                         const char *enc, size_t enc_sz,
+                         int (*decode)(char **, size_t *))
+{
+	double best = 1e9;
+
+	for (int run = 0; run < RUNS; ++run) {
+		char *buf = PDF_MALLOC(enc_sz);
+		size_t buf_sz = enc_sz;
+		double start;
+
+		memcpy(buf, enc, enc_sz);
+		start = now();
+		if (decode(&buf, &buf_sz) || buf_sz != sz || memcmp(buf, data, sz)) {
+			fprintf(stderr, "%s: decoded data differs\n", name);
+			exit(1);
+		}
+		start = now() - start;
+		if (start < best)
+			best = start;
+		PDF_FREE(buf);
+	}
+	report(name, sz, 0, NULL, best);
+}
+
+static int lzw_decode(char **stream, size_t *sz)
+{
+	return pdf__lzw_decode(stream, sz, 1);
+}
+
+static void bench_lzw(void)
+{
+	size_t sz = 32 << 20, enc_sz;
+	char *data = gen_text(sz);
+	char *enc = lzw_encode((unsigned char *)data, sz, &enc_sz);
+
+	bench_filter("lzw", data, sz, enc, enc_sz, lzw_decode);
+	PDF_FREE(enc);
+	PDF_FREE(data);
+}
+
+static void bench_rl(void)
+{
+	size_t sz = 32 << 20, enc_sz;
+	char *data = gen_runs(sz);
+	char *enc = rl_encode((unsigned char *)data, sz, &enc_sz);
+
+	bench_filter("rl", data, sz, enc, enc_sz, pdf__rl_decode);
+	PDF_FREE(enc);
+	PDF_FREE(data);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct {
+		const char *name;
+		void (*run)(void);
+	} benches[] = {
+		{"lex", bench_lex},
+		{"lzw", bench_lzw},
+		{"rl", bench_rl},
+	};
+
+	for (size_t i = 0; i < sizeof(benches) / sizeof(*benches); ++i) {
+		int sel = argc < 2;
+		for (int j = 1; j < argc; ++j)
+			sel |= strcmp(argv[j], benches[i].name) == 0;
+		if (sel)
+			benches[i].run();
+	}
+	return 0;
+}
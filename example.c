@@ -2,25 +2,15 @@
 #include "amethyst.h"
 
 int obj_draw(struct pdf *pdf, struct pdf_objid id,
-             struct pdf_obj_dict *xobjects, unsigned indent)
+             struct pdf_resources *resources, unsigned indent);
+
+int stream_draw(struct pdf *pdf, const struct ps_segment *segs, size_t cnt,
+                struct pdf_resources *resources, unsigned indent)
 {
-	struct pdf_baseobj *contents = pdf_get_baseobj(pdf, id);
-	struct pdf_obj *xobj;
+	struct pdf_res_entry *xobj;
 	struct ps_ctx ctx = {0};
 	struct ps_cmd cmd;
-	PDF_ERRIF(!contents, -1,
-	          "failed to retrive Page Contents base object\n");
-	PDF_ERRIF(!contents->stream, -1, "Page Contents has no stream\n");
-	switch (contents->stream_type) {
-	case PDF_STREAM_JPEG:
-		PDF_LOG("%*s<<jpeg>>\n", 2*indent, "");
-		return 0;
-	case PDF_STREAM_UNKNOWN:
-		PDF_ERR(-1, "unknown stream type\n");
-	case PDF_STREAM_CMD:
-	break;
-	}
-	ps_init(&ctx, contents->stream);
+	ps_init_chain(&ctx, segs, cnt, PS_CMD_ALL);
 	while (ps_exec(&ctx, &cmd) == PS_OK) {
 		PDF_LOG("%*s%s", 2*indent, "", ps_cmd_name(cmd.type));
 		switch (cmd.type) {
@@ -39,6 +29,56 @@ int obj_draw(struct pdf *pdf, struct pdf_objid id,
 			PDF_LOG(" (%f %f %f %f)\n", cmd.cmyk.c, cmd.cmyk.m, cmd.cmyk.y,
 			        cmd.cmyk.k);
 		break;
+		case PS_CMD_FILL_COLOR:
+		case PS_CMD_STROKE_COLOR:
+			PDF_LOG(" (");
+			for (int i = 0; i < cmd.color.sz; ++i)
+				PDF_LOG("%f ", cmd.color.val[i]);
+			PDF_LOG("%s)\n", cmd.color.pattern ? cmd.color.pattern : "");
+		break;
+		case PS_CMD_FILL_RGB:
+		case PS_CMD_STROKE_RGB:
+			PDF_LOG(" (%f %f %f)\n", cmd.rgb.r, cmd.rgb.g, cmd.rgb.b);
+		break;
+		case PS_CMD_CURVE_TO:
+		case PS_CMD_CURVE_TO_V:
+		case PS_CMD_CURVE_TO_Y:
+			PDF_LOG(" (%f %f %f %f %f %f)\n", cmd.curve.x1, cmd.curve.y1,
+			        cmd.curve.x2, cmd.curve.y2, cmd.curve.x3, cmd.curve.y3);
+		break;
+		case PS_CMD_EXT_GSTATE:
+		case PS_CMD_FILL_COLOR_SPACE:
+		case PS_CMD_RENDERING_INTENT:
+		case PS_CMD_SHADING:
+		case PS_CMD_STROKE_COLOR_SPACE:
+			PDF_LOG(" (%s)\n", cmd.name.val);
+		break;
+		case PS_CMD_BEGIN_MARK:
+		case PS_CMD_MARK:
+			PDF_LOG(" (%s %s)\n", cmd.mark.tag,
+			        cmd.mark.props ? cmd.mark.props : "");
+		break;
+		case PS_CMD_CHAR_SPACING:
+		case PS_CMD_FLATNESS:
+		case PS_CMD_HORIZ_SCALING:
+		case PS_CMD_LEADING:
+		case PS_CMD_MITER_LIMIT:
+		case PS_CMD_TEXT_RISE:
+		case PS_CMD_WORD_SPACING:
+			PDF_LOG(" (%f)\n", cmd.real.val);
+		break;
+		case PS_CMD_LINE_CAP:
+		case PS_CMD_LINE_JOIN:
+		case PS_CMD_TEXT_RENDER:
+			PDF_LOG(" (%d)\n", cmd.intg.val);
+		break;
+		case PS_CMD_GLYPH_WIDTH:
+			PDF_LOG(" (%f %f)\n", cmd.glyph_width.wx, cmd.glyph_width.wy);
+		break;
+		case PS_CMD_INLINE_IMAGE:
+			PDF_LOG(" (%dx%d, %lu bytes)\n", cmd.inline_image.width,
+			        cmd.inline_image.height, cmd.inline_image.sz);
+		break;
 		case PS_CMD_FILL_GRAY:
 		case PS_CMD_STROKE_GRAY:
 			PDF_LOG(" (%f)\n", cmd.gray.val);
@@ -51,34 +91,70 @@ int obj_draw(struct pdf *pdf, struct pdf_objid id,
 			PDF_LOG(" (%f)\n", cmd.line_width.val);
 		break;
 		case PS_CMD_OBJ:
-			PDF_ERRIF(!xobjects, -1, " (%s) no resources\n", cmd.obj.name);
-			xobj = pdf_dict_find(xobjects, cmd.obj.name);
+			xobj = pdf_res_find(resources, PDF_RES_XOBJECT, cmd.obj.name);
 			PDF_ERRIF(!xobj, -1, " (%s) not found\n", cmd.obj.name);
-			PDF_ERRIF(xobj->type != PDF_OBJ_REF, -1,
+			PDF_ERRIF(!xobj->baseobj, -1,
 			          " (%s) invalid type\n", cmd.obj.name);
 			PDF_LOG(" (%s)\n", cmd.obj.name);
-			if (obj_draw(pdf, xobj->ref.id, NULL, indent+1))
+			if (obj_draw(pdf, xobj->id,
+			             pdf_get_form_resources(pdf, xobj->baseobj,
+			                                    resources),
+			             indent+1))
 				return -1;
 		break;
 		case PS_CMD_RECTANGLE:
 			PDF_LOG(" (%f %f %f %f)\n", cmd.rectangle.x, cmd.rectangle.y,
 			        cmd.rectangle.width, cmd.rectangle.height);
 		break;
+		case PS_CMD_NEXT_LINE_SHOW_TEXT:
 		case PS_CMD_SHOW_TEXT:
-			PDF_LOG(" (%s)\n", cmd.show_text.str);
+			PDF_LOG(cmd.show_text.hex ? " <%s>\n" : " (%s)\n",
+			        cmd.show_text.str);
+		break;
+		case PS_CMD_NEXT_LINE_SHOW_TEXT_SPACED:
+			PDF_LOG(cmd.spaced_text.hex ? " (%f %f <%s>)\n" : " (%f %f (%s))\n",
+			        cmd.spaced_text.word_spacing,
+			        cmd.spaced_text.char_spacing, cmd.spaced_text.str);
+		break;
+		case PS_CMD_SHOW_TEXT_ARR:
+			PDF_LOG(" ([");
+			for (size_t i = 0; i < cmd.show_text_arr.sz; ++i) {
+				const struct ps_text_elem *elem = cmd.show_text_arr.elems+i;
+				if (!elem->str)
+					PDF_LOG(" %f", elem->adjust);
+				else
+					PDF_LOG(elem->hex ? " <%s>" : " (%s)", elem->str);
+			}
+			PDF_LOG(" ])\n");
 		break;
 		case PS_CMD_SET_FONT:
-			PDF_LOG(" (%s, %d)\n", cmd.set_font.font, cmd.set_font.sz);
+			PDF_LOG(" (%s, %g)\n", cmd.set_font.font, cmd.set_font.sz);
 		break;
 		case PS_CMD_MOVE_TEXT:
+		case PS_CMD_MOVE_TEXT_LEADING:
 			PDF_LOG(" (%f, %f)\n", cmd.pos.x, cmd.pos.y);
 		break;
+		case PS_CMD_TEXT_MATRIX:
 		case PS_CMD_TRANSFORM:
 			PDF_LOG(" (%f %f %f %f %f %f)\n", cmd.transform.a,
 			        cmd.transform.b, cmd.transform.c, cmd.transform.d,
 			        cmd.transform.e, cmd.transform.f);
 		break;
+		case PS_CMD_BEGIN_TEXT:
+		case PS_CMD_CLIP:
+		case PS_CMD_CLIP_EVEN_ODD:
+		case PS_CMD_CLOSE_FILL_STROKE:
+		case PS_CMD_CLOSE_FILL_STROKE_EVEN_ODD:
+		case PS_CMD_CLOSE_PATH:
+		case PS_CMD_CLOSE_STROKE:
+		case PS_CMD_END_MARK:
+		case PS_CMD_END_PATH:
+		case PS_CMD_END_TEXT:
 		case PS_CMD_FILL:
+		case PS_CMD_FILL_EVEN_ODD:
+		case PS_CMD_FILL_STROKE:
+		case PS_CMD_FILL_STROKE_EVEN_ODD:
+		case PS_CMD_NEXT_LINE:
 		case PS_CMD_RESTORE_STATE:
 		case PS_CMD_SAVE_STATE:
 		case PS_CMD_STROKE:
@@ -89,11 +165,56 @@ int obj_draw(struct pdf *pdf, struct pdf_objid id,
 	return 0;
 }
 
-int page_draw(struct pdf *pdf, int page_idx)
+int obj_draw(struct pdf *pdf, struct pdf_objid id,
+             struct pdf_resources *resources, unsigned indent)
+{
+	struct pdf_baseobj *contents = pdf_get_baseobj(pdf, id);
+	struct ps_segment seg;
+	PDF_ERRIF(indent > 16, -1, "XObject nesting too deep\n");
+	PDF_ERRIF(!contents, -1,
+	          "failed to retrive Page Contents base object\n");
+	PDF_ERRIF(!contents->stream, -1, "Page Contents has no stream\n");
+	switch (contents->stream_type) {
+	case PDF_STREAM_JPEG: {
+		struct pdf_dct_opts opts = { .max_width = 64, .max_height = 64 };
+		struct pdf_image *image = pdf_image_acquire(pdf, id, &opts);
+		PDF_ERRIF(!image, -1, "failed to decode jpeg\n");
+		PDF_LOG("%*s<<jpeg %dx%dx%d>>\n", 2*indent, "", image->desc.width,
+		        image->desc.height, image->desc.components);
+		pdf_image_release(pdf, image);
+		return 0;
+	}
+	case PDF_STREAM_UNKNOWN:
+		PDF_ERR(-1, "unknown stream type\n");
+	case PDF_STREAM_CMD:
+	break;
+	}
+	seg.str = contents->stream;
+	seg.sz = contents->stream_sz;
+	return stream_draw(pdf, &seg, 1, resources, indent);
+}
+
+int text_draw(struct ps_segment *segs, size_t cnt, struct ps_text_buf *buf)
+{
+	PDF_ERRIF(ps_text_extract_chain(buf, segs, cnt, NULL), -1,
+	          "failed to extract text\n");
+	for (size_t i = 0; i < buf->run_cnt; ++i) {
+		const struct ps_text_run *run = buf->runs+i;
+		PDF_LOG("text @ (%g %g) %.*s: '%.*s'\n", run->trm[4], run->trm[5],
+		        (int)run->font_len, buf->data+run->font,
+		        (int)run->text_len, buf->data+run->text);
+	}
+	return 0;
+}
+
+int page_draw(struct pdf *pdf, int page_idx, struct ps_text_buf *text)
 {
-	struct pdf_obj *page, *contents_ref, *resources;
-	struct pdf_obj_dict *xobjects = NULL;
-	int bounds[4];
+	struct pdf_obj *page, *contents_ref, *refs;
+	struct pdf_resources *resources;
+	struct pdf_triage triage;
+	struct ps_segment *segs;
+	size_t cnt;
+	int bounds[4], ret = 0;
 
 	page = pdf_get_page(pdf, page_idx);
 	PDF_ERRIF(!page, -1, "failed to retrieve page %d\n", page_idx);
@@ -103,49 +224,89 @@ int page_draw(struct pdf *pdf, int page_idx)
 	PDF_LOG("bounds: [%d %d %d %d]\n", bounds[0], bounds[1], bounds[2],
 	        bounds[3]);
 
-	resources = pdf_dict_find_deref(pdf, &page->dict, "Resources");
-	if (resources) {
-		PDF_ERRIF(resources->type != PDF_OBJ_DICT, -1,
-		          "Page Resources is not a dict\n");
-		for (size_t i = 0; i < resources->dict.sz; ++i) {
-			if (strcmp(resources->dict.entries[i].name, "XObject") == 0) {
-				struct pdf_obj *xobjs = &resources->dict.entries[i].obj;
-				PDF_ERRIF(xobjs->type != PDF_OBJ_DICT, -1,
-				          "Page Resources XObject is not a dict\n");
-				xobjects = &xobjs->dict;
-				break;
-			}
-		}
-	}
+	PDF_ERRIF(pdf_page_triage(pdf, page_idx, &triage), -1,
+	          "failed to triage page %d\n", page_idx);
+	PDF_LOG("extent: [%g %g %g %g]%s%s%s\n", triage.bbox[0], triage.bbox[1],
+	        triage.bbox[2], triage.bbox[3],
+	        triage.flags & PDF_TRIAGE_TEXT ? " text" : "",
+	        triage.flags & PDF_TRIAGE_VECTOR ? " vector" : "",
+	        triage.flags & PDF_TRIAGE_IMAGE ? " image" : "");
+
+	resources = pdf_get_page_resources(pdf, page_idx);
 
 	contents_ref = pdf_dict_find(&page->dict, "Contents");
 	PDF_ERRIF(!contents_ref, -1, "failed to retrieve Page Contents\n");
 	if (contents_ref->type == PDF_OBJ_ARR) {
-		for (size_t i = 0; i < contents_ref->arr.sz; ++i) {
-			struct pdf_obj *elem = contents_ref->arr.entries+i;
-			PDF_ERRIF(elem->type != PDF_OBJ_REF, -1,
-			          "Page Contents array element is not a valid type\n");
-			if (!PDF_OK(obj_draw(pdf, elem->ref.id, xobjects, 0)))
-				PDF_ERR(-1, "Failed to draw page contents array element\n");
-		}
+		refs = contents_ref->arr.entries;
+		cnt = contents_ref->arr.sz;
 	} else if (contents_ref->type == PDF_OBJ_REF) {
-		if (!PDF_OK(obj_draw(pdf, contents_ref->ref.id, xobjects, 0)))
-			PDF_ERR(-1, "Failed to draw page contents\n");
+		refs = contents_ref;
+		cnt = 1;
 	} else
 		PDF_ERR(-1, "Page Contents is not a valid type\n");
+
+	/* the parts of a Contents array are one stream, split between tokens */
+	segs = PDF_MALLOC(cnt * sizeof(struct ps_segment));
+	for (size_t i = 0; i < cnt && PDF_OK(ret); ++i) {
+		struct pdf_baseobj *part = NULL;
+		if (refs[i].type == PDF_OBJ_REF)
+			part = pdf_get_baseobj(pdf, refs[i].ref.id);
+		if (!part || !part->stream || part->stream_type != PDF_STREAM_CMD) {
+			PDF_LOG("Page Contents part %zu is not a content stream\n", i);
+			ret = -1;
+		} else {
+			segs[i].str = part->stream;
+			segs[i].sz = part->stream_sz;
+		}
+	}
+	if (PDF_OK(ret) && !PDF_OK(stream_draw(pdf, segs, cnt, resources, 0))) {
+		PDF_LOG("Failed to draw page contents\n");
+		ret = -1;
+	}
+	if (PDF_OK(ret) && !PDF_OK(text_draw(segs, cnt, text))) {
+		PDF_LOG("Failed to extract page contents text\n");
+		ret = -1;
+	}
+	PDF_FREE(segs);
+	return ret;
+}
+
+/*
+ * A Contents array may split the stream anywhere between tokens, but an
+ * inline image and its EI stay in one part.  The last chain breaks that
+ * rule and has to fail cleanly.
+ */
+int chain_draw(void)
+{
+	char a[] = "q 1 0 0 1 5 5", b[] = "cm BI /W 2 /H 1 /L 2 ID xy EI",
+	     c[] = "Q", d[] = "q BI /W 1 /H 1 /L 3 ID xyz", e[] = "Q EI";
+	struct ps_segment good[] = { { a, sizeof(a) - 1 }, { b, sizeof(b) - 1 },
+	                             { c, sizeof(c) - 1 } };
+	struct ps_segment bad[] = { { d, sizeof(d) - 1 }, { e, sizeof(e) - 1 } };
+
+	PDF_ERRIF(!PDF_OK(stream_draw(NULL, good, 3, NULL, 0)), 1,
+	          "split contents failed\n");
+	stream_draw(NULL, bad, 2, NULL, 0);
 	return 0;
 }
 
 int main(int argc, const char *argv[])
 {
 	struct pdf pdf = {0};
+	struct ps_text_buf text = {0};
+	struct pdf_image_cache_stats image_stats;
+	struct pdf_obj_share_stats share_stats;
 	int ret = 1, pages;
 	if (argc != 2) {
-		printf("Usage: parse <file.pdf>\n");
+		printf("Usage: parse <file.pdf>\n"
+		       "       parse --chain\n");
 		return 1;
 	}
+	if (strcmp(argv[1], "--chain") == 0)
+		return chain_draw();
 	if (!PDF_OK(pdf_init_from_file(&pdf, argv[1])))
 		goto out;
+	pdf_obj_share(&pdf, 1);
 
 	printf("version: '%u'\n", pdf.version);
 	for (size_t i = 0; i < pdf.xref_tbl_sz; ++i) {
@@ -158,11 +319,18 @@ int main(int argc, const char *argv[])
 	printf("pages: %d\n", pages);
 	for (int i = 0; i < pages; ++i) {
 		printf("page %d:\n", i);
-		page_draw(&pdf, i);
+		page_draw(&pdf, i, &text);
 	}
+	pdf_image_cache_stats(&pdf, &image_stats);
+	printf("image cache: %zu hits, %zu misses, %zu bytes\n",
+	       image_stats.hits, image_stats.misses, image_stats.bytes);
+	pdf_obj_share_stats(&pdf, &share_stats);
+	printf("obj sharing: %zu hits, %zu misses, %zu bytes saved\n",
+	       share_stats.hits, share_stats.misses, share_stats.bytes);
 	ret = 0;
 
 out:
+	ps_text_buf_free(&text);
 	pdf_free(&pdf);
 	return ret;
 }